@@ -0,0 +1,372 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include "BodyStore.h"
+#include "ThreadPool.h"
+#include "MortonSort.h"
+
+// Per-node data the traversal touches, kept compact so a target's walk stays in cache
+struct BarnesHutNode {
+    double comX, comY, comZ;
+    double mu;
+    double openDistance2;   // (l / theta + delta)^2, a target closer than this has to open the node
+    uint32_t first, count;  // Range of the node's bodies in sorted order
+    uint32_t skip;          // Index of the first node after this subtree
+    uint32_t isLeaf;
+};
+
+/// <summary>
+/// Barnes-Hut octree over a range of gravity sources. Sources are ordered along a Morton curve, so
+/// every node covers a contiguous run of them and the tree is stored depth-first with skip links,
+/// which makes the traversal a single stackless loop. Nodes use their tight bounding box with the
+/// opening test d > l / theta + delta (delta being the offset of the centre of mass from the box
+/// centre), which stays safe when the topology is refitted to moved bodies. Large trees are built and fitted
+/// in parallel below the first few levels: each subtree there is built on its own and copied into place, and
+/// fitting runs the subtrees in parallel before the handful of nodes above them. A strongly clustered system can
+/// still leave most of the work in one subtree.
+/// </summary>
+class BarnesHutTree
+{
+private:
+    static constexpr size_t LeafSize = 8;
+
+    std::vector<BarnesHutNode> nodes;
+    std::vector<BodyBounds> bounds; // Tight bounds of each node, only needed while building or refitting
+    MortonSort morton;
+    std::vector<uint32_t> order;
+    AlignedDoubles sortedX, sortedY, sortedZ, sortedMu;
+
+    // A subtree below the split level, built into its own array and then copied into nodes at offset
+    struct Subtree {
+        uint32_t begin, end;
+        int level;
+        size_t offset;
+        std::vector<BarnesHutNode> nodes;
+    };
+
+    static constexpr size_t ParallelBuildSize = 4096;   // Fewer sources than this are built serially
+
+    std::vector<Subtree> subtrees;
+    int splitLevel = -1;    // Level the last Build handed to the pool, -1 if it built everything serially
+
+    bool IsLeaf(uint32_t begin, uint32_t end, int level) const
+    {
+        return end - begin <= LeafSize || level == MortonSort::MaxDepth;
+    }
+
+    // Appends the subtree over sorted bodies [begin, end) to out depth-first, indices relative to the start of out
+    uint32_t BuildNode(std::vector<BarnesHutNode>& out, uint32_t begin, uint32_t end, int level) const
+    {
+        uint32_t index = (uint32_t)out.size();
+        out.push_back({});
+        if (IsLeaf(begin, end, level)) {
+            out[index].first = begin;
+            out[index].count = end - begin;
+            out[index].isLeaf = 1;
+        }
+        else {
+            uint32_t childBegin = begin;
+            for (uint64_t octant = 0; octant < 8 && childBegin < end; octant++)
+            {
+                uint32_t childEnd = morton.OctantEnd(childBegin, end, level, octant);
+                if (childEnd > childBegin) {
+                    BuildNode(out, childBegin, childEnd, level + 1);
+                }
+                childBegin = childEnd;
+            }
+            out[index].first = begin;
+            out[index].count = end - begin;
+            out[index].isLeaf = 0;
+        }
+        out[index].skip = (uint32_t)out.size();
+        return index;
+    }
+
+    // Lists, in depth-first order, the subtrees at the split level and the leaves above it
+    void FindSubtrees(uint32_t begin, uint32_t end, int level)
+    {
+        if (level == splitLevel || IsLeaf(begin, end, level)) {
+            subtrees.push_back({ begin, end, level, 0, {} });
+            return;
+        }
+        uint32_t childBegin = begin;
+        for (uint64_t octant = 0; octant < 8 && childBegin < end; octant++)
+        {
+            uint32_t childEnd = morton.OctantEnd(childBegin, end, level, octant);
+            if (childEnd > childBegin) {
+                FindSubtrees(childBegin, childEnd, level + 1);
+            }
+            childBegin = childEnd;
+        }
+    }
+
+    // Builds the nodes above the split level, leaving room for each subtree where it belongs depth-first
+    void BuildTop(uint32_t begin, uint32_t end, int level, size_t& next)
+    {
+        if (level == splitLevel || IsLeaf(begin, end, level)) {
+            Subtree& subtree = subtrees[next++];
+            subtree.offset = nodes.size();
+            nodes.resize(nodes.size() + subtree.nodes.size());
+            return;
+        }
+        uint32_t index = (uint32_t)nodes.size();
+        nodes.push_back({});
+        uint32_t childBegin = begin;
+        for (uint64_t octant = 0; octant < 8 && childBegin < end; octant++)
+        {
+            uint32_t childEnd = morton.OctantEnd(childBegin, end, level, octant);
+            if (childEnd > childBegin) {
+                BuildTop(childBegin, childEnd, level + 1, next);
+            }
+            childBegin = childEnd;
+        }
+        nodes[index].first = begin;
+        nodes[index].count = end - begin;
+        nodes[index].isLeaf = 0;
+        nodes[index].skip = (uint32_t)nodes.size();
+    }
+
+    // Runs work on every subtree, each participant taking the next one nobody has claimed, as their sizes vary widely
+    template <typename Work>
+    void ForEachSubtree(ThreadPool& pool, Work&& work)
+    {
+        std::atomic<size_t> next{ 0 };
+        auto job = [&](int) {
+            for (size_t k = next.fetch_add(1, std::memory_order_relaxed); k < subtrees.size(); k = next.fetch_add(1, std::memory_order_relaxed))
+            {
+                work(subtrees[k]);
+            }
+            };
+        pool.Run(job);
+    }
+
+    // Same layout as one serial BuildNode from the root, with the subtrees below the split level built in parallel
+    void BuildAll(size_t n, ThreadPool& pool)
+    {
+        const size_t participants = (size_t)pool.GetNumberOfParticipants();
+        subtrees.clear();
+        if (participants == 1 || n < ParallelBuildSize) {
+            splitLevel = -1;
+            BuildNode(nodes, 0, (uint32_t)n, 0);
+            bounds.resize(nodes.size());
+            return;
+        }
+        // Deep enough for several subtrees per participant if the bodies were spread evenly
+        splitLevel = 1;
+        while (splitLevel < 4 && (size_t(1) << (3 * splitLevel)) < 8 * participants)
+        {
+            splitLevel++;
+        }
+        FindSubtrees(0, (uint32_t)n, 0);
+        ForEachSubtree(pool, [&](Subtree& subtree) {
+            subtree.nodes.clear();
+            BuildNode(subtree.nodes, subtree.begin, subtree.end, subtree.level);
+            });
+        size_t next = 0;
+        BuildTop(0, (uint32_t)n, 0, next);
+        ForEachSubtree(pool, [&](Subtree& subtree) {
+            const uint32_t offset = (uint32_t)subtree.offset;
+            for (size_t i = 0; i < subtree.nodes.size(); i++)
+            {
+                BarnesHutNode& node = nodes[offset + i];
+                node = subtree.nodes[i];
+                node.skip += offset;
+            }
+            });
+        bounds.resize(nodes.size());
+    }
+
+    // Recomputes the monopole, bounds and opening distance of one node from its bodies or children
+    void FitNode(uint32_t index, double theta)
+    {
+        BarnesHutNode& node = nodes[index];
+        BodyBounds& box = bounds[index];
+        double mu = 0, cx = 0, cy = 0, cz = 0;
+        box = BodyBounds::Empty();
+        if (node.isLeaf) {
+            for (uint32_t b = node.first; b < node.first + node.count; b++)
+            {
+                mu += sortedMu[b];
+                cx += sortedMu[b] * sortedX[b];
+                cy += sortedMu[b] * sortedY[b];
+                cz += sortedMu[b] * sortedZ[b];
+                box.Add(sortedX[b], sortedY[b], sortedZ[b]);
+            }
+        }
+        else {
+            for (uint32_t child = index + 1; child < node.skip; child = nodes[child].skip)
+            {
+                const BarnesHutNode& c = nodes[child];
+                mu += c.mu;
+                cx += c.mu * c.comX;
+                cy += c.mu * c.comY;
+                cz += c.mu * c.comZ;
+                box.Add(bounds[child]);
+            }
+        }
+        // A node whose bodies all sit on one point (typically a single-body leaf) takes that point exactly, the
+        // rounding in cx / mu could otherwise move it off a target that is the body itself and let it be accepted
+        if (mu > 0 && (box.minX != box.maxX || box.minY != box.maxY || box.minZ != box.maxZ)) {
+            node.comX = cx / mu;
+            node.comY = cy / mu;
+            node.comZ = cz / mu;
+        }
+        else {
+            node.comX = 0.5 * (box.minX + box.maxX);
+            node.comY = 0.5 * (box.minY + box.maxY);
+            node.comZ = 0.5 * (box.minZ + box.maxZ);
+        }
+        node.mu = mu;
+        double size = std::max({ box.maxX - box.minX, box.maxY - box.minY, box.maxZ - box.minZ });
+        double ox = node.comX - 0.5 * (box.minX + box.maxX);
+        double oy = node.comY - 0.5 * (box.minY + box.maxY);
+        double oz = node.comZ - 0.5 * (box.minZ + box.maxZ);
+        double openDistance = size / theta + std::sqrt(ox * ox + oy * oy + oz * oz);
+        node.openDistance2 = openDistance * openDistance;
+    }
+
+    void GatherSorted(const StageView& s, const double* mu, size_t sourceBegin, ThreadPool& pool)
+    {
+        pool.ParallelFor(order.size(), [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; i++)
+            {
+                size_t source = sourceBegin + order[i];
+                sortedX[i] = s.x[source];
+                sortedY[i] = s.y[source];
+                sortedZ[i] = s.z[source];
+                sortedMu[i] = mu[source];
+            }
+            });
+    }
+
+    void FitAll(double theta, ThreadPool& pool)
+    {
+        // Children always follow their parent in depth-first order, so a reverse sweep is bottom-up
+        if (splitLevel < 0) {
+            for (size_t i = nodes.size(); i-- > 0;)
+            {
+                FitNode((uint32_t)i, theta);
+            }
+            return;
+        }
+        // Subtrees are independent, so they can be swept in parallel and then the nodes above them in reverse order
+        ForEachSubtree(pool, [&](const Subtree& subtree) {
+            for (size_t i = subtree.offset + subtree.nodes.size(); i-- > subtree.offset;)
+            {
+                FitNode((uint32_t)i, theta);
+            }
+            });
+        size_t i = nodes.size();
+        for (size_t k = subtrees.size(); k-- > 0;)
+        {
+            const Subtree& subtree = subtrees[k];
+            while (i > subtree.offset + subtree.nodes.size())
+            {
+                FitNode((uint32_t)--i, theta);
+            }
+            i = subtree.offset;
+        }
+        while (i > 0)
+        {
+            FitNode((uint32_t)--i, theta);
+        }
+    }
+
+public:
+    // Largest opening angle for which a node containing the target is guaranteed to be opened
+    static constexpr double MaxTheta = 1.0;
+
+    size_t GetNumberOfNodes() const
+    {
+        return nodes.size();
+    }
+
+    bool IsKeyOrderSorted() const
+    {
+        return morton.IsSorted();
+    }
+
+    // Rebuilds the tree over sources [sourceBegin, sourceEnd) at the stage positions
+    void Build(const StageView& s, const double* mu, size_t sourceBegin, size_t sourceEnd, double theta, ThreadPool& pool)
+    {
+        nodes.clear();
+        bounds.clear();
+        size_t n = sourceEnd - sourceBegin;
+        order.resize(n);
+        sortedX.resize(n); sortedY.resize(n); sortedZ.resize(n); sortedMu.resize(n);
+        if (n == 0)
+            return;
+
+        morton.Sort(s, sourceBegin, sourceEnd, pool);
+        for (size_t i = 0; i < n; i++)
+        {
+            order[i] = morton.keys[i].second;
+        }
+
+        GatherSorted(s, mu, sourceBegin, pool);
+        BuildAll(n, pool);
+        FitAll(theta, pool);
+    }
+
+    // Keeps the topology from the last Build and refits every node to the sources' new positions
+    void Refit(const StageView& s, const double* mu, size_t sourceBegin, double theta, ThreadPool& pool)
+    {
+        if (nodes.empty())
+            return;
+        GatherSorted(s, mu, sourceBegin, pool);
+        FitAll(theta, pool);
+    }
+
+    // Acceleration on targets [targetBegin, targetEnd) from every source in the tree
+    void Accumulate(const StageView& s, size_t targetBegin, size_t targetEnd) const
+    {
+        const size_t numberOfNodes = nodes.size();
+        for (size_t t = targetBegin; t < targetEnd; t++)
+        {
+            const double xt = s.x[t], yt = s.y[t], zt = s.z[t];
+            double ax = 0, ay = 0, az = 0;
+            size_t index = 0;
+            while (index < numberOfNodes)
+            {
+                const BarnesHutNode& node = nodes[index];
+                double dx = node.comX - xt;
+                double dy = node.comY - yt;
+                double dz = node.comZ - zt;
+                double d2 = dx * dx + dy * dy + dz * dz;
+                if (d2 > node.openDistance2) {
+                    double f = node.mu / (d2 * std::sqrt(d2));
+                    ax += dx * f;
+                    ay += dy * f;
+                    az += dz * f;
+                    index = node.skip;
+                }
+                else if (node.isLeaf) {
+                    for (uint32_t b = node.first; b < node.first + node.count; b++)
+                    {
+                        double bx = sortedX[b] - xt;
+                        double by = sortedY[b] - yt;
+                        double bz = sortedZ[b] - zt;
+                        double r2 = bx * bx + by * by + bz * bz;
+                        if (r2 <= 0.0)
+                            continue;
+                        double f = sortedMu[b] / (r2 * std::sqrt(r2));
+                        ax += bx * f;
+                        ay += by * f;
+                        az += bz * f;
+                    }
+                    index = node.skip;
+                }
+                else {
+                    index++;
+                }
+            }
+            s.ax[t] += ax;
+            s.ay[t] += ay;
+            s.az[t] += az;
+        }
+    }
+};
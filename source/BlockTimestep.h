@@ -0,0 +1,262 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include "BodyStore.h"
+#include "ThreadPool.h"
+
+/// <summary>
+/// Fourth-order Hermite integrator with individual power-of-two block time steps (Aarseth style). Every
+/// body keeps its own step h / 2^level inside a cycle of length h. At each block time only the bodies
+/// due there ("active") have their acceleration and jerk evaluated, against sources predicted to that
+/// time by their Taylor series; the active bodies are then corrected and given a new step from the
+/// Aarseth criterion. Times are counted in integer ticks so block boundaries are exact. Each cycle
+/// starts and ends with every body synchronised, which is what lets RunSimulation hand the store back
+/// to the objects after it.
+/// </summary>
+class BlockHermiteIntegrator
+{
+private:
+    static constexpr int MaxLevel = 20;                      // Finest step is h / 2^20
+    static constexpr uint64_t CycleTicks = uint64_t(1) << MaxLevel;
+    static constexpr size_t ParallelThreshold = 1 << 14;     // Active pair count below which the pool is not worth waking
+
+    // Start-of-step state of every body: acceleration and jerk at its own time
+    AlignedDoubles ax, ay, az;
+    AlignedDoubles jx, jy, jz;
+    // Positions and velocities predicted to the current block time
+    AlignedDoubles px, py, pz;
+    AlignedDoubles pvx, pvy, pvz;
+    // Acceleration and jerk of the active bodies at the current block time
+    AlignedDoubles ax1, ay1, az1;
+    AlignedDoubles jx1, jy1, jz1;
+    std::vector<uint64_t> time, step;   // In ticks of h / 2^MaxLevel
+    std::vector<uint32_t> active;
+
+    size_t targetEvaluations = 0;
+    size_t sharedStepEvaluations = 0;
+
+    void Resize(size_t n)
+    {
+        for (AlignedDoubles* array : { &ax, &ay, &az, &jx, &jy, &jz, &px, &py, &pz, &pvx, &pvy, &pvz, &ax1, &ay1, &az1, &jx1, &jy1, &jz1 })
+        {
+            array->resize(n);
+        }
+        time.resize(n);
+        step.resize(n);
+    }
+
+    // Taylor prediction of body i from its own time to block time t
+    void Predict(const BodyStore& bodies, size_t i, uint64_t t, double tick)
+    {
+        const double d = (double)(t - time[i]) * tick;
+        const double d2 = d * d * 0.5, d3 = d * d * d / 6.0;
+        px[i] = bodies.x[i] + bodies.vx[i] * d + ax[i] * d2 + jx[i] * d3;
+        py[i] = bodies.y[i] + bodies.vy[i] * d + ay[i] * d2 + jy[i] * d3;
+        pz[i] = bodies.z[i] + bodies.vz[i] * d + az[i] * d2 + jz[i] * d3;
+        pvx[i] = bodies.vx[i] + ax[i] * d + jx[i] * d2;
+        pvy[i] = bodies.vy[i] + ay[i] * d + jy[i] * d2;
+        pvz[i] = bodies.vz[i] + az[i] * d + jz[i] * d2;
+    }
+
+    // Acceleration and jerk of body i from the predicted massive bodies, plus its external acceleration
+    void Evaluate(const BodyStore& bodies, size_t i)
+    {
+        const double xi = px[i], yi = py[i], zi = pz[i];
+        const double vxi = pvx[i], vyi = pvy[i], vzi = pvz[i];
+        double sax = bodies.extAx[i], say = bodies.extAy[i], saz = bodies.extAz[i];
+        double sjx = 0, sjy = 0, sjz = 0;
+        for (size_t j = 0; j < bodies.massiveCount; j++)
+        {
+            double dx = px[j] - xi, dy = py[j] - yi, dz = pz[j] - zi;
+            double r2 = dx * dx + dy * dy + dz * dz;
+            if (r2 <= 0.0)
+                continue;
+            double dvx = pvx[j] - vxi, dvy = pvy[j] - vyi, dvz = pvz[j] - vzi;
+            double rinv2 = 1.0 / r2;
+            double f = bodies.mu[j] * rinv2 * std::sqrt(rinv2);
+            double rv = 3.0 * (dx * dvx + dy * dvy + dz * dvz) * rinv2;
+            sax += f * dx;
+            say += f * dy;
+            saz += f * dz;
+            sjx += f * (dvx - rv * dx);
+            sjy += f * (dvy - rv * dy);
+            sjz += f * (dvz - rv * dz);
+        }
+        ax1[i] = sax; ay1[i] = say; az1[i] = saz;
+        jx1[i] = sjx; jy1[i] = sjy; jz1[i] = sjz;
+    }
+
+    void EvaluateActive(const BodyStore& bodies, ThreadPool& pool)
+    {
+        targetEvaluations += active.size();
+        if (active.size() * bodies.massiveCount < ParallelThreshold || pool.GetNumberOfParticipants() == 1) {
+            for (uint32_t i : active)
+            {
+                Evaluate(bodies, i);
+            }
+            return;
+        }
+        pool.ParallelFor(active.size(), [this, &bodies](size_t begin, size_t end, int) {
+            for (size_t k = begin; k < end; k++)
+            {
+                Evaluate(bodies, active[k]);
+            }
+            });
+    }
+
+    // Largest power-of-two number of ticks no longer than dt
+    static uint64_t PowerOfTwoTicks(double dt, double tick)
+    {
+        uint64_t s = CycleTicks;
+        const double ticks = dt / tick;
+        while (s > 1 && (double)s > ticks)
+        {
+            s >>= 1;
+        }
+        return s;
+    }
+
+    // Largest power-of-two step no longer than dt that the body's current time is a multiple of, and at most
+    // twice its previous step. step[i] == 0 means the body has no step yet
+    uint64_t QuantizeStep(size_t i, double dt, double tick) const
+    {
+        uint64_t s = PowerOfTwoTicks(dt, tick);
+        if (step[i] != 0) {
+            s = std::min(s, 2 * step[i]);
+        }
+        while (s > 1 && time[i] % s != 0)
+        {
+            s >>= 1;
+        }
+        return s;
+    }
+
+    static double Norm(double x, double y, double z)
+    {
+        return std::sqrt(x * x + y * y + z * z);
+    }
+
+public:
+    // Force evaluations of single bodies since the counters were last reset
+    size_t GetTargetEvaluations() const
+    {
+        return targetEvaluations;
+    }
+
+    // Evaluations a shared step would have needed: every body at the smallest step the criterion chose in each cycle
+    size_t GetSharedStepEvaluations() const
+    {
+        return sharedStepEvaluations;
+    }
+
+    void ResetCounters()
+    {
+        targetEvaluations = 0;
+        sharedStepEvaluations = 0;
+    }
+
+    // Advances every body of the store by h. eta is the accuracy parameter of the Aarseth step criterion
+    void Integrate(BodyStore& bodies, double h, double eta, ThreadPool& pool)
+    {
+        const size_t n = bodies.count;
+        if (n == 0 || h <= 0)
+            return;
+        Resize(n);
+        const double tick = h / (double)CycleTicks;
+
+        // Synchronised start: every body is evaluated at its current state and given a starting step
+        active.resize(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            active[i] = (uint32_t)i;
+            time[i] = 0;
+            step[i] = 0;
+            Predict(bodies, i, 0, tick);
+        }
+        EvaluateActive(bodies, pool);
+        for (size_t i = 0; i < n; i++)
+        {
+            ax[i] = ax1[i]; ay[i] = ay1[i]; az[i] = az1[i];
+            jx[i] = jx1[i]; jy[i] = jy1[i]; jz[i] = jz1[i];
+            double a = Norm(ax[i], ay[i], az[i]);
+            double j = Norm(jx[i], jy[i], jz[i]);
+            // The usual conservative starting step, half the accuracy parameter times the jerk time scale
+            step[i] = QuantizeStep(i, j > 0 ? 0.5 * eta * a / j : h, tick);
+        }
+
+        // Smallest step the criterion asked for, the one a shared step would be held to. The cautious starting steps
+        // and the doubling limit only hold bodies below it for a few steps, so they are left out
+        uint64_t finest = CycleTicks;
+
+        uint64_t now = 0;
+        while (now < CycleTicks)
+        {
+            uint64_t next = CycleTicks;
+            for (size_t i = 0; i < n; i++)
+            {
+                next = std::min(next, time[i] + step[i]);
+            }
+            active.clear();
+            for (size_t i = 0; i < n; i++)
+            {
+                if (time[i] + step[i] == next) {
+                    active.push_back((uint32_t)i);
+                }
+            }
+            // Sources are needed at the block time whether active or not; massless bodies only when active
+            for (size_t i = 0; i < bodies.massiveCount; i++)
+            {
+                Predict(bodies, i, next, tick);
+            }
+            for (uint32_t i : active)
+            {
+                if (i >= bodies.massiveCount) {
+                    Predict(bodies, i, next, tick);
+                }
+            }
+            EvaluateActive(bodies, pool);
+
+            for (uint32_t i : active)
+            {
+                const double dt = (double)step[i] * tick;
+                const double dt2 = dt * dt, dt3 = dt2 * dt;
+                // Second and third derivatives of the acceleration at the start of the step, from the Hermite interpolant
+                double a2x = (-6.0 * (ax[i] - ax1[i]) - dt * (4.0 * jx[i] + 2.0 * jx1[i])) / dt2;
+                double a2y = (-6.0 * (ay[i] - ay1[i]) - dt * (4.0 * jy[i] + 2.0 * jy1[i])) / dt2;
+                double a2z = (-6.0 * (az[i] - az1[i]) - dt * (4.0 * jz[i] + 2.0 * jz1[i])) / dt2;
+                double a3x = (12.0 * (ax[i] - ax1[i]) + 6.0 * dt * (jx[i] + jx1[i])) / dt3;
+                double a3y = (12.0 * (ay[i] - ay1[i]) + 6.0 * dt * (jy[i] + jy1[i])) / dt3;
+                double a3z = (12.0 * (az[i] - az1[i]) + 6.0 * dt * (jz[i] + jz1[i])) / dt3;
+
+                const double c4 = dt2 * dt2 / 24.0, c5 = dt2 * dt3 / 120.0;
+                const double d3 = dt3 / 6.0, d4 = dt2 * dt2 / 24.0;
+                bodies.x[i] = px[i] + a2x * c4 + a3x * c5;
+                bodies.y[i] = py[i] + a2y * c4 + a3y * c5;
+                bodies.z[i] = pz[i] + a2z * c4 + a3z * c5;
+                bodies.vx[i] = pvx[i] + a2x * d3 + a3x * d4;
+                bodies.vy[i] = pvy[i] + a2y * d3 + a3y * d4;
+                bodies.vz[i] = pvz[i] + a2z * d3 + a3z * d4;
+
+                ax[i] = ax1[i]; ay[i] = ay1[i]; az[i] = az1[i];
+                jx[i] = jx1[i]; jy[i] = jy1[i]; jz[i] = jz1[i];
+                time[i] = next;
+
+                // Aarseth criterion with the snap and crackle carried to the end of the step
+                a2x += a3x * dt; a2y += a3y * dt; a2z += a3z * dt;
+                double a1n = Norm(ax[i], ay[i], az[i]);
+                double j1n = Norm(jx[i], jy[i], jz[i]);
+                double a2n = Norm(a2x, a2y, a2z);
+                double a3n = Norm(a3x, a3y, a3z);
+                double denominator = j1n * a3n + a2n * a2n;
+                double desired = denominator > 0 ? std::sqrt(eta * (a1n * a2n + j1n * j1n) / denominator) : h;
+                step[i] = QuantizeStep(i, desired, tick);
+                finest = std::min(finest, PowerOfTwoTicks(desired, tick));
+            }
+            now = next;
+        }
+        sharedStepEvaluations += n * (size_t)(CycleTicks / finest);
+    }
+};
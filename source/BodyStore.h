@@ -0,0 +1,123 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+#include <new>
+
+// Minimal over-aligned allocator so every array in the body store starts on a cache line,
+// which keeps aligned SIMD loads legal on the first element of each array.
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+    AlignedAllocator() noexcept = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T* ptr, std::size_t) noexcept {
+        ::operator delete(ptr, std::align_val_t(Alignment));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const noexcept { return false; }
+};
+
+using AlignedDoubles = std::vector<double, AlignedAllocator<double>>;
+
+// Positions and accumulated accelerations for a single force evaluation
+struct BodyStage {
+    AlignedDoubles x, y, z;
+    AlignedDoubles ax, ay, az;
+
+    void Resize(size_t n) {
+        x.resize(n); y.resize(n); z.resize(n);
+        ax.assign(n, 0.0); ay.assign(n, 0.0); az.assign(n, 0.0);
+    }
+
+    void ClearAcceleration() {
+        std::fill(ax.begin(), ax.end(), 0.0);
+        std::fill(ay.begin(), ay.end(), 0.0);
+        std::fill(az.begin(), az.end(), 0.0);
+    }
+};
+
+// Private acceleration accumulator for one thread of a parallel force evaluation
+struct AccelerationBuffer {
+    AlignedDoubles ax, ay, az;
+
+    void Resize(size_t n) {
+        ax.assign(n, 0.0); ay.assign(n, 0.0); az.assign(n, 0.0);
+    }
+};
+
+// Raw pointers into one stage, handed to the force kernels so the inner loops never touch a std::vector
+struct StageView {
+    const double* x;
+    const double* y;
+    const double* z;
+    double* ax;
+    double* ay;
+    double* az;
+};
+
+/// <summary>
+/// Structure-of-arrays copy of every simulated body. Gravitational (massive) bodies occupy
+/// slots [0, massiveCount) and massless test particles occupy [massiveCount, count), so the
+/// set of gravity sources is always a contiguous prefix. PhysicsObject::storeIndex maps a
+/// handle back to its slot.
+/// </summary>
+struct BodyStore {
+    // Stage 0 is used by the single-evaluation integrators, stages 1..4 by RK4 and 1..7 by Dormand-Prince
+    static constexpr int NumStages = 8;
+
+    size_t count = 0;
+    size_t massiveCount = 0;
+    AlignedDoubles x, y, z;
+    AlignedDoubles vx, vy, vz;
+    AlignedDoubles m, mu;
+    AlignedDoubles extAx, extAy, extAz;
+    BodyStage stages[NumStages];
+
+    void Resize(size_t n, size_t massive) {
+        count = n;
+        massiveCount = massive;
+        x.resize(n); y.resize(n); z.resize(n);
+        vx.resize(n); vy.resize(n); vz.resize(n);
+        m.resize(n); mu.resize(n);
+        extAx.resize(n); extAy.resize(n); extAz.resize(n);
+        for (BodyStage& stage : stages) {
+            stage.Resize(n);
+        }
+    }
+
+    // Stages 0 and 1 are evaluated at the start-of-step positions, later RK stages at their own trial positions
+    StageView View(int stage) {
+        BodyStage& s = stages[stage];
+        if (stage <= 1) {
+            return { x.data(), y.data(), z.data(), s.ax.data(), s.ay.data(), s.az.data() };
+        }
+        return { s.x.data(), s.y.data(), s.z.data(), s.ax.data(), s.ay.data(), s.az.data() };
+    }
+
+    // Exchanges the state of two slots; the stages are scratch and are left alone
+    void Swap(size_t i, size_t j) {
+        for (AlignedDoubles* array : { &x, &y, &z, &vx, &vy, &vz, &m, &mu, &extAx, &extAy, &extAz }) {
+            std::swap((*array)[i], (*array)[j]);
+        }
+    }
+
+    void ClearAccelerations() {
+        for (BodyStage& stage : stages) {
+            stage.ClearAcceleration();
+        }
+    }
+};
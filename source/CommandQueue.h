@@ -0,0 +1,132 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+class PhysicsObject;
+
+/// <summary>
+/// Bounded multi-producer queue (Vyukov's bounded MPMC queue) of trivially copyable items. Each slot carries a
+/// sequence number that tells producers and the consumer whose turn it is, so a push or pop is one compare-and-swap
+/// on the shared position plus a store to the slot; nobody ever waits on a lock, and a full queue refuses the push
+/// instead of blocking. Capacity must be a power of two.
+/// </summary>
+template<typename T, size_t Capacity>
+class BoundedQueue
+{
+private:
+    static_assert((Capacity & (Capacity - 1)) == 0, "BoundedQueue capacity must be a power of two");
+    static constexpr size_t Mask = Capacity - 1;
+
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    Slot slots[Capacity];
+    // On their own cache lines, so producers bumping one do not evict the consumer's
+    alignas(64) std::atomic<size_t> enqueuePosition{ 0 };
+    alignas(64) std::atomic<size_t> dequeuePosition{ 0 };
+
+public:
+    BoundedQueue()
+    {
+        for (size_t i = 0; i < Capacity; i++)
+        {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Whether item was queued; false when the queue is full
+    bool TryPush(const T& item)
+    {
+        size_t position = enqueuePosition.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Slot& slot = slots[position & Mask];
+            const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            const ptrdiff_t difference = (ptrdiff_t)sequence - (ptrdiff_t)position;
+            if (difference == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    slot.item = item;
+                    slot.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0) {
+                return false;
+            }
+            else {
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Whether an item was taken into item; false when the queue is empty
+    bool TryPop(T& item)
+    {
+        size_t position = dequeuePosition.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Slot& slot = slots[position & Mask];
+            const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            const ptrdiff_t difference = (ptrdiff_t)sequence - (ptrdiff_t)(position + 1);
+            if (difference == 0) {
+                if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    item = slot.item;
+                    slot.sequence.store(position + Capacity, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (difference < 0) {
+                return false;
+            }
+            else {
+                position = dequeuePosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+enum class SimulatorCommandType {
+    SetTimeWarp,        // timeWarp = value
+    ScaleTimeWarp,      // timeWarp *= value, no lower than 0.01
+    ScaleSubsteps,      // substeps *= value, or rkfTolerance /= value with useRKF, no looser than 1e-3
+    SetPaused,          // paused = value != 0
+    TogglePause,
+    Select,             // selectedObject = object, noneObject when null
+    SelectNext,         // Selection moved value places along allObjects, wrapping
+    SetReference,       // object->referenceObject = target
+    AddObject,
+    RemoveObject,
+    SetSetting          // The setting named by setting = value
+};
+
+// Simulator fields the UI edits that the simulation thread reads mid-step
+enum class SimulatorSetting { PositionStoreDelay, NumberOfStoredPositions, OnRails, RegularizeEncounters, RecordTrajectories, DecimateTrails, TrailScale,
+    FmmOrder, FmmTheta };
+
+// One change to the simulator, applied by the simulation thread between frames, see GravitySimulator::Post
+struct SimulatorCommand {
+    SimulatorCommandType type = SimulatorCommandType::TogglePause;
+    double value = 0;
+    PhysicsObject* object = nullptr;
+    PhysicsObject* target = nullptr;
+    SimulatorSetting setting = SimulatorSetting::PositionStoreDelay;
+
+    static SimulatorCommand Make(SimulatorCommandType type, double value = 0, PhysicsObject* object = nullptr, PhysicsObject* target = nullptr)
+    {
+        SimulatorCommand command;
+        command.type = type;
+        command.value = value;
+        command.object = object;
+        command.target = target;
+        return command;
+    }
+
+    static SimulatorCommand Set(SimulatorSetting setting, double value)
+    {
+        SimulatorCommand command = Make(SimulatorCommandType::SetSetting, value);
+        command.setting = setting;
+        return command;
+    }
+};
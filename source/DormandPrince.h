@@ -0,0 +1,147 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+#include "BodyStore.h"
+
+/// <summary>
+/// Stage bookkeeping for the Dormand-Prince 5(4) pair on x'' = a(x). The state of a body is its
+/// position and velocity, so stage k has a velocity V_k (kept here) and an acceleration A_k (the
+/// force kernels' output in BodyStore stage k), and its trial position is x + h sum a_kj V_j. Stage
+/// 7 is evaluated at the accepted fifth-order state, so after Accept() its acceleration is moved
+/// into stage 1 and the next step starts with six evaluations instead of seven.
+/// </summary>
+class DormandPrince
+{
+private:
+    static constexpr int NumStages = 7;
+    // A few ulps of the state itself, so the error test never asks for more than doubles can hold
+    static constexpr double RoundoffFloor = 1e-15;
+
+    // Butcher tableau, a[k][j] for stage k + 1 in terms of stage j + 1
+    static constexpr double a[NumStages][NumStages] = {
+        { 0, 0, 0, 0, 0, 0, 0 },
+        { 1.0 / 5.0, 0, 0, 0, 0, 0, 0 },
+        { 3.0 / 40.0, 9.0 / 40.0, 0, 0, 0, 0, 0 },
+        { 44.0 / 45.0, -56.0 / 15.0, 32.0 / 9.0, 0, 0, 0, 0 },
+        { 19372.0 / 6561.0, -25360.0 / 2187.0, 64448.0 / 6561.0, -212.0 / 729.0, 0, 0, 0 },
+        { 9017.0 / 3168.0, -355.0 / 33.0, 46732.0 / 5247.0, 49.0 / 176.0, -5103.0 / 18656.0, 0, 0 },
+        { 35.0 / 384.0, 0, 500.0 / 1113.0, 125.0 / 192.0, -2187.0 / 6784.0, 11.0 / 84.0, 0 },
+    };
+    // Fifth-order weights minus the embedded fourth-order ones
+    static constexpr double e[NumStages] = {
+        71.0 / 57600.0, 0, -71.0 / 16695.0, 71.0 / 1920.0, -17253.0 / 339200.0, 22.0 / 525.0, -1.0 / 40.0
+    };
+
+    // Velocities of stages 2..7 (index 0 unused: stage 1's velocity is the body's own)
+    AlignedDoubles vx[NumStages], vy[NumStages], vz[NumStages];
+
+    static const double* StageVelocity(const AlignedDoubles* velocities, const AlignedDoubles& own, int k)
+    {
+        return k == 0 ? own.data() : velocities[k].data();
+    }
+
+public:
+    // Stages used in BodyStore, 1..7
+    static constexpr int FirstStage = 1;
+    static constexpr int LastStage = NumStages;
+
+    void Resize(size_t n)
+    {
+        for (int k = 1; k < NumStages; k++)
+        {
+            vx[k].resize(n);
+            vy[k].resize(n);
+            vz[k].resize(n);
+        }
+    }
+
+    // Trial position and velocity of stage (2..7) for a step of h, from the stages before it
+    void TrialState(BodyStore& bodies, int stage, double h)
+    {
+        const double* row = a[stage - 1];
+        BodyStage& target = bodies.stages[stage];
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            double px = 0, py = 0, pz = 0;
+            double qx = 0, qy = 0, qz = 0;
+            for (int j = 0; j < stage - 1; j++)
+            {
+                const BodyStage& previous = bodies.stages[j + 1];
+                px += row[j] * StageVelocity(vx, bodies.vx, j)[i];
+                py += row[j] * StageVelocity(vy, bodies.vy, j)[i];
+                pz += row[j] * StageVelocity(vz, bodies.vz, j)[i];
+                qx += row[j] * previous.ax[i];
+                qy += row[j] * previous.ay[i];
+                qz += row[j] * previous.az[i];
+            }
+            target.x[i] = bodies.x[i] + h * px;
+            target.y[i] = bodies.y[i] + h * py;
+            target.z[i] = bodies.z[i] + h * pz;
+            vx[stage - 1][i] = bodies.vx[i] + h * qx;
+            vy[stage - 1][i] = bodies.vy[i] + h * qy;
+            vz[stage - 1][i] = bodies.vz[i] + h * qz;
+        }
+        target.ClearAcceleration();
+    }
+
+    /// <summary>
+    /// Largest ratio over all bodies of the embedded error estimate to tolerance times the step's own
+    /// change in position or velocity, so each body is held to a relative accuracy of its motion
+    /// whatever its distance from the origin. Accept the step when this is at most 1; as the error
+    /// goes as h^5 and the change as h, the ratio scales as h^4 until it meets the roundoff floor.
+    /// </summary>
+    double ErrorRatio(const BodyStore& bodies, double h, double tolerance) const
+    {
+        const BodyStage& last = bodies.stages[LastStage];
+        double worst = 0;
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            double ex = 0, ey = 0, ez = 0;
+            double fx = 0, fy = 0, fz = 0;
+            for (int k = 0; k < NumStages; k++)
+            {
+                if (e[k] == 0)
+                    continue;
+                const BodyStage& stage = bodies.stages[k + 1];
+                ex += e[k] * StageVelocity(vx, bodies.vx, k)[i];
+                ey += e[k] * StageVelocity(vy, bodies.vy, k)[i];
+                ez += e[k] * StageVelocity(vz, bodies.vz, k)[i];
+                fx += e[k] * stage.ax[i];
+                fy += e[k] * stage.ay[i];
+                fz += e[k] * stage.az[i];
+            }
+            double positionError = h * std::sqrt(ex * ex + ey * ey + ez * ez);
+            double velocityError = h * std::sqrt(fx * fx + fy * fy + fz * fz);
+            double dx = last.x[i] - bodies.x[i], dy = last.y[i] - bodies.y[i], dz = last.z[i] - bodies.z[i];
+            double dvx = vx[LastStage - 1][i] - bodies.vx[i], dvy = vy[LastStage - 1][i] - bodies.vy[i], dvz = vz[LastStage - 1][i] - bodies.vz[i];
+            double positionScale = tolerance * std::sqrt(dx * dx + dy * dy + dz * dz)
+                + RoundoffFloor * std::sqrt(last.x[i] * last.x[i] + last.y[i] * last.y[i] + last.z[i] * last.z[i]);
+            double velocityScale = tolerance * std::sqrt(dvx * dvx + dvy * dvy + dvz * dvz)
+                + RoundoffFloor * std::sqrt(bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i] + bodies.vz[i] * bodies.vz[i]);
+            if (positionError > 0) {
+                worst = std::max(worst, positionScale > 0 ? positionError / positionScale : HUGE_VAL);
+            }
+            if (velocityError > 0) {
+                worst = std::max(worst, velocityScale > 0 ? velocityError / velocityScale : HUGE_VAL);
+            }
+        }
+        return worst;
+    }
+
+    // Moves every body to the fifth-order solution and hands stage 7's acceleration to stage 1
+    void Accept(BodyStore& bodies)
+    {
+        BodyStage& first = bodies.stages[FirstStage];
+        BodyStage& last = bodies.stages[LastStage];
+        std::copy(last.x.begin(), last.x.end(), bodies.x.begin());
+        std::copy(last.y.begin(), last.y.end(), bodies.y.begin());
+        std::copy(last.z.begin(), last.z.end(), bodies.z.begin());
+        std::copy(vx[LastStage - 1].begin(), vx[LastStage - 1].end(), bodies.vx.begin());
+        std::copy(vy[LastStage - 1].begin(), vy[LastStage - 1].end(), bodies.vy.begin());
+        std::copy(vz[LastStage - 1].begin(), vz[LastStage - 1].end(), bodies.vz.begin());
+        first.ax.swap(last.ax);
+        first.ay.swap(last.ay);
+        first.az.swap(last.az);
+    }
+};
@@ -0,0 +1,177 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+#include "triple.h"
+#include "BodyStore.h"
+#include "Kepler.h"
+#include "SourcePaths.h"
+
+class PhysicsObject;
+
+// Per-object state of an Encke-propagated body, kept on the object so it survives repacks of the body store
+struct EnckeState {
+    const PhysicsObject* primary = nullptr;  // Body the reference conic is about, the conic is rectified when it changes
+    triple epochPosition, epochVelocity;     // Osculating state relative to the primary at the reference epoch
+    double elapsed = 0;                      // Time since the reference epoch
+    triple deviation, deviationVelocity;     // Departure from the reference conic
+    triple lastPosition, lastVelocity;       // Inertial state written at the end of the last step, to spot outside changes
+    bool valid = false;
+    size_t rectifications = 0;
+};
+
+/// <summary>
+/// Encke's method for massless bodies close to a dominant primary: the motion relative to the primary is
+/// an osculating two-body conic, advanced analytically with KeplerDrift, plus a deviation integrated with
+/// RK4 under only the perturbing accelerations. Battin's f(q) form keeps the deviation equation free of the
+/// cancellation between two nearly equal central pulls. The conic is rectified to the current state when the
+/// deviation grows past RectifyRatio of the distance, when the primary changes, or when something outside the
+/// propagator (a collision, scenario code) moved the body.
+///
+/// The propagator runs after the step integrator has moved the massive bodies. Their paths inside the step are
+/// Hermite cubics through the start and end states, so the body can take its own substeps, sized to its
+/// distance from the primary and from every perturber rather than to the simulator's step.
+/// </summary>
+class EnckePropagator
+{
+private:
+    static constexpr double RectifyRatio = 1e-3;   // |deviation| / |distance| past which the conic is restarted
+    static constexpr double StepFraction = 0.1;    // Substep as a fraction of the shortest free-fall time scale sqrt(d^3 / mu)
+
+    // Position on the reference conic, and optionally velocity, a given time after its epoch
+    static triple ReferenceConic(double mu, const EnckeState& state, double elapsed, triple* velocity = nullptr)
+    {
+        double x = state.epochPosition.x, y = state.epochPosition.y, z = state.epochPosition.z;
+        double vx = state.epochVelocity.x, vy = state.epochVelocity.y, vz = state.epochVelocity.z;
+        KeplerDrift(mu, elapsed, x, y, z, vx, vy, vz);
+        if (velocity) {
+            *velocity = triple(vx, vy, vz);
+        }
+        return triple(x, y, z);
+    }
+
+    static bool Same(const triple& a, const triple& b)
+    {
+        return a.x == b.x && a.y == b.y && a.z == b.z;
+    }
+
+    /// <summary>
+    /// Second derivative of the deviation at time t into the step: the central pull on the true position minus
+    /// that on the reference, in Battin's form, plus the pull of every other massive body on the body less its
+    /// pull on the primary, plus the body's external acceleration
+    /// </summary>
+    static triple DeviationAcceleration(const BodyStore& bodies, const SourcePaths& paths, size_t i, size_t primary, double t, const triple& reference, const triple& deviation)
+    {
+        const double mu = bodies.mu[primary];
+        const triple relative = reference + deviation;
+        const double r2 = reference * reference;
+        const double q = (deviation * (deviation - 2.0 * relative)) / (relative * relative);
+        const double fq = q * (3.0 + 3.0 * q + q * q) / (1.0 + std::pow(1.0 + q, 1.5));
+        triple acceleration = (-mu / (r2 * std::sqrt(r2))) * (deviation + fq * relative);
+
+        const triple primaryPosition = paths.Position(bodies, primary, t);
+        const triple position = primaryPosition + relative;
+        for (size_t j = 0; j < paths.MassiveCount(); j++)
+        {
+            if (j == primary)
+                continue;
+            const triple source = paths.Position(bodies, j, t);
+            const triple toBody = source - position;
+            const triple toPrimary = source - primaryPosition;
+            const double d2 = toBody * toBody, p2 = toPrimary * toPrimary;
+            if (d2 > 0) {
+                acceleration += (bodies.mu[j] / (d2 * std::sqrt(d2))) * toBody;
+            }
+            if (p2 > 0) {
+                acceleration -= (bodies.mu[j] / (p2 * std::sqrt(p2))) * toPrimary;
+            }
+        }
+        return acceleration + triple(bodies.extAx[i], bodies.extAy[i], bodies.extAz[i]);
+    }
+
+    // Longest substep the body can take at time t: a fraction of the shortest free-fall time scale to any massive body
+    static double SubstepLimit(const BodyStore& bodies, const SourcePaths& paths, size_t primary, double t, const triple& relative)
+    {
+        const double d2 = relative * relative;
+        double shortest = d2 * std::sqrt(d2) / bodies.mu[primary];
+        const triple position = paths.Position(bodies, primary, t) + relative;
+        for (size_t j = 0; j < paths.MassiveCount(); j++)
+        {
+            if (j == primary || bodies.mu[j] <= 0)
+                continue;
+            const triple toBody = paths.Position(bodies, j, t) - position;
+            const double s2 = toBody * toBody;
+            shortest = std::min(shortest, s2 * std::sqrt(s2) / bodies.mu[j]);
+        }
+        return StepFraction * std::sqrt(shortest);
+    }
+
+    // Restarts the reference conic from the body's state relative to the primary at time t into the step
+    void Rectify(EnckeState& state, const triple& relative, const triple& relativeVelocity)
+    {
+        state.epochPosition = relative;
+        state.epochVelocity = relativeVelocity;
+        state.elapsed = 0;
+        state.deviation = triple::zero();
+        state.deviationVelocity = triple::zero();
+        state.valid = true;
+        state.rectifications++;
+    }
+
+public:
+    /// <summary>
+    /// Moves massless body i across the step recorded in paths, with primary as the centre of its reference
+    /// conic, and writes its end state into the store over whatever the step integrator left there. start is
+    /// the body's inertial state at the start of the step.
+    /// </summary>
+    void Advance(BodyStore& bodies, const SourcePaths& paths, size_t i, size_t primary, const PhysicsObject* primaryObject, const triple& startPosition,
+        const triple& startVelocity, EnckeState& state)
+    {
+        const double mu = bodies.mu[primary];
+        const double stepLength = paths.StepLength();
+        const triple primaryStart = paths.StartPosition(primary);
+        const triple primaryStartVelocity = paths.StartVelocity(primary);
+        if (!state.valid || state.primary != primaryObject || !Same(state.lastPosition, startPosition) || !Same(state.lastVelocity, startVelocity)) {
+            state.primary = primaryObject;
+            Rectify(state, startPosition - primaryStart, startVelocity - primaryStartVelocity);
+        }
+
+        double t = 0;
+        while (t < stepLength)
+        {
+            const triple reference = ReferenceConic(mu, state, state.elapsed);
+            const double h = std::min(stepLength - t, SubstepLimit(bodies, paths, primary, t, reference + state.deviation));
+            const triple half = ReferenceConic(mu, state, state.elapsed + 0.5 * h);
+            triple endVelocity;
+            const triple end = ReferenceConic(mu, state, state.elapsed + h, &endVelocity);
+
+            const triple d1 = state.deviation, w1 = state.deviationVelocity;
+            const triple a1 = DeviationAcceleration(bodies, paths, i, primary, t, reference, d1);
+            const triple d2 = d1 + 0.5 * h * w1, w2 = w1 + 0.5 * h * a1;
+            const triple a2 = DeviationAcceleration(bodies, paths, i, primary, t + 0.5 * h, half, d2);
+            const triple d3 = d1 + 0.5 * h * w2, w3 = w1 + 0.5 * h * a2;
+            const triple a3 = DeviationAcceleration(bodies, paths, i, primary, t + 0.5 * h, half, d3);
+            const triple d4 = d1 + h * w3, w4 = w1 + h * a3;
+            const triple a4 = DeviationAcceleration(bodies, paths, i, primary, t + h, end, d4);
+            state.deviation += (h / 6.0) * (w1 + 2.0 * w2 + 2.0 * w3 + w4);
+            state.deviationVelocity += (h / 6.0) * (a1 + 2.0 * a2 + 2.0 * a3 + a4);
+            state.elapsed += h;
+            t += h;
+
+            const triple relative = end + state.deviation;
+            if (state.deviation.magnitude() > RectifyRatio * relative.magnitude()) {
+                Rectify(state, relative, endVelocity + state.deviationVelocity);
+            }
+        }
+
+        triple referenceVelocity;
+        const triple relative = ReferenceConic(mu, state, state.elapsed, &referenceVelocity) + state.deviation;
+        const triple relativeVelocity = referenceVelocity + state.deviationVelocity;
+        const triple position = triple(bodies.x[primary], bodies.y[primary], bodies.z[primary]) + relative;
+        const triple velocity = triple(bodies.vx[primary], bodies.vy[primary], bodies.vz[primary]) + relativeVelocity;
+        bodies.x[i] = position.x; bodies.y[i] = position.y; bodies.z[i] = position.z;
+        bodies.vx[i] = velocity.x; bodies.vy[i] = velocity.y; bodies.vz[i] = velocity.z;
+        state.lastPosition = position;
+        state.lastVelocity = velocity;
+    }
+};
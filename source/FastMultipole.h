@@ -0,0 +1,547 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include "BodyStore.h"
+#include "GravityKernels.h"
+#include "ThreadPool.h"
+#include "MortonSort.h"
+
+// Centre of a tight box and the distance from it to the farthest body inside
+struct FastMultipoleSphere {
+    double cx, cy, cz;
+    double radius;
+};
+
+// One octree cell of the multipole tree, stored depth-first with skip links like BarnesHutNode
+struct FastMultipoleCell {
+    FastMultipoleSphere target; // Around every body, the centre of the local expansion
+    FastMultipoleSphere source; // Around the gravity sources only, the centre of the multipole expansion
+    uint32_t first, count;  // Range of the cell's bodies in sorted order
+    uint32_t sourceCount;   // Gravity sources among them; in a leaf they come first
+    uint32_t skip;          // Index of the first cell after this subtree
+    uint32_t isLeaf;
+};
+
+/// <summary>
+/// Fast multipole solver using Cartesian Taylor expansions of configurable order. Multipoles are
+/// built bottom-up, a dual-tree traversal turns every well separated pair of cells into a local
+/// expansion of the target cell (M2L) and evaluates the remaining leaf pairs directly, and the local
+/// expansions are pushed down to the bodies. Target cell A and source cell B are well separated when
+/// (rA + rB) < theta * |cA - cB|, with A's sphere around all of its bodies and B's around its sources
+/// only, so theta and the order together set the accuracy.
+///
+/// One tree holds every body: the gravity sources are the prefix [0, sourceCount) of the range,
+/// massless test particles are targets only, and subtrees without sources are skipped on the source
+/// side. The traversal is split into independent target subtrees that the pool picks up
+/// dynamically, so no two participants ever write to the same cell or body.
+/// </summary>
+class FastMultipoleSolver
+{
+public:
+    static constexpr int MaxOrder = 10;
+
+private:
+    static constexpr size_t LeafSize = 32;
+    static constexpr size_t MaxTerms = (MaxOrder + 1) * (MaxOrder + 2) * (MaxOrder + 3) / 6;
+
+    // A multi-index n = (nx, ny, nz) with |n| <= order
+    struct Term {
+        int power[3];
+        int degree;
+        int minus1[3];  // Index of n - e_i, -1 if n_i < 1
+        int minus2[3];  // Index of n - 2e_i, -1 if n_i < 2
+        int axis;       // Any axis with n_i > 0, used to build powers from minus1[axis]
+    };
+    // (big, small, big - small) for every pair of multi-indices with small <= big componentwise
+    struct ShiftTerm { uint16_t big, small, difference; };
+    // (n, n + k) for every pair with |n| + |k| <= order, grouped by k
+    struct InteractionTerm { uint16_t n, sum; };
+
+    int order = 0;
+    size_t numberOfTerms = 0;
+    std::vector<Term> terms;
+    std::vector<int> termIndex;
+    std::vector<ShiftTerm> shiftTerms;
+    std::vector<InteractionTerm> interactionTerms;
+    std::vector<uint32_t> interactionBegin; // interactionTerms of k are [interactionBegin[k], interactionBegin[k + 1])
+    std::vector<int> gradientTerms;   // For each k with |k| < order, the indices of k + e_x, k + e_y, k + e_z
+
+    std::vector<FastMultipoleCell> cells;
+    std::vector<double> multipoles, locals;
+    std::vector<uint32_t> workCells, topCells;
+    std::atomic<size_t> nextWorkCell{ 0 };
+    MortonSort morton;
+    std::vector<uint32_t> sorted;     // Body index of each sorted slot
+    size_t sourceCount = 0;
+    double theta = 0.5;
+    AlignedDoubles sortedX, sortedY, sortedZ, sortedMu;
+    AlignedDoubles sortedAx, sortedAy, sortedAz;
+
+    int Index(int x, int y, int z) const
+    {
+        return termIndex[(x * (order + 1) + y) * (order + 1) + z];
+    }
+
+    void SetOrder(int newOrder)
+    {
+        newOrder = std::clamp(newOrder, 1, MaxOrder);
+        if (newOrder == order)
+            return;
+        order = newOrder;
+        terms.clear();
+        termIndex.assign((order + 1) * (order + 1) * (order + 1), -1);
+        for (int degree = 0; degree <= order; degree++)
+        {
+            for (int x = degree; x >= 0; x--)
+            {
+                for (int y = degree - x; y >= 0; y--)
+                {
+                    termIndex[(x * (order + 1) + y) * (order + 1) + degree - x - y] = (int)terms.size();
+                    terms.push_back({ { x, y, degree - x - y }, degree, { -1, -1, -1 }, { -1, -1, -1 }, -1 });
+                }
+            }
+        }
+        numberOfTerms = terms.size();
+        for (Term& t : terms)
+        {
+            t.axis = -1;
+            for (int i = 0; i < 3; i++)
+            {
+                int p[3] = { t.power[0], t.power[1], t.power[2] };
+                p[i] -= 1;
+                t.minus1[i] = p[i] >= 0 ? Index(p[0], p[1], p[2]) : -1;
+                p[i] -= 1;
+                t.minus2[i] = p[i] >= 0 ? Index(p[0], p[1], p[2]) : -1;
+                if (t.power[i] > 0)
+                    t.axis = i;
+            }
+        }
+
+        shiftTerms.clear();
+        interactionTerms.clear();
+        interactionBegin.clear();
+        gradientTerms.clear();
+        for (size_t big = 0; big < numberOfTerms; big++)
+        {
+            const Term& b = terms[big];
+            interactionBegin.push_back((uint32_t)interactionTerms.size());
+            for (size_t small = 0; small < numberOfTerms; small++)
+            {
+                const Term& s = terms[small];
+                if (s.power[0] <= b.power[0] && s.power[1] <= b.power[1] && s.power[2] <= b.power[2]) {
+                    shiftTerms.push_back({ (uint16_t)big, (uint16_t)small,
+                        (uint16_t)Index(b.power[0] - s.power[0], b.power[1] - s.power[1], b.power[2] - s.power[2]) });
+                }
+                if (b.degree + s.degree <= order) {
+                    interactionTerms.push_back({ (uint16_t)small, (uint16_t)Index(b.power[0] + s.power[0], b.power[1] + s.power[1], b.power[2] + s.power[2]) });
+                }
+            }
+            if (b.degree < order) {
+                gradientTerms.push_back(Index(b.power[0] + 1, b.power[1], b.power[2]));
+                gradientTerms.push_back(Index(b.power[0], b.power[1] + 1, b.power[2]));
+                gradientTerms.push_back(Index(b.power[0], b.power[1], b.power[2] + 1));
+            }
+        }
+        interactionBegin.push_back((uint32_t)interactionTerms.size());
+    }
+
+    // out[n] = d^n / n! for every term
+    void Powers(double dx, double dy, double dz, double* out) const
+    {
+        const double d[3] = { dx, dy, dz };
+        out[0] = 1.0;
+        for (size_t n = 1; n < numberOfTerms; n++)
+        {
+            const Term& t = terms[n];
+            out[n] = out[t.minus1[t.axis]] * d[t.axis] / t.power[t.axis];
+        }
+    }
+
+    // out[n] = D^n (1 / r) at (x, y, z), from the recurrence
+    // |n| r^2 D^n + (2|n| - 1) sum_i n_i x_i D^(n - e_i) + (|n| - 1) sum_i n_i (n_i - 1) D^(n - 2e_i) = 0
+    void Derivatives(double x, double y, double z, double* out) const
+    {
+        const double d[3] = { x, y, z };
+        double invR2 = 1.0 / (x * x + y * y + z * z);
+        out[0] = std::sqrt(invR2);
+        for (size_t n = 1; n < numberOfTerms; n++)
+        {
+            const Term& t = terms[n];
+            double sum = 0;
+            for (int i = 0; i < 3; i++)
+            {
+                if (t.power[i] > 0)
+                    sum += (2 * t.degree - 1) * t.power[i] * d[i] * out[t.minus1[i]];
+                if (t.power[i] > 1)
+                    sum += (t.degree - 1) * t.power[i] * (t.power[i] - 1) * out[t.minus2[i]];
+            }
+            out[n] = -sum * invR2 / t.degree;
+        }
+    }
+
+    uint32_t BuildCell(uint32_t begin, uint32_t end, int level)
+    {
+        uint32_t index = (uint32_t)cells.size();
+        cells.push_back({});
+        uint32_t sources = 0;
+        if (end - begin <= LeafSize || level == MortonSort::MaxDepth) {
+            // Sources first, so P2M and P2P only walk the cell's prefix
+            sources = (uint32_t)(std::partition(sorted.begin() + begin, sorted.begin() + end,
+                [this](uint32_t body) { return body < sourceCount; }) - (sorted.begin() + begin));
+            cells[index].isLeaf = 1;
+        }
+        else {
+            uint32_t childBegin = begin;
+            for (uint64_t octant = 0; octant < 8 && childBegin < end; octant++)
+            {
+                uint32_t childEnd = morton.OctantEnd(childBegin, end, level, octant);
+                if (childEnd > childBegin) {
+                    sources += cells[BuildCell(childBegin, childEnd, level + 1)].sourceCount;
+                }
+                childBegin = childEnd;
+            }
+            cells[index].isLeaf = 0;
+        }
+        cells[index].first = begin;
+        cells[index].count = end - begin;
+        cells[index].sourceCount = sources;
+        cells[index].skip = (uint32_t)cells.size();
+        return index;
+    }
+
+    // Splits the tree into independent target subtrees, several per participant so the dynamic
+    // scheduling can even out cells of different cost. Cells above them are only ever sources
+    void SplitWork(int participants)
+    {
+        workCells.assign(1, 0);
+        topCells.clear();
+        auto smaller = [this](uint32_t a, uint32_t b) { return cells[a].count < cells[b].count; };
+        while (workCells.size() < 16 * (size_t)participants)
+        {
+            std::pop_heap(workCells.begin(), workCells.end(), smaller);
+            uint32_t largest = workCells.back();
+            if (cells[largest].isLeaf) {
+                std::push_heap(workCells.begin(), workCells.end(), smaller);
+                break;
+            }
+            workCells.pop_back();
+            topCells.push_back(largest);
+            for (uint32_t child = largest + 1; child < cells[largest].skip; child = cells[child].skip)
+            {
+                workCells.push_back(child);
+                std::push_heap(workCells.begin(), workCells.end(), smaller);
+            }
+        }
+        std::sort(workCells.begin(), workCells.end(), [this](uint32_t a, uint32_t b) { return cells[a].count > cells[b].count; });
+    }
+
+    FastMultipoleSphere SphereAroundBodies(uint32_t begin, uint32_t end) const
+    {
+        BodyBounds box = BodyBounds::Empty();
+        for (uint32_t b = begin; b < end; b++)
+        {
+            box.Add(sortedX[b], sortedY[b], sortedZ[b]);
+        }
+        FastMultipoleSphere sphere = { 0.5 * (box.minX + box.maxX), 0.5 * (box.minY + box.maxY), 0.5 * (box.minZ + box.maxZ), 0.0 };
+        double radius2 = 0;
+        for (uint32_t b = begin; b < end; b++)
+        {
+            double dx = sortedX[b] - sphere.cx, dy = sortedY[b] - sphere.cy, dz = sortedZ[b] - sphere.cz;
+            radius2 = std::max(radius2, dx * dx + dy * dy + dz * dz);
+        }
+        sphere.radius = std::sqrt(radius2);
+        return sphere;
+    }
+
+    // Sphere around the target or source spheres of a cell's children, skipping children without sources for the latter
+    FastMultipoleSphere SphereAroundChildren(uint32_t index, FastMultipoleSphere FastMultipoleCell::* member) const
+    {
+        const bool sourcesOnly = member == &FastMultipoleCell::source;
+        BodyBounds box = BodyBounds::Empty();
+        for (uint32_t child = index + 1; child < cells[index].skip; child = cells[child].skip)
+        {
+            if (sourcesOnly && cells[child].sourceCount == 0)
+                continue;
+            const FastMultipoleSphere& c = cells[child].*member;
+            box.Add(c.cx - c.radius, c.cy - c.radius, c.cz - c.radius);
+            box.Add(c.cx + c.radius, c.cy + c.radius, c.cz + c.radius);
+        }
+        FastMultipoleSphere sphere = { 0.5 * (box.minX + box.maxX), 0.5 * (box.minY + box.maxY), 0.5 * (box.minZ + box.maxZ), 0.0 };
+        for (uint32_t child = index + 1; child < cells[index].skip; child = cells[child].skip)
+        {
+            if (sourcesOnly && cells[child].sourceCount == 0)
+                continue;
+            const FastMultipoleSphere& c = cells[child].*member;
+            double dx = c.cx - sphere.cx, dy = c.cy - sphere.cy, dz = c.cz - sphere.cz;
+            sphere.radius = std::max(sphere.radius, std::sqrt(dx * dx + dy * dy + dz * dz) + c.radius);
+        }
+        return sphere;
+    }
+
+    // Spheres and multipole of one cell from its bodies (P2M) or its children (M2M)
+    void Upward(uint32_t index)
+    {
+        FastMultipoleCell& cell = cells[index];
+        double* m = &multipoles[index * numberOfTerms];
+        std::fill(m, m + numberOfTerms, 0.0);
+        double powers[MaxTerms];
+        if (cell.isLeaf) {
+            cell.target = SphereAroundBodies(cell.first, cell.first + cell.count);
+            cell.source = SphereAroundBodies(cell.first, cell.first + cell.sourceCount);
+            for (uint32_t b = cell.first; b < cell.first + cell.sourceCount; b++)
+            {
+                Powers(cell.source.cx - sortedX[b], cell.source.cy - sortedY[b], cell.source.cz - sortedZ[b], powers);
+                for (size_t n = 0; n < numberOfTerms; n++)
+                {
+                    m[n] += sortedMu[b] * powers[n];
+                }
+            }
+            return;
+        }
+
+        cell.target = SphereAroundChildren(index, &FastMultipoleCell::target);
+        cell.source = SphereAroundChildren(index, &FastMultipoleCell::source);
+        for (uint32_t child = index + 1; child < cell.skip; child = cells[child].skip)
+        {
+            const FastMultipoleCell& c = cells[child];
+            if (c.sourceCount == 0)
+                continue;
+            const double* mc = &multipoles[child * numberOfTerms];
+            Powers(cell.source.cx - c.source.cx, cell.source.cy - c.source.cy, cell.source.cz - c.source.cz, powers);
+            for (const ShiftTerm& t : shiftTerms)
+            {
+                m[t.big] += mc[t.small] * powers[t.difference];
+            }
+        }
+    }
+
+    // Far field of source cell b on the local expansion of target cell a
+    void MultipoleToLocal(uint32_t a, uint32_t b, double dx, double dy, double dz)
+    {
+        double derivatives[MaxTerms];
+        Derivatives(dx, dy, dz, derivatives);
+        const double* m = &multipoles[b * numberOfTerms];
+        double* l = &locals[a * numberOfTerms];
+        for (size_t k = 0; k < numberOfTerms; k++)
+        {
+            double sum = 0;
+            for (uint32_t i = interactionBegin[k]; i < interactionBegin[k + 1]; i++)
+            {
+                sum += m[interactionTerms[i].n] * derivatives[interactionTerms[i].sum];
+            }
+            l[k] += sum;
+        }
+    }
+
+    // Direct pull of source leaf b on every body of target leaf a, through the vectorized kernel on the sorted arrays
+    void ParticleToParticle(uint32_t a, uint32_t b)
+    {
+        const FastMultipoleCell& target = cells[a];
+        const FastMultipoleCell& source = cells[b];
+        StageView view = { sortedX.data(), sortedY.data(), sortedZ.data(), sortedAx.data(), sortedAy.data(), sortedAz.data() };
+        AccumulateGravityBlock(view, sortedMu.data(), target.first, target.first + target.count, source.first, source.first + source.sourceCount);
+    }
+
+    // Every target leaf under a against every source leaf under b
+    void Direct(uint32_t a, uint32_t b)
+    {
+        for (uint32_t targetLeaf = a; targetLeaf < cells[a].skip; targetLeaf++)
+        {
+            if (!cells[targetLeaf].isLeaf)
+                continue;
+            for (uint32_t sourceLeaf = b; sourceLeaf < cells[b].skip;)
+            {
+                const FastMultipoleCell& source = cells[sourceLeaf];
+                if (source.isLeaf && source.sourceCount > 0) {
+                    ParticleToParticle(targetLeaf, sourceLeaf);
+                }
+                sourceLeaf = source.isLeaf || source.sourceCount == 0 ? source.skip : sourceLeaf + 1;
+            }
+        }
+    }
+
+    // Dual-tree traversal: accept the pair, evaluate it directly, or split the larger cell
+    void Interact(uint32_t a, uint32_t b)
+    {
+        const FastMultipoleCell& target = cells[a];
+        const FastMultipoleCell& source = cells[b];
+        if (source.sourceCount == 0)
+            return;
+        double dx = target.target.cx - source.source.cx;
+        double dy = target.target.cy - source.source.cy;
+        double dz = target.target.cz - source.source.cz;
+        double reach = (target.target.radius + source.source.radius) / theta;
+        if (reach * reach < dx * dx + dy * dy + dz * dz) {
+            // A pair with fewer body pairs than the M2L has terms is cheaper, and exact, to sum directly
+            if ((size_t)target.count * source.sourceCount <= interactionTerms.size()) {
+                Direct(a, b);
+            }
+            else {
+                MultipoleToLocal(a, b, dx, dy, dz);
+            }
+        }
+        else if (target.isLeaf && source.isLeaf) {
+            ParticleToParticle(a, b);
+        }
+        else if (source.isLeaf || (!target.isLeaf && target.target.radius >= source.source.radius)) {
+            for (uint32_t child = a + 1; child < target.skip; child = cells[child].skip)
+            {
+                Interact(child, b);
+            }
+        }
+        else {
+            for (uint32_t child = b + 1; child < source.skip; child = cells[child].skip)
+            {
+                Interact(a, child);
+            }
+        }
+    }
+
+    // Pushes the local expansions of a target subtree down to its bodies (L2L, then L2P at the leaves)
+    void Downward(uint32_t root)
+    {
+        double powers[MaxTerms];
+        for (uint32_t index = root; index < cells[root].skip; index++)
+        {
+            const FastMultipoleCell& cell = cells[index];
+            const double* l = &locals[index * numberOfTerms];
+            if (!cell.isLeaf) {
+                for (uint32_t child = index + 1; child < cell.skip; child = cells[child].skip)
+                {
+                    const FastMultipoleCell& c = cells[child];
+                    double* lc = &locals[child * numberOfTerms];
+                    Powers(c.target.cx - cell.target.cx, c.target.cy - cell.target.cy, c.target.cz - cell.target.cz, powers);
+                    for (const ShiftTerm& t : shiftTerms)
+                    {
+                        lc[t.small] += l[t.big] * powers[t.difference];
+                    }
+                }
+                continue;
+            }
+            for (uint32_t b = cell.first; b < cell.first + cell.count; b++)
+            {
+                Powers(sortedX[b] - cell.target.cx, sortedY[b] - cell.target.cy, sortedZ[b] - cell.target.cz, powers);
+                double ax = 0, ay = 0, az = 0;
+                for (size_t k = 0, g = 0; g < gradientTerms.size(); k++, g += 3)
+                {
+                    ax += l[gradientTerms[g]] * powers[k];
+                    ay += l[gradientTerms[g + 1]] * powers[k];
+                    az += l[gradientTerms[g + 2]] * powers[k];
+                }
+                sortedAx[b] += ax;
+                sortedAy[b] += ay;
+                sortedAz[b] += az;
+            }
+        }
+    }
+
+    // Hands out work cells until none are left
+    template <typename Body>
+    void ForEachWorkCell(ThreadPool& pool, Body&& body)
+    {
+        nextWorkCell.store(0, std::memory_order_relaxed);
+        auto job = [&](int) {
+            for (size_t w = nextWorkCell.fetch_add(1, std::memory_order_relaxed); w < workCells.size();
+                w = nextWorkCell.fetch_add(1, std::memory_order_relaxed))
+            {
+                body(workCells[w]);
+            }
+            };
+        pool.Run(job);
+    }
+
+public:
+    size_t GetNumberOfCells() const
+    {
+        return cells.size();
+    }
+
+    bool IsKeyOrderSorted() const
+    {
+        return morton.IsSorted();
+    }
+
+    int GetOrder() const
+    {
+        return order;
+    }
+
+    // Sorts bodies [0, bodyCount) into a new tree, of which [0, numberOfSources) are gravity sources
+    void Build(const StageView& s, size_t bodyCount, size_t numberOfSources, ThreadPool& pool)
+    {
+        cells.clear();
+        sourceCount = numberOfSources;
+        if (bodyCount == 0)
+            return;
+        morton.Sort(s, 0, bodyCount, pool);
+        sorted.resize(bodyCount);
+        for (size_t i = 0; i < bodyCount; i++)
+        {
+            sorted[i] = morton.keys[i].second;
+        }
+        BuildCell(0, (uint32_t)bodyCount, 0);
+        SplitWork(pool.GetNumberOfParticipants());
+    }
+
+    /// <summary>
+    /// Adds the pull of the sources on every body to the stage accelerations, using the topology of the
+    /// last Build() with boxes and expansions refitted to the stage positions. order is the highest
+    /// Taylor order kept (clamped to 1..MaxOrder) and openingTheta the separation parameter (0, 1].
+    /// </summary>
+    void Evaluate(const StageView& s, const double* mu, int expansionOrder, double openingTheta, ThreadPool& pool)
+    {
+        if (cells.empty())
+            return;
+        SetOrder(expansionOrder);
+        theta = std::clamp(openingTheta, 1e-3, 1.0);
+        size_t n = sorted.size();
+        sortedX.resize(n); sortedY.resize(n); sortedZ.resize(n); sortedMu.resize(n);
+        sortedAx.resize(n); sortedAy.resize(n); sortedAz.resize(n);
+        multipoles.resize(cells.size() * numberOfTerms);
+        locals.resize(cells.size() * numberOfTerms);
+        pool.ParallelFor(n, [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; i++)
+            {
+                uint32_t body = sorted[i];
+                sortedX[i] = s.x[body];
+                sortedY[i] = s.y[body];
+                sortedZ[i] = s.z[body];
+                sortedMu[i] = body < sourceCount ? mu[body] : 0.0;
+                sortedAx[i] = sortedAy[i] = sortedAz[i] = 0.0;
+            }
+            });
+
+        // Multipoles: each work subtree bottom-up, then the cells above them
+        ForEachWorkCell(pool, [this](uint32_t root) {
+            for (uint32_t index = cells[root].skip; index-- > root;)
+            {
+                Upward(index);
+            }
+            });
+        for (size_t i = topCells.size(); i-- > 0;)
+        {
+            Upward(topCells[i]);
+        }
+
+        // Far field and near field of each work subtree against the whole tree, then down to its bodies
+        ForEachWorkCell(pool, [this](uint32_t root) {
+            std::fill(locals.begin() + root * numberOfTerms, locals.begin() + cells[root].skip * numberOfTerms, 0.0);
+            Interact(root, 0);
+            Downward(root);
+            });
+
+        pool.ParallelFor(n, [&](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; i++)
+            {
+                uint32_t body = sorted[i];
+                s.ax[body] += sortedAx[i];
+                s.ay[body] += sortedAy[i];
+                s.az[body] += sortedAz[i];
+            }
+            });
+    }
+};
@@ -0,0 +1,83 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include "BodyStore.h"
+#include "SimdKernels.h"
+
+// Pull of sources [sourceBegin, sourceEnd) on a single target, skipping the target itself
+inline void AccumulateGravityScalar(const StageView& s, const double* mu, size_t t, size_t sourceBegin, size_t sourceEnd)
+{
+    const double xt = s.x[t], yt = s.y[t], zt = s.z[t];
+    double ax = 0, ay = 0, az = 0;
+    for (size_t j = sourceBegin; j < sourceEnd; j++)
+    {
+        double dx = s.x[j] - xt;
+        double dy = s.y[j] - yt;
+        double dz = s.z[j] - zt;
+        double r2 = dx * dx + dy * dy + dz * dz;
+        if (r2 <= 0.0)
+            continue;
+        double f = mu[j] / (r2 * std::sqrt(r2));
+        ax += dx * f;
+        ay += dy * f;
+        az += dz * f;
+    }
+    s.ax[t] += ax;
+    s.ay[t] += ay;
+    s.az[t] += az;
+}
+
+// One row of a symmetric pair sweep: body i against j in [jBegin, jEnd), each pair evaluated once and applied to both
+// bodies. Positions come from the stage, the results go to (ax, ay, az), which may be a thread's private buffer
+inline void AccumulateGravitySymmetricRow(const StageView& s, const double* mu, size_t i, size_t jBegin, size_t jEnd, double* ax, double* ay, double* az)
+{
+    const double xi = s.x[i], yi = s.y[i], zi = s.z[i];
+    const double mui = mu[i];
+    double axi = 0, ayi = 0, azi = 0;
+    for (size_t j = jBegin; j < jEnd; j++)
+    {
+        double dx = s.x[j] - xi;
+        double dy = s.y[j] - yi;
+        double dz = s.z[j] - zi;
+        double r2 = dx * dx + dy * dy + dz * dz;
+        double invR3 = 1.0 / (r2 * std::sqrt(r2));
+        double fi = mu[j] * invR3;
+        double fj = mui * invR3;
+        axi += dx * fi;
+        ayi += dy * fi;
+        azi += dz * fi;
+        ax[j] -= dx * fj;
+        ay[j] -= dy * fj;
+        az[j] -= dz * fj;
+    }
+    ax[i] += axi;
+    ay[i] += ayi;
+    az[i] += azi;
+}
+
+/// <summary>
+/// Direct-summation gravity for a block of targets against a block of sources. Targets are packed
+/// four (AVX2) or eight (AVX-512) to a register and every source is broadcast against them, so the
+/// accumulators stay in registers for the whole source sweep; the kernel is picked at run time from
+/// what the processor supports. Coincident pairs (including a target seeing itself) contribute nothing.
+/// </summary>
+inline void AccumulateGravityBlock(const StageView& s, const double* mu, size_t targetBegin, size_t targetEnd, size_t sourceBegin, size_t sourceEnd)
+{
+    size_t t = targetBegin;
+    switch (GetSimdLevel())
+    {
+    case SimdLevel::AVX512:
+        t = AccumulateGravityBlockAVX512(s, mu, targetBegin, targetEnd, sourceBegin, sourceEnd);
+        break;
+    case SimdLevel::AVX2:
+        t = AccumulateGravityBlockAVX2(s, mu, targetBegin, targetEnd, sourceBegin, sourceEnd);
+        break;
+    default:
+        break;
+    }
+    // Remainder that does not fill a register, or everything on processors without AVX2
+    for (; t < targetEnd; t++)
+    {
+        AccumulateGravityScalar(s, mu, t, sourceBegin, sourceEnd);
+    }
+}
@@ -0,0 +1,255 @@
+// Built with AVX2 and FMA enabled (see CMakelists.txt) and only called when GetSimdLevel() reports them. Nothing here
+// may call an inline function or template shared with other translation units: the linker could keep this copy,
+// built for AVX2, for the whole program. KeplerInitialAnomaly is static for that reason
+#include <cstddef>
+#include "SimdKernels.h"
+#include "BodyStore.h"
+#include "Kepler.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+// 1/sqrt(r2) for four doubles. AVX2 has no double-precision estimate, so the seed comes from the exponent bit trick
+// (about 5 correct bits, valid over the whole double range) and four Newton-Raphson steps bring it to full precision
+static inline __m256d GravityRsqrt(__m256d r2)
+{
+    const __m256i magic = _mm256_set1_epi64x(0x5FE6EB50C7B537A9LL);
+    const __m256d threeHalves = _mm256_set1_pd(1.5);
+    const __m256d halfR2 = _mm256_mul_pd(_mm256_set1_pd(0.5), r2);
+    __m256d y = _mm256_castsi256_pd(_mm256_sub_epi64(magic, _mm256_srli_epi64(_mm256_castpd_si256(r2), 1)));
+    for (int k = 0; k < 4; k++)
+    {
+        y = _mm256_mul_pd(y, _mm256_fnmadd_pd(halfR2, _mm256_mul_pd(y, y), threeHalves));
+    }
+    return y;
+}
+
+// Stumpff c2 and c3 of four arguments with no trigonometric calls: the argument is quartered until every lane is
+// inside the series' range, c0 = cos sqrt w, c1 = sin sqrt w / sqrt w, c2 and c3 are summed there and rebuilt with
+// the duplication formulas, lane by lane as many times as that lane was quartered. Lanes still out of range after
+// MaxQuarterings are cleared in inRange.
+static void StumpffC2C3x4(__m256d z, __m256d& c2, __m256d& c3, __m256d& inRange)
+{
+    constexpr int MaxQuarterings = 24;
+    const __m256d signBit = _mm256_set1_pd(-0.0);
+    const __m256d limit = _mm256_set1_pd(0.1);
+    const __m256d quarter = _mm256_set1_pd(0.25);
+    const __m256d one = _mm256_set1_pd(1.0);
+    __m256d w = z, quarterings = _mm256_setzero_pd();
+    int passes = 0;
+    for (; passes < MaxQuarterings; passes++)
+    {
+        const __m256d large = _mm256_cmp_pd(_mm256_andnot_pd(signBit, w), limit, _CMP_GE_OQ);
+        if (_mm256_movemask_pd(large) == 0)
+            break;
+        w = _mm256_blendv_pd(w, _mm256_mul_pd(w, quarter), large);
+        quarterings = _mm256_add_pd(quarterings, _mm256_and_pd(large, one));
+    }
+    inRange = _mm256_cmp_pd(_mm256_andnot_pd(signBit, w), limit, _CMP_LT_OQ);
+
+    // Horner forms of the series, innermost coefficient first
+    auto series = [w](const double* coefficients, int terms) {
+        __m256d sum = _mm256_set1_pd(coefficients[0]);
+        for (int k = 1; k < terms; k++)
+        {
+            sum = _mm256_fnmadd_pd(w, sum, _mm256_set1_pd(coefficients[k]));
+        }
+        return sum;
+    };
+    static constexpr double C0[] = { 1.0 / 479001600.0, 1.0 / 3628800.0, 1.0 / 40320.0, 1.0 / 720.0, 1.0 / 24.0, 1.0 / 2.0, 1.0 };
+    static constexpr double C1[] = { 1.0 / 6227020800.0, 1.0 / 39916800.0, 1.0 / 362880.0, 1.0 / 5040.0, 1.0 / 120.0, 1.0 / 6.0, 1.0 };
+    __m256d s0 = series(C0, 7), s1 = series(C1, 7), s2 = series(C0, 6), s3 = series(C1, 6);
+
+    // c3(4w) = (c2 + c0 c3) / 4, c2(4w) = c1^2 / 2, c1(4w) = c0 c1, c0(4w) = 2 c0^2 - 1
+    const __m256d half = _mm256_set1_pd(0.5);
+    for (int r = 0; r < passes; r++)
+    {
+        const __m256d apply = _mm256_cmp_pd(_mm256_set1_pd(r), quarterings, _CMP_LT_OQ);
+        const __m256d d3 = _mm256_mul_pd(quarter, _mm256_fmadd_pd(s0, s3, s2));
+        const __m256d d2 = _mm256_mul_pd(half, _mm256_mul_pd(s1, s1));
+        const __m256d d1 = _mm256_mul_pd(s0, s1);
+        const __m256d d0 = _mm256_fmsub_pd(_mm256_add_pd(s0, s0), s0, one);
+        s3 = _mm256_blendv_pd(s3, d3, apply);
+        s2 = _mm256_blendv_pd(s2, d2, apply);
+        s1 = _mm256_blendv_pd(s1, d1, apply);
+        s0 = _mm256_blendv_pd(s0, d0, apply);
+    }
+    c2 = s2;
+    c3 = s3;
+}
+
+size_t AccumulateGravityBlockAVX2(const StageView& s, const double* mu, size_t targetBegin, size_t targetEnd, size_t sourceBegin, size_t sourceEnd)
+{
+    size_t t = targetBegin;
+    const __m256d zero = _mm256_setzero_pd();
+    for (; t + 4 <= targetEnd; t += 4)
+    {
+        const __m256d xt = _mm256_loadu_pd(s.x + t);
+        const __m256d yt = _mm256_loadu_pd(s.y + t);
+        const __m256d zt = _mm256_loadu_pd(s.z + t);
+        __m256d ax = zero, ay = zero, az = zero;
+        for (size_t j = sourceBegin; j < sourceEnd; j++)
+        {
+            __m256d dx = _mm256_sub_pd(_mm256_broadcast_sd(s.x + j), xt);
+            __m256d dy = _mm256_sub_pd(_mm256_broadcast_sd(s.y + j), yt);
+            __m256d dz = _mm256_sub_pd(_mm256_broadcast_sd(s.z + j), zt);
+            __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+            __m256d nonZero = _mm256_cmp_pd(r2, zero, _CMP_GT_OQ);
+            __m256d rinv = _mm256_and_pd(GravityRsqrt(r2), nonZero);
+            __m256d f = _mm256_mul_pd(_mm256_broadcast_sd(mu + j), _mm256_mul_pd(rinv, _mm256_mul_pd(rinv, rinv)));
+            ax = _mm256_fmadd_pd(dx, f, ax);
+            ay = _mm256_fmadd_pd(dy, f, ay);
+            az = _mm256_fmadd_pd(dz, f, az);
+        }
+        _mm256_storeu_pd(s.ax + t, _mm256_add_pd(_mm256_loadu_pd(s.ax + t), ax));
+        _mm256_storeu_pd(s.ay + t, _mm256_add_pd(_mm256_loadu_pd(s.ay + t), ay));
+        _mm256_storeu_pd(s.az + t, _mm256_add_pd(_mm256_loadu_pd(s.az + t), az));
+    }
+    return t;
+}
+
+// Two registers of particles share every source load, which also gives the long reciprocal square root chains two
+// independent streams
+size_t AccumulateTestParticlesAVX2(const StageView& s, const double* packed, size_t targetBegin, size_t targetEnd, size_t first, size_t last)
+{
+    size_t t = targetBegin;
+    const __m256d zero = _mm256_setzero_pd();
+    for (; t + 8 <= targetEnd; t += 8)
+    {
+        const __m256d xt0 = _mm256_loadu_pd(s.x + t), xt1 = _mm256_loadu_pd(s.x + t + 4);
+        const __m256d yt0 = _mm256_loadu_pd(s.y + t), yt1 = _mm256_loadu_pd(s.y + t + 4);
+        const __m256d zt0 = _mm256_loadu_pd(s.z + t), zt1 = _mm256_loadu_pd(s.z + t + 4);
+        __m256d ax0 = zero, ay0 = zero, az0 = zero;
+        __m256d ax1 = zero, ay1 = zero, az1 = zero;
+        for (size_t j = first; j < last; j++)
+        {
+            const double* source = &packed[4 * j];
+            const __m256d sx = _mm256_broadcast_sd(source), sy = _mm256_broadcast_sd(source + 1), sz = _mm256_broadcast_sd(source + 2);
+            const __m256d mu = _mm256_broadcast_sd(source + 3);
+            __m256d dx0 = _mm256_sub_pd(sx, xt0), dx1 = _mm256_sub_pd(sx, xt1);
+            __m256d dy0 = _mm256_sub_pd(sy, yt0), dy1 = _mm256_sub_pd(sy, yt1);
+            __m256d dz0 = _mm256_sub_pd(sz, zt0), dz1 = _mm256_sub_pd(sz, zt1);
+            __m256d r20 = _mm256_fmadd_pd(dz0, dz0, _mm256_fmadd_pd(dy0, dy0, _mm256_mul_pd(dx0, dx0)));
+            __m256d r21 = _mm256_fmadd_pd(dz1, dz1, _mm256_fmadd_pd(dy1, dy1, _mm256_mul_pd(dx1, dx1)));
+            __m256d rinv0 = _mm256_and_pd(GravityRsqrt(r20), _mm256_cmp_pd(r20, zero, _CMP_GT_OQ));
+            __m256d rinv1 = _mm256_and_pd(GravityRsqrt(r21), _mm256_cmp_pd(r21, zero, _CMP_GT_OQ));
+            __m256d f0 = _mm256_mul_pd(mu, _mm256_mul_pd(rinv0, _mm256_mul_pd(rinv0, rinv0)));
+            __m256d f1 = _mm256_mul_pd(mu, _mm256_mul_pd(rinv1, _mm256_mul_pd(rinv1, rinv1)));
+            ax0 = _mm256_fmadd_pd(dx0, f0, ax0); ax1 = _mm256_fmadd_pd(dx1, f1, ax1);
+            ay0 = _mm256_fmadd_pd(dy0, f0, ay0); ay1 = _mm256_fmadd_pd(dy1, f1, ay1);
+            az0 = _mm256_fmadd_pd(dz0, f0, az0); az1 = _mm256_fmadd_pd(dz1, f1, az1);
+        }
+        _mm256_storeu_pd(s.ax + t, _mm256_add_pd(_mm256_loadu_pd(s.ax + t), ax0));
+        _mm256_storeu_pd(s.ay + t, _mm256_add_pd(_mm256_loadu_pd(s.ay + t), ay0));
+        _mm256_storeu_pd(s.az + t, _mm256_add_pd(_mm256_loadu_pd(s.az + t), az0));
+        _mm256_storeu_pd(s.ax + t + 4, _mm256_add_pd(_mm256_loadu_pd(s.ax + t + 4), ax1));
+        _mm256_storeu_pd(s.ay + t + 4, _mm256_add_pd(_mm256_loadu_pd(s.ay + t + 4), ay1));
+        _mm256_storeu_pd(s.az + t + 4, _mm256_add_pd(_mm256_loadu_pd(s.az + t + 4), az1));
+    }
+    return t;
+}
+
+int KeplerDriftAVX2x4(const double* mu, double dt, double* x, double* y, double* z, double* vx, double* vy, double* vz)
+{
+    constexpr int MaxIterations = 16;
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d signBit = _mm256_set1_pd(-0.0);
+    const __m256d n = _mm256_set1_pd(5.0);                  // Laguerre-Conway order
+    const __m256d nMinusOne = _mm256_set1_pd(4.0);
+    const __m256d twoPi = _mm256_set1_pd(2.0 * 3.14159265358979323846);
+    const __m256d tolerance = _mm256_set1_pd(1e-14);
+    const __m256d tiny = _mm256_set1_pd(1e-300);
+    const __m256d step = _mm256_set1_pd(dt);
+    const __m256d m = _mm256_loadu_pd(mu);
+    const __m256d x0 = _mm256_loadu_pd(x), y0 = _mm256_loadu_pd(y), z0 = _mm256_loadu_pd(z);
+    const __m256d vx0 = _mm256_loadu_pd(vx), vy0 = _mm256_loadu_pd(vy), vz0 = _mm256_loadu_pd(vz);
+    const __m256d r0 = _mm256_sqrt_pd(_mm256_fmadd_pd(z0, z0, _mm256_fmadd_pd(y0, y0, _mm256_mul_pd(x0, x0))));
+    const __m256d regular = _mm256_and_pd(_mm256_cmp_pd(m, zero, _CMP_GT_OQ), _mm256_cmp_pd(r0, zero, _CMP_GT_OQ));
+    if (dt == 0 || _mm256_movemask_pd(regular) != 0xF)
+        return -1;
+    const __m256d sqrtMu = _mm256_sqrt_pd(m);
+    const __m256d v2 = _mm256_fmadd_pd(vz0, vz0, _mm256_fmadd_pd(vy0, vy0, _mm256_mul_pd(vx0, vx0)));
+    const __m256d alpha = _mm256_sub_pd(_mm256_div_pd(two, r0), _mm256_div_pd(v2, m));
+    const __m256d sigma0 = _mm256_div_pd(_mm256_fmadd_pd(z0, vz0, _mm256_fmadd_pd(y0, vy0, _mm256_mul_pd(x0, vx0))), sqrtMu);
+    const __m256d oneMinusAlphaR0 = _mm256_fnmadd_pd(alpha, r0, one);
+
+    // Bound orbits drop whole periods, to the nearest one so that the anomaly left to solve for is as short as it can be
+    const __m256d threshold = _mm256_div_pd(_mm256_set1_pd(1e-12), r0);
+    const __m256d bound = _mm256_cmp_pd(alpha, threshold, _CMP_GT_OQ);
+    const __m256d safeAlpha = _mm256_blendv_pd(one, alpha, bound);
+    const __m256d period = _mm256_div_pd(twoPi, _mm256_mul_pd(sqrtMu, _mm256_mul_pd(safeAlpha, _mm256_sqrt_pd(safeAlpha))));
+    const __m256d whole = _mm256_round_pd(_mm256_div_pd(step, period), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    const __m256d laneDt = _mm256_blendv_pd(step, _mm256_fnmadd_pd(whole, period, step), bound);
+    const __m256d target = _mm256_mul_pd(sqrtMu, laneDt);
+    __m256d chi = _mm256_blendv_pd(_mm256_div_pd(target, r0), _mm256_mul_pd(target, alpha), bound);
+    if (_mm256_movemask_pd(_mm256_cmp_pd(alpha, _mm256_sub_pd(zero, threshold), _CMP_LT_OQ)) != 0) {
+        // Hyperbolic lanes start from the logarithmic estimate, which needs a log per lane
+        double lanes[5][4];
+        _mm256_storeu_pd(lanes[0], sqrtMu); _mm256_storeu_pd(lanes[1], alpha); _mm256_storeu_pd(lanes[2], r0);
+        _mm256_storeu_pd(lanes[3], sigma0); _mm256_storeu_pd(lanes[4], laneDt);
+        double guess[4];
+        for (int lane = 0; lane < 4; lane++)
+        {
+            guess[lane] = KeplerInitialAnomaly(lanes[0][lane], lanes[1][lane], lanes[2][lane], lanes[3][lane], lanes[4][lane]);
+        }
+        chi = _mm256_loadu_pd(guess);
+    }
+
+    __m256d c2, c3, inRange, zeta, converged = zero;
+    for (int iteration = 0; iteration < MaxIterations && _mm256_movemask_pd(converged) != 0xF; iteration++)
+    {
+        const __m256d chi2 = _mm256_mul_pd(chi, chi);
+        zeta = _mm256_mul_pd(alpha, chi2);
+        StumpffC2C3x4(zeta, c2, c3, inRange);
+        const __m256d oneMinusZc3 = _mm256_fnmadd_pd(zeta, c3, one);
+        const __m256d f = _mm256_sub_pd(_mm256_fmadd_pd(r0, chi, _mm256_fmadd_pd(_mm256_mul_pd(oneMinusAlphaR0, chi2), _mm256_mul_pd(chi, c3),
+            _mm256_mul_pd(_mm256_mul_pd(sigma0, chi2), c2))), target);
+        const __m256d df = _mm256_add_pd(_mm256_fmadd_pd(_mm256_mul_pd(sigma0, chi), oneMinusZc3, _mm256_mul_pd(_mm256_mul_pd(oneMinusAlphaR0, chi2), c2)), r0);
+        const __m256d ddf = _mm256_fmadd_pd(sigma0, _mm256_fnmadd_pd(zeta, c2, one), _mm256_mul_pd(_mm256_mul_pd(oneMinusAlphaR0, chi), oneMinusZc3));
+        const __m256d discriminant = _mm256_fmsub_pd(_mm256_mul_pd(_mm256_mul_pd(nMinusOne, nMinusOne), df), df, _mm256_mul_pd(_mm256_mul_pd(n, nMinusOne), _mm256_mul_pd(f, ddf)));
+        const __m256d root = _mm256_sqrt_pd(_mm256_andnot_pd(signBit, discriminant));
+        const __m256d denominator = _mm256_add_pd(df, _mm256_or_pd(root, _mm256_and_pd(df, signBit)));
+        const __m256d delta = _mm256_div_pd(_mm256_mul_pd(n, f), denominator);
+        // Converged lanes stop moving, so each lane ends on the same anomaly the scalar solver would stop at
+        chi = _mm256_blendv_pd(_mm256_sub_pd(chi, delta), chi, converged);
+        const __m256d settledStep = _mm256_max_pd(_mm256_mul_pd(tolerance, _mm256_andnot_pd(signBit, chi)), tiny);
+        converged = _mm256_or_pd(converged, _mm256_and_pd(inRange, _mm256_cmp_pd(_mm256_andnot_pd(signBit, delta), settledStep, _CMP_LE_OQ)));
+    }
+
+    const __m256d chi2 = _mm256_mul_pd(chi, chi);
+    zeta = _mm256_mul_pd(alpha, chi2);
+    StumpffC2C3x4(zeta, c2, c3, inRange);
+    const __m256d r = _mm256_add_pd(_mm256_fmadd_pd(_mm256_mul_pd(sigma0, chi), _mm256_fnmadd_pd(zeta, c3, one), _mm256_mul_pd(_mm256_mul_pd(oneMinusAlphaR0, chi2), c2)), r0);
+    const __m256d f = _mm256_fnmadd_pd(chi2, _mm256_div_pd(c2, r0), one);
+    const __m256d g = _mm256_fnmadd_pd(_mm256_mul_pd(chi2, chi), _mm256_div_pd(c3, sqrtMu), laneDt);
+    const __m256d fDot = _mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(sqrtMu, chi), _mm256_fmsub_pd(zeta, c3, one)), _mm256_mul_pd(r, r0));
+    const __m256d gDot = _mm256_fnmadd_pd(chi2, _mm256_div_pd(c2, r), one);
+
+    double out[6][4];
+    _mm256_storeu_pd(out[0], _mm256_fmadd_pd(g, vx0, _mm256_mul_pd(f, x0)));
+    _mm256_storeu_pd(out[1], _mm256_fmadd_pd(g, vy0, _mm256_mul_pd(f, y0)));
+    _mm256_storeu_pd(out[2], _mm256_fmadd_pd(g, vz0, _mm256_mul_pd(f, z0)));
+    _mm256_storeu_pd(out[3], _mm256_fmadd_pd(gDot, vx0, _mm256_mul_pd(fDot, x0)));
+    _mm256_storeu_pd(out[4], _mm256_fmadd_pd(gDot, vy0, _mm256_mul_pd(fDot, y0)));
+    _mm256_storeu_pd(out[5], _mm256_fmadd_pd(gDot, vz0, _mm256_mul_pd(fDot, z0)));
+    const int settled = _mm256_movemask_pd(_mm256_and_pd(converged, inRange));
+    int moved = 0;
+    for (int lane = 0; lane < 4; lane++)
+    {
+        // sum - sum is 0 only for a finite sum, without reaching for std::isfinite (see the top of the file)
+        const double sum = out[0][lane] + out[3][lane];
+        if (settled & (1 << lane) && sum - sum == 0) {
+            x[lane] = out[0][lane]; y[lane] = out[1][lane]; z[lane] = out[2][lane];
+            vx[lane] = out[3][lane]; vy[lane] = out[4][lane]; vz[lane] = out[5][lane];
+            moved |= 1 << lane;
+        }
+    }
+    return moved;
+}
+#else
+// Without AVX2 (a non-x86 build) GetSimdLevel() never picks these, they only have to link
+size_t AccumulateGravityBlockAVX2(const StageView&, const double*, size_t targetBegin, size_t, size_t, size_t) { return targetBegin; }
+size_t AccumulateTestParticlesAVX2(const StageView&, const double*, size_t targetBegin, size_t, size_t, size_t) { return targetBegin; }
+int KeplerDriftAVX2x4(const double*, double, double*, double*, double*, double*, double*, double*) { return -1; }
+#endif
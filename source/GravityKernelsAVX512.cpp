@@ -0,0 +1,95 @@
+// Built with AVX-512 enabled (see CMakelists.txt) and only called when GetSimdLevel() reports it. As in
+// GravityKernelsAVX2.cpp, nothing here may call an inline function or template shared with other translation units
+#include <cstddef>
+#include "SimdKernels.h"
+#include "BodyStore.h"
+#if defined(__AVX512F__)
+#include <immintrin.h>
+
+// 1/sqrt(r2) for eight doubles: 14-bit hardware estimate refined by two Newton-Raphson steps to full double precision
+static inline __m512d GravityRsqrt(__m512d r2)
+{
+    const __m512d threeHalves = _mm512_set1_pd(1.5);
+    const __m512d halfR2 = _mm512_mul_pd(_mm512_set1_pd(0.5), r2);
+    __m512d y = _mm512_rsqrt14_pd(r2);
+    for (int k = 0; k < 2; k++)
+    {
+        y = _mm512_mul_pd(y, _mm512_fnmadd_pd(halfR2, _mm512_mul_pd(y, y), threeHalves));
+    }
+    return y;
+}
+
+size_t AccumulateGravityBlockAVX512(const StageView& s, const double* mu, size_t targetBegin, size_t targetEnd, size_t sourceBegin, size_t sourceEnd)
+{
+    size_t t = targetBegin;
+    const __m512d zero = _mm512_setzero_pd();
+    for (; t + 8 <= targetEnd; t += 8)
+    {
+        const __m512d xt = _mm512_loadu_pd(s.x + t);
+        const __m512d yt = _mm512_loadu_pd(s.y + t);
+        const __m512d zt = _mm512_loadu_pd(s.z + t);
+        __m512d ax = zero, ay = zero, az = zero;
+        for (size_t j = sourceBegin; j < sourceEnd; j++)
+        {
+            __m512d dx = _mm512_sub_pd(_mm512_set1_pd(s.x[j]), xt);
+            __m512d dy = _mm512_sub_pd(_mm512_set1_pd(s.y[j]), yt);
+            __m512d dz = _mm512_sub_pd(_mm512_set1_pd(s.z[j]), zt);
+            __m512d r2 = _mm512_fmadd_pd(dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+            __mmask8 nonZero = _mm512_cmp_pd_mask(r2, zero, _CMP_GT_OQ);
+            __m512d rinv = _mm512_maskz_mov_pd(nonZero, GravityRsqrt(r2));
+            __m512d f = _mm512_mul_pd(_mm512_set1_pd(mu[j]), _mm512_mul_pd(rinv, _mm512_mul_pd(rinv, rinv)));
+            ax = _mm512_fmadd_pd(dx, f, ax);
+            ay = _mm512_fmadd_pd(dy, f, ay);
+            az = _mm512_fmadd_pd(dz, f, az);
+        }
+        _mm512_storeu_pd(s.ax + t, _mm512_add_pd(_mm512_loadu_pd(s.ax + t), ax));
+        _mm512_storeu_pd(s.ay + t, _mm512_add_pd(_mm512_loadu_pd(s.ay + t), ay));
+        _mm512_storeu_pd(s.az + t, _mm512_add_pd(_mm512_loadu_pd(s.az + t), az));
+    }
+    return t;
+}
+
+// Two registers of particles share every source load, as in AccumulateTestParticlesAVX2
+size_t AccumulateTestParticlesAVX512(const StageView& s, const double* packed, size_t targetBegin, size_t targetEnd, size_t first, size_t last)
+{
+    size_t t = targetBegin;
+    const __m512d zero = _mm512_setzero_pd();
+    for (; t + 16 <= targetEnd; t += 16)
+    {
+        const __m512d xt0 = _mm512_loadu_pd(s.x + t), xt1 = _mm512_loadu_pd(s.x + t + 8);
+        const __m512d yt0 = _mm512_loadu_pd(s.y + t), yt1 = _mm512_loadu_pd(s.y + t + 8);
+        const __m512d zt0 = _mm512_loadu_pd(s.z + t), zt1 = _mm512_loadu_pd(s.z + t + 8);
+        __m512d ax0 = zero, ay0 = zero, az0 = zero;
+        __m512d ax1 = zero, ay1 = zero, az1 = zero;
+        for (size_t j = first; j < last; j++)
+        {
+            const double* source = &packed[4 * j];
+            const __m512d sx = _mm512_set1_pd(source[0]), sy = _mm512_set1_pd(source[1]), sz = _mm512_set1_pd(source[2]);
+            const __m512d mu = _mm512_set1_pd(source[3]);
+            __m512d dx0 = _mm512_sub_pd(sx, xt0), dx1 = _mm512_sub_pd(sx, xt1);
+            __m512d dy0 = _mm512_sub_pd(sy, yt0), dy1 = _mm512_sub_pd(sy, yt1);
+            __m512d dz0 = _mm512_sub_pd(sz, zt0), dz1 = _mm512_sub_pd(sz, zt1);
+            __m512d r20 = _mm512_fmadd_pd(dz0, dz0, _mm512_fmadd_pd(dy0, dy0, _mm512_mul_pd(dx0, dx0)));
+            __m512d r21 = _mm512_fmadd_pd(dz1, dz1, _mm512_fmadd_pd(dy1, dy1, _mm512_mul_pd(dx1, dx1)));
+            __m512d rinv0 = _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(r20, zero, _CMP_GT_OQ), GravityRsqrt(r20));
+            __m512d rinv1 = _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(r21, zero, _CMP_GT_OQ), GravityRsqrt(r21));
+            __m512d f0 = _mm512_mul_pd(mu, _mm512_mul_pd(rinv0, _mm512_mul_pd(rinv0, rinv0)));
+            __m512d f1 = _mm512_mul_pd(mu, _mm512_mul_pd(rinv1, _mm512_mul_pd(rinv1, rinv1)));
+            ax0 = _mm512_fmadd_pd(dx0, f0, ax0); ax1 = _mm512_fmadd_pd(dx1, f1, ax1);
+            ay0 = _mm512_fmadd_pd(dy0, f0, ay0); ay1 = _mm512_fmadd_pd(dy1, f1, ay1);
+            az0 = _mm512_fmadd_pd(dz0, f0, az0); az1 = _mm512_fmadd_pd(dz1, f1, az1);
+        }
+        _mm512_storeu_pd(s.ax + t, _mm512_add_pd(_mm512_loadu_pd(s.ax + t), ax0));
+        _mm512_storeu_pd(s.ay + t, _mm512_add_pd(_mm512_loadu_pd(s.ay + t), ay0));
+        _mm512_storeu_pd(s.az + t, _mm512_add_pd(_mm512_loadu_pd(s.az + t), az0));
+        _mm512_storeu_pd(s.ax + t + 8, _mm512_add_pd(_mm512_loadu_pd(s.ax + t + 8), ax1));
+        _mm512_storeu_pd(s.ay + t + 8, _mm512_add_pd(_mm512_loadu_pd(s.ay + t + 8), ay1));
+        _mm512_storeu_pd(s.az + t + 8, _mm512_add_pd(_mm512_loadu_pd(s.az + t + 8), az1));
+    }
+    return t;
+}
+#else
+// Without AVX-512 (a non-x86 build) GetSimdLevel() never picks these, they only have to link
+size_t AccumulateGravityBlockAVX512(const StageView&, const double*, size_t targetBegin, size_t, size_t, size_t) { return targetBegin; }
+size_t AccumulateTestParticlesAVX512(const StageView&, const double*, size_t targetBegin, size_t, size_t, size_t) { return targetBegin; }
+#endif
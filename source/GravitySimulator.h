@@ -4,10 +4,31 @@
 #include <iostream>
 #include <vector>
 #include <mutex>
-#include <queue>
-#include <functional>
-#include <condition_variable>
+#include <memory>
+#include <algorithm>
 #include "PhysicsObject.h"
+#include "BodyStore.h"
+#include "GravityKernels.h"
+#include "ThreadPool.h"
+#include "TaskScheduler.h"
+#include "BarnesHut.h"
+#include "FastMultipole.h"
+#include "TestParticles.h"
+#include "TiledGravity.h"
+#include "BlockTimestep.h"
+#include "DormandPrince.h"
+#include "Symplectic.h"
+#include "IAS15.h"
+#include "Respa.h"
+#include "Encke.h"
+#include "PatchedConics.h"
+#include "ReferenceFrame.h"
+#include "Regularization.h"
+#include "SourcePaths.h"
+#include "Parareal.h"
+#include "Trajectory.h"
+#include "WorldSnapshot.h"
+#include "CommandQueue.h"
 #include <chrono>
 #include <cmath>
 
@@ -15,20 +36,54 @@ using namespace std::chrono_literals;
 
 struct SimType {
 public:
-    enum RunMode { SingleThreaded, MultiThreaded, WorkerThreads, Modified };
+    enum RunMode { SingleThreaded, MultiThreaded, WorkerThreads, Modified, Vectorized, BarnesHut, FastMultipole };
 
 };
 
-enum UpdateType { Verlet, Euler, RungeKutte4, SymplecticEuler };
+enum UpdateType { Verlet, Euler, RungeKutte4, SymplecticEuler, BlockTimestep, Yoshida4, Yoshida6, WisdomHolman, IAS15, RESPA };
 
 class GravitySimulator
 {
 private:
-    std::queue<std::function<void()>> workQueue;
-    std::mutex queueMutex;
-    std::condition_variable condition;
-    bool stop = false;
-    std::vector<std::thread> threads;
+    // Created on first use so single-threaded scenarios never start workers
+    std::unique_ptr<ThreadPool> forcePool;
+    // Runs every parallel part of a step in SimType::WorkerThreads, also created on first use
+    std::unique_ptr<TaskScheduler> taskScheduler;
+    static constexpr size_t WorkerGrain = 64;
+    std::vector<std::pair<size_t, size_t>> contactCandidates;
+    std::mutex contactCandidatesMutex;
+    // One private accumulator per pool participant (slot 0 unused, participant 0 writes the stage directly)
+    std::vector<AccelerationBuffer> threadAccelerations;
+    std::vector<size_t> rowBounds;
+    BarnesHutTree barnesHutTree;
+    FastMultipoleSolver fastMultipole;
+    TestParticleSources testParticleSources;
+    TiledGravity tiledGravity;
+    BlockHermiteIntegrator blockHermite;
+    DormandPrince dormandPrince;
+    WisdomHolmanMapping wisdomHolman;
+    IAS15Integrator ias15;
+    RespaIntegrator respa;
+    std::vector<int> respaLevels;     // PhysicsObject::respaLevel of each body in the store
+    EnckePropagator enckePropagator;
+    std::vector<size_t> enckeBodies;  // Store indices of the bodies EnckePropagator moves this step
+    PatchedConicPropagator patchedConics;
+    FramePropagator framePropagator;
+    KSPropagator ksPropagator;
+    SourcePaths sourcePaths;          // Massive bodies across this step, shared by the KS, Encke and frame propagators
+    PararealIntegrator parareal;
+    std::vector<std::pair<size_t, size_t>> encounterBodies;   // Store index of each body KSPropagator moves this step, and of its neighbour
+    std::vector<size_t> frameBodies;  // Store indices of the reference frame members FramePropagator moves this step
+    TripleBuffer<WorldSnapshot> snapshots;  // Written by the simulation thread only, read by the renderer only
+    static constexpr size_t CommandCapacity = 256;
+    BoundedQueue<SimulatorCommand, CommandCapacity> commands;     // Posted from any thread, applied by the simulation thread
+    TrailSlab trailSlab;                    // Every object's pastPositions ring, laid out again when the objects or numberOfStoredPositions change
+    std::vector<TrailRing*> trailRings;
+    std::vector<PhysicsObject*> removedTrails;  // Removed objects whose rings still point into the slab, detached at its next layout
+    bool trailsDirty = true;
+    size_t publishedFrames = 0;
+    std::vector<std::pair<const PhysicsObject*, int>> snapshotOrder;   // Objects sorted by address, to find reference indices
+    static constexpr double RKFMinStep = 1e-6; // Steps this short are accepted whatever their error, so a singular encounter cannot stall the frame
 public:
     bool finished = false;
     bool enableCollisions = false;
@@ -37,6 +92,10 @@ public:
     std::vector<PhysicsObject*> allObjects;
     std::vector<PhysicsObject*> gravitationalObjects;
     std::vector<PhysicsObject*> physicsObjects;
+    // Packed copy of every body that the force kernels and integrators iterate, see BodyStore.h
+    BodyStore bodies;
+    std::vector<PhysicsObject*> bodyHandles;
+    bool bodiesDirty = true;
 	PhysicsObject* noneObject = new PhysicsObject("None", 0, 1, triple(0,0,0), triple(0,0,0));
     PhysicsObject* selectedObject = noneObject;
     // New members for rotating reference frame:
@@ -53,16 +112,32 @@ public:
     SimType::RunMode type = SimType::Modified;
     UpdateType updateType = UpdateType::SymplecticEuler;
     int numThreads = (int)std::thread::hardware_concurrency();
-    std::mutex accelMutex;
     std::mutex storingPositionsMutex;
     bool useRK = true;
     bool useRKF = false;
+    bool onRails = false;   // Patched conics instead of the step integrator, for warps too long to integrate, see PatchedConics.h
+    bool regularizeEncounters = false; // Massless bodies passing close to a massive one leave the step integrator for KSPropagator, see Regularization.h
     bool showTraces = true;
     int RKStep = 0;
     int RKFStep = 1;
+    double rkfTolerance = 1e-9;  // Relative error per step allowed by useRKF, against each body's own change in position and velocity
+    double rkfStepSize = 0;      // Step the adaptive integrator will try next, carried from frame to frame
+    size_t rkfAcceptedSteps = 0, rkfRejectedSteps = 0;
     int numberOfCalculationsPerThread = 0;
     float zoomLevel = 1;
     int substeps = 1;
+    double barnesHutTheta = 0.5; // Opening angle for SimType::BarnesHut, 0 opens every node, clamped to BarnesHutTree::MaxTheta
+    // Expansion order (1..FastMultipoleSolver::MaxOrder) and separation of SimType::FastMultipole, whose cells interact
+    // through expansions when (rA + rB) < theta * d. On a 20k-body Plummer cloud (FastMultipoleAccuracy) order 8 at
+    // theta 0.4 keeps the worst relative force error near 2e-4 and the 99th percentile near 4e-6; order 4 at theta 0.6
+    // evaluates nearly five times faster but lets the worst bodies reach 15%, fine for looks and not for orbits
+    int fmmOrder = 8;
+    double fmmTheta = 0.4;
+    double blockTimestepEta = 0.02; // Accuracy parameter of UpdateType::BlockTimestep, smaller takes shorter steps
+    int respaSubsteps = 8;          // Steps of each UpdateType::RESPA level inside one step of the level below, see Respa.h
+    PararealCoarse pararealCoarse = PararealCoarse::PatchedConics; // FastForwardTo's coarse propagator, see Parareal.h
+    int pararealCoarseSteps = 1;    // Steps per slice of the coarse propagator
+    double pararealTolerance = 1.0; // Largest position correction (m) at which FastForwardTo stops iterating
     double lastMouseX = 0, lastMouseY = 0;
     double currentMouseX = 0, currentMouseY = 0;
     double viewPosX = 0, viewPosY = 0;
@@ -76,23 +151,119 @@ public:
     bool paused = false;
     bool storingPositions = true;
     int numberOfStoredPositions = 1000;
+    bool decimateTrails = true;          // Simplify trails as they are stored, keeping points only where they bend, see TrailFilter
+    double trailTolerance = 0.5;         // Largest miss (pixels) of a simplified trail from the samples it replaces
+    double trailMetresPerPixel = 0;      // Screen scale the tolerance is measured at, posted by the renderer as it zooms
+    bool recordTrajectories = false;     // Keep every object's path as Hermite segments for PositionAt and the trails, see Trajectory.h
+    double trajectoryTolerance = 1000.0; // Largest miss (m) of a recorded segment from the step ends it replaces
+    int maxTrajectorySegments = 1000;    // Closed segments kept per object, oldest dropped first
     int currentObjectIndex = 0;
 
     void RKSimStep(double dt)
     {
         switch (RKStep) {
-        case 1: for (PhysicsObject* object : allObjects) {
-            object->RK4Step1(dt);
-        }break;
-        case 2: for (PhysicsObject* object : allObjects) {
-            object->RK4Step2(dt);
-        }break;
-        case 3: for (PhysicsObject* object : allObjects) {
-            object->RK4Step3(dt);
-        }break;
-        case 4: for (PhysicsObject* object : allObjects) {
-            object->RK4Step4(dt);
-        }break;
+        case 1: RK4TrialPositions(bodies.stages[2], bodies.stages[1], dt); break;
+        case 2: RK4TrialPositions(bodies.stages[3], bodies.stages[2], dt * 0.5); break;
+        case 3: RK4TrialPositions(bodies.stages[4], bodies.stages[3], dt * 0.5); break;
+        case 4: RK4Combine(dt); break;
+        }
+    }
+
+    // Projects every body from its start-of-step state to the trial position the next RK stage is evaluated at
+    void RK4TrialPositions(BodyStage& next, const BodyStage& previous, double h)
+    {
+        const double halfH2 = 0.5 * h * h;
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            next.x[i] = bodies.x[i] + bodies.vx[i] * h + previous.ax[i] * halfH2;
+            next.y[i] = bodies.y[i] + bodies.vy[i] * h + previous.ay[i] * halfH2;
+            next.z[i] = bodies.z[i] + bodies.vz[i] * h + previous.az[i] * halfH2;
+        }
+    }
+
+    void RK4Combine(double dt)
+    {
+        const BodyStage& s1 = bodies.stages[1];
+        const BodyStage& s2 = bodies.stages[2];
+        const BodyStage& s3 = bodies.stages[3];
+        const BodyStage& s4 = bodies.stages[4];
+        const double halfDt2 = 0.5 * dt * dt;
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            double ax = (s1.ax[i] + 2 * s4.ax[i] + 2 * s3.ax[i] + s2.ax[i]) / 6;
+            double ay = (s1.ay[i] + 2 * s4.ay[i] + 2 * s3.ay[i] + s2.ay[i]) / 6;
+            double az = (s1.az[i] + 2 * s4.az[i] + 2 * s3.az[i] + s2.az[i]) / 6;
+            bodies.x[i] += bodies.vx[i] * dt + ax * halfDt2;
+            bodies.y[i] += bodies.vy[i] * dt + ay * halfDt2;
+            bodies.z[i] += bodies.vz[i] * dt + az * halfDt2;
+            bodies.vx[i] += ax * dt;
+            bodies.vy[i] += ay * dt;
+            bodies.vz[i] += az * dt;
+            ClampToLightSpeed(i);
+        }
+    }
+
+    /// <summary>
+    /// Advances the store by h with Dormand-Prince 5(4) steps sized to rkfTolerance. The first stage is evaluated
+    /// once per call, since scenario code and thrust may have changed the bodies since the last frame; after that
+    /// each accepted step's last stage becomes the next step's first. A rejected step is retried with the step
+    /// the error estimate suggests, and the step that ends the frame is trimmed to land on it exactly.
+    /// </summary>
+    void AdvanceDormandPrince(double h)
+    {
+        if (bodies.count == 0 || h <= 0)
+            return;
+        dormandPrince.Resize(bodies.count);
+        RKFStep = DormandPrince::FirstStage;
+        bodies.stages[RKFStep].ClearAcceleration();
+        CalculateForcesForRunMode();
+
+        double step = rkfStepSize > 0 ? rkfStepSize : h;
+        double t = 0;
+        while (t < h)
+        {
+            double remaining = h - t;
+            bool lastStep = step >= remaining * (1 - 1e-12);
+            double trial = lastStep ? remaining : step;
+            for (RKFStep = DormandPrince::FirstStage + 1; RKFStep <= DormandPrince::LastStage; RKFStep++)
+            {
+                dormandPrince.TrialState(bodies, RKFStep, trial);
+                CalculateForcesForRunMode();
+            }
+            double error = dormandPrince.ErrorRatio(bodies, trial, rkfTolerance);
+            // The ratio goes as h^4 (see DormandPrince::ErrorRatio), with the usual safety factor and growth limits
+            double factor = error > 0 ? std::clamp(0.9 * std::pow(error, -0.25), 0.2, 5.0) : 5.0;
+            if (error <= 1.0 || trial <= RKFMinStep) {
+                dormandPrince.Accept(bodies);
+                for (size_t i = 0; i < bodies.count; i++)
+                {
+                    ClampToLightSpeed(i);
+                }
+                t = lastStep ? h : t + trial;
+                rkfAcceptedSteps++;
+                // A step trimmed to the end of the frame says little about the step the orbit wants
+                if (!lastStep || factor < 1.0) {
+                    step = trial * factor;
+                }
+            }
+            else {
+                step = std::max(trial * factor, RKFMinStep);
+                rkfRejectedSteps++;
+            }
+        }
+        rkfStepSize = step;
+        bodies.ClearAccelerations();
+    }
+
+    void ClampToLightSpeed(size_t i)
+    {
+        constexpr double c = 299792458.0;
+        double v2 = bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i] + bodies.vz[i] * bodies.vz[i];
+        if (v2 > c * c) {
+            double scale = c / std::sqrt(v2);
+            bodies.vx[i] *= scale;
+            bodies.vy[i] *= scale;
+            bodies.vz[i] *= scale;
         }
     }
 
@@ -122,64 +293,75 @@ public:
 
     void RunSimulation(double inputdt, int substeps)
     {
+        ApplyCommands();
+        if (trailsDirty || trailSlab.GetCapacity() != (size_t)std::max(numberOfStoredPositions, 1)) {
+            LayoutTrails();
+        }
         if (paused)
         {
+            PublishSnapshot();
             return;
         }
         SetReferenceObjects();
         double dt = timeWarp * inputdt;
         myDt = inputdt;
+        // The adaptive integrators choose their own steps inside the frame
+        if (onRails || useRKF || (!useRK && updateType == UpdateType::IAS15)) {
+            substeps = 1;
+        }
         for (int i = 0; i < substeps; i++)
         {
-            if (!useRK)
+            if (onRails)
+            {
+                if (oldPositionStoreDelay != positionStoreDelay) {
+                    nextStorageTime = timeElapsed + positionStoreDelay;
+                    oldPositionStoreDelay = positionStoreDelay;
+                }
+                // Thrust and collisions have no part in the conics, the frame is a single analytic step
+                PreForceUpdateAll(timeElapsed, dt);
+                GatherBodies();
+                patchedConics.Advance(bodies, dt);
+                ScatterBodies();
+                UpdateSpheresOfInfluence();
+                AdvanceClock(dt);
+            }
+            else if (useRKF)
+            {
+                if (oldPositionStoreDelay != positionStoreDelay) {
+                    nextStorageTime = timeElapsed + positionStoreDelay;
+                    oldPositionStoreDelay = positionStoreDelay;
+                }
+                PreForceUpdateAll(timeElapsed, dt);
+                GatherBodies();
+                BeginPropagatedSteps(dt);
+                AdvanceDormandPrince(dt);
+                FinishEnckeStep();
+                FinishFrameStep();
+                FinishEncounterStep();
+                ScatterBodies();
+                if (enableCollisions) SolveDistanceConstraints();
+                AdvanceClock(dt);
+            }
+            else if (!useRK)
             {
                 if (oldPositionStoreDelay != positionStoreDelay) {
                     nextStorageTime = timeElapsed + positionStoreDelay;
                     oldPositionStoreDelay = positionStoreDelay;
                 }
                 PreForceUpdateAll(timeElapsed, dt / substeps);
-                switch (type) {
-                case 0:   CalculateForces();      break;
-                case 1:   CalculateForcesMT();    break;
-                case 2:   CalculateForcesWorker();    break;
-                case 3:   CalculateForcesModified();  break;
+                GatherBodies();
+                BeginPropagatedSteps(dt / substeps);
+                if (!EvaluatesOwnForces(updateType)) {
+                    CalculateForcesForRunMode();
                 }
 
                 UpdateObjects((dt) / substeps, updateType);
+                FinishEnckeStep();
+                FinishFrameStep();
+                FinishEncounterStep();
+                ScatterBodies();
                 if (enableCollisions) SolveDistanceConstraints();
-                timeElapsed += dt / substeps;
-                seconds += dt / substeps;
-                if (seconds >= 60.0) {
-                    minutes += static_cast<int>(seconds) / 60;
-                    seconds = fmod(seconds, 60.0); // Remainder after dividing by 60
-
-                    if (minutes >= 60) {
-                        hours += minutes / 60;
-                        minutes %= 60; // Remainder after dividing by 60
-                    }
-
-                    if (hours >= 24) {
-                        days += hours / 24;
-                        hours %= 24; // Remainder after dividing by 24
-                    }
-
-                    if (days >= 365) {
-                        years += days / 365;
-                        days %= 365; // Remainder after dividing by 365
-                    }
-                }
-                if (timeElapsed > nextStorageTime && storingPositions) {
-                    storingPositionsMutex.lock();
-                    for (PhysicsObject* object : allObjects)
-                    {
-                        object->StoreCurrentPosition(numberOfStoredPositions);
-                    }
-                    storingPositionsMutex.unlock();
-                    if (positionStoreDelay < dt / substeps) {
-                        nextStorageTime += dt / substeps;
-                    }
-                    else { nextStorageTime += positionStoreDelay; }
-                }
+                AdvanceClock(dt / substeps);
             }
             else
             {
@@ -188,710 +370,1281 @@ public:
                     oldPositionStoreDelay = positionStoreDelay;
                 }
                 PreForceUpdateAll(timeElapsed, dt / substeps);
+                GatherBodies();
+                BeginPropagatedSteps(dt / substeps);
                 for (RKStep = 1; RKStep < 5; RKStep++)
                 {
-                    switch (type) {
-                    case 0:   CalculateForces();      break;
-                    case 1:   CalculateForcesMT();    break;
-                    case 2:   CalculateForcesWorker();    break;
-                    case 3:   CalculateForcesModified();  break;
-                    }
+                    CalculateForcesForRunMode();
                     RKSimStep(dt / substeps);
                 }
+                FinishEnckeStep();
+                FinishFrameStep();
+                FinishEncounterStep();
+                ScatterBodies();
+                bodies.ClearAccelerations();
                 SolveDistanceConstraints();
-                timeElapsed += dt / substeps;
-                seconds += dt / substeps;
-                if (seconds >= 60.0) {
-                    minutes += static_cast<int>(seconds) / 60;
-                    seconds = fmod(seconds, 60.0); // Remainder after dividing by 60
-
-                    if (minutes >= 60) {
-                        hours += minutes / 60;
-                        minutes %= 60; // Remainder after dividing by 60
-                    }
-
-                    if (hours >= 24) {
-                        days += hours / 24;
-                        hours %= 24; // Remainder after dividing by 24
-                    }
-
-                    if (days >= 365) {
-                        years += days / 365;
-                        days %= 365; // Remainder after dividing by 365
-                    }
-                }
-                if (timeElapsed > nextStorageTime && storingPositions) {
-                    storingPositionsMutex.lock();
-                    for (PhysicsObject* object : allObjects)
-                    {
-                        object->StoreCurrentPosition(numberOfStoredPositions);
-                        object->ClearForce();
-                    }
-                    storingPositionsMutex.unlock();
-                    if (positionStoreDelay < dt / substeps) {
-                        nextStorageTime += dt / substeps;
-                    }
-                    else { nextStorageTime += positionStoreDelay; }
-                }
-                else {
-                    for (PhysicsObject* object : allObjects)
-                    {
-                        object->ClearForce();
-                    }
-                }
+                AdvanceClock(dt / substeps);
             }
         }
+        PublishSnapshot();
         for (PhysicsObject* object : allObjects)
         {
             object->ClearExternalForce();
         }
     }
 
-    void ResetUniverseOrigin(PhysicsObject* selectedObject) {
-        if(selectedObject != nullptr){
-            for (PhysicsObject* object : allObjects)
-            {
-                if (object == selectedObject) {
-                    continue;
-                }
-                else {
-                    object->p -= selectedObject->p;
-                }
+    /// <summary>
+    /// Copies the state the renderer draws into the back slot of the snapshot triple buffer and publishes it.
+    /// RunSimulation calls it at the end of every frame, paused or not, before the external forces are cleared.
+    /// </summary>
+    void PublishSnapshot()
+    {
+        WorldSnapshot& world = snapshots.Back();
+        const size_t count = allObjects.size();
+        world.objects.assign(allObjects.begin(), allObjects.end());
+        world.positions.resize(count);
+        world.velocities.resize(count);
+        world.externalForces.resize(count);
+        world.selectedPositions.resize(count);
+        world.referenceIndices.resize(count);
+        const PhysicsObject* selected = selectedObject ? selectedObject : noneObject;
+        world.selectedIndex = -1;
+        world.referenceIndex = -1;
+        for (size_t i = 0; i < count; i++)
+        {
+            const PhysicsObject* object = allObjects[i];
+            world.positions[i] = object->p;
+            world.velocities[i] = object->v;
+            world.externalForces[i] = object->ExternalForces;
+            world.selectedPositions[i] = RelativePosition(object, selected);
+            world.referenceIndices[i] = -1;
+            if (object == selectedObject) {
+                world.selectedIndex = (int)i;
+            }
+            if (object == referenceObject) {
+                world.referenceIndex = (int)i;
             }
-            selectedObject->p = vec3(0, 0, 0);
         }
-    }
-
-    void SolveDistanceConstraints() {
-        size_t k = allObjects.size();
-        for (int i = 0; i < k; i++) {
-            for (int j = i + 1; j < k; j++) {
-                triple displacement = (allObjects[j]->p - allObjects[i]->p);
-                double distance = displacement.magnitude();
-                if (distance == 0) {
-                    allObjects[i]->p -= triple(0, 1, 0);
-                    allObjects[j]->p += triple(0, 1, 0);
-                    triple displacement = (allObjects[j]->p - allObjects[i]->p);
-                    double distance = displacement.magnitude();
-                }
-                double combinedRadii = allObjects[i]->radius + allObjects[j]->radius;
-
-                // Check if the objects are intersecting
-                if (distance < combinedRadii) {
-                    // Normalize the displacement vector to get the collision normal
-                    triple normal = displacement.normalized();
-
-                    // Calculate the overlap (negative means penetration)
-                    double overlap = distance - combinedRadii;
-
-                    // Adjust positions to resolve the overlap
-                    double totalMass = allObjects[i]->m + allObjects[j]->m;
-                    allObjects[j]->p -= normal * (overlap * (allObjects[i]->m / totalMass));
-                    allObjects[i]->p += normal * (overlap * (allObjects[j]->m / totalMass));
-                    double e = 0.5;
-                    triple* v1 = &allObjects[i]->v;
-                    triple* v2 = &allObjects[j]->v;
-                    double m1 = allObjects[i]->m;
-                    double m2 = allObjects[j]->m;
-                    triple relativeVelocity = *v2 - *v1;
-                    double velocityAlongNormal = relativeVelocity.Dot(normal);
-                    if (velocityAlongNormal > 0) continue; // Skip if moving apart
-
-                    double restitution = 0.5; // Coefficient of restitution
-                    double impulseMagnitude = -(1 + restitution) * velocityAlongNormal / (1 / m1 + 1 / m2);
-                    triple impulse = normal * impulseMagnitude;
-
-                    *v1 -= impulse / m1;
-                    *v2 += impulse / m2;
-
-                    /**v1 =    (e * *v1 * m2 - e * *v2 * m2 + m1 * *v1 + m2 * *v2) / (m1 + m2);
-                    *v2 = -1*(e * *v1 * m1 - e * *v2 * m1 - m1 * *v1 - m2 * *v2) / (m1 + m2);*/
-                    if (v1->magnitude() > LIGHTSPEED) {
-                        *v1 = v1->normalized() * LIGHTSPEED;
-                    }
-                    if (v2->magnitude() > LIGHTSPEED) {
-                        *v2 = v2->normalized() * LIGHTSPEED;
-                    }
-                }
+        snapshotOrder.resize(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            snapshotOrder[i] = { allObjects[i], (int)i };
+        }
+        std::sort(snapshotOrder.begin(), snapshotOrder.end());
+        for (size_t i = 0; i < count; i++)
+        {
+            const PhysicsObject* reference = allObjects[i]->referenceObject;
+            const auto found = std::lower_bound(snapshotOrder.begin(), snapshotOrder.end(), std::make_pair(reference, -1));
+            if (reference && found != snapshotOrder.end() && found->first == reference) {
+                world.referenceIndices[i] = found->second;
             }
         }
+        world.timeElapsed = timeElapsed;
+        world.years = years;
+        world.days = days;
+        world.hours = hours;
+        world.minutes = minutes;
+        world.seconds = seconds;
+        world.timeWarp = timeWarp;
+        world.substeps = substeps;
+        world.paused = paused;
+        world.frame = publishedFrames++;
+        snapshots.Publish();
     }
 
-    void PurgeObjects()
+    /// <summary>
+    /// Queues a change for the simulation thread, which applies everything queued at the start of its next frame,
+    /// in order, so nothing it reads mid-step changes under it. Safe from any number of threads without locks;
+    /// false when the queue is full and the command was dropped. Objects added this way stay owned by the caller, and
+    /// one removed must outlive the snapshot the renderer may still be drawing it from.
+    /// </summary>
+    bool Post(const SimulatorCommand& command)
     {
-        allObjects.clear();
+        return commands.TryPush(command);
     }
 
-    void CalculateForces()
+    // Applies every queued command, on the simulation thread
+    void ApplyCommands()
     {
-        size_t k = allObjects.size();
-        for (int i = 0; i < k; i++)
+        SimulatorCommand command;
+        while (commands.TryPop(command))
         {
-            allObjects[i]->GPE = 0;
-            for (int j = i; j < k; j++)
-            {
-                if (i == j)
-                    continue;
-                if (allObjects[i]->contributesToGravity || allObjects[j]->contributesToGravity)
-                {
-                    CalculateForce(i, j);
-                }
-            }
-            CalculateExternalForce(i);
+            Apply(command);
         }
     }
 
-    void CalculateForcesMT()
+    void Apply(const SimulatorCommand& command)
     {
-        std::vector<std::thread> threads;
-        size_t k = allObjects.size();
-        for (int i = 0; i < k; i++)
-        {
-            threads.push_back(std::thread([this, i, k]() {
-                allObjects[i]->GPE = 0;
-                for (int j = i; j < k; j++)
-                {
-                    if (i == j)
-                        continue;
-                    if (allObjects[i]->contributesToGravity || allObjects[j]->contributesToGravity)
-                    {
-                        CalculateForce(i, j);
-
-                    }
-                }
-                }));
+        switch (command.type) {
+        case SimulatorCommandType::SetTimeWarp:
+            timeWarp = command.value;
+            break;
+        case SimulatorCommandType::ScaleTimeWarp:
+            timeWarp = std::max(timeWarp * command.value, 0.01);
+            break;
+        case SimulatorCommandType::ScaleSubsteps:
+            if (useRKF) {
+                rkfTolerance = std::min(rkfTolerance / command.value, 1e-3);
+            }
+            else {
+                substeps = std::max((int)(substeps * command.value), 1);
+            }
+            break;
+        case SimulatorCommandType::SetPaused:
+            paused = command.value != 0;
+            break;
+        case SimulatorCommandType::TogglePause:
+            paused = !paused;
+            break;
+        case SimulatorCommandType::Select:
+            selectedObject = command.object ? command.object : noneObject;
+            break;
+        case SimulatorCommandType::SelectNext:
+            if (!allObjects.empty()) {
+                const int count = (int)allObjects.size();
+                const int current = (int)(std::find(allObjects.begin(), allObjects.end(), selectedObject) - allObjects.begin());
+                const int from = current < count ? current : (command.value > 0 ? -1 : 0);
+                selectedObjectIndex = ((from + (int)command.value) % count + count) % count;
+                selectedObject = allObjects[selectedObjectIndex];
+            }
+            break;
+        case SimulatorCommandType::SetReference:
+            if (command.object) {
+                command.object->referenceObject = command.target;
+            }
+            break;
+        case SimulatorCommandType::AddObject:
+            if (command.object && std::find(allObjects.begin(), allObjects.end(), command.object) == allObjects.end()) {
+                AddObject(command.object);
+            }
+            break;
+        case SimulatorCommandType::RemoveObject:
+            if (command.object) {
+                RemoveObject(command.object);
+                ForgetObject(command.object);
+            }
+            break;
+        case SimulatorCommandType::SetSetting:
+            switch (command.setting) {
+            case SimulatorSetting::PositionStoreDelay: positionStoreDelay = (float)command.value; break;
+            case SimulatorSetting::NumberOfStoredPositions: numberOfStoredPositions = (int)command.value; break;
+            case SimulatorSetting::OnRails: onRails = command.value != 0; break;
+            case SimulatorSetting::RegularizeEncounters: regularizeEncounters = command.value != 0; break;
+            case SimulatorSetting::RecordTrajectories: recordTrajectories = command.value != 0; break;
+            case SimulatorSetting::DecimateTrails: decimateTrails = command.value != 0; break;
+            case SimulatorSetting::TrailScale: trailMetresPerPixel = command.value; break;
+            case SimulatorSetting::FmmOrder: fmmOrder = (int)command.value; break;
+            case SimulatorSetting::FmmTheta: fmmTheta = command.value; break;
+            }
+            break;
         }
-        JoinThreads(threads);
-        threads.clear();
     }
 
-    void CalculateForcesWorker() {
-        int k = (int)allObjects.size();
-        for (int i = 0; i < k; i++)
+    // Gives every object a region of the trail slab, starting the trail of any new one at its current position. Like
+    // the stores, it waits for a frame the renderer is not drawing the trails in rather than block on it
+    void LayoutTrails()
+    {
+        if (!storingPositionsMutex.try_lock())
+            return;
+        std::lock_guard<std::mutex> guard(storingPositionsMutex, std::adopt_lock);
+        for (PhysicsObject* object : removedTrails)
         {
-            {
-                std::lock_guard<std::mutex> lock(queueMutex);
-                workQueue.push([this, i, k] { CalculateThisObjectsForces(i, k); });
+            if (std::find(allObjects.begin(), allObjects.end(), object) == allObjects.end()) {
+                object->pastPositions.Detach();
+            }
+        }
+        removedTrails.clear();
+        trailRings.clear();
+        for (PhysicsObject* object : allObjects)
+        {
+            trailRings.push_back(&object->pastPositions);
+        }
+        trailSlab.Layout(trailRings, (size_t)std::max(numberOfStoredPositions, 1));
+        for (PhysicsObject* object : allObjects)
+        {
+            if (object->pastPositions.empty()) {
+                object->StoreCurrentPosition(timeElapsed, 0.0, -HUGE_VAL);
             }
-            condition.notify_one();
         }
+        trailsDirty = false;
     }
 
-    void CalculateForcesModified() {
-        size_t k = gravitationalObjects.size();
-        for (int i = 0; i < k; i++)
+    // Drops every pointer the simulator and the remaining objects hold to an object that has left the simulation
+    void ForgetObject(const PhysicsObject* object)
+    {
+        for (PhysicsObject* other : allObjects)
         {
-            for (int j = i; j < k; j++)
-            {
-                if (i == j)
-                    continue;
-                CalculateForceGrav(i, j);
+            if (other->referenceObject == object) {
+                other->referenceObject = nullptr;
             }
-        }
-        size_t l = physicsObjects.size();
-        for (int i = 0; i < l; i++) {
-            for (int j = 0; j < k; j++) {
-                CalculateForcePhys(i, j);
-                l = physicsObjects.size();
-                k = gravitationalObjects.size();
+            if (other->sphereOfInfluence == object) {
+                other->sphereOfInfluence = nullptr;
             }
         }
-        size_t m = allObjects.size();
-        for (int i = 0; i < m; i++) {
-            CalculateExternalForce(i);
+        if (selectedObject == object) {
+            selectedObject = noneObject;
+        }
+        if (referenceObject == object) {
+            referenceObject = nullptr;
+        }
+        if (frameOrientationObject == object) {
+            frameOrientationObject = nullptr;
         }
     }
 
-    void CalculateExternalForce(int i) {
-        auto* obj = allObjects[i];
-        if (!useRK)
-        {
-            obj->a += obj->GetExternalForces() / obj->m;
-            return;
-        }
+    // Newest published snapshot, for the renderer thread; it stays valid until the next call
+    const WorldSnapshot& LatestSnapshot()
+    {
+        return snapshots.Latest();
+    }
 
-        // Use an if/else chain instead of a switch to avoid unannotated fallthrough warnings.
-        if (RKStep == 1) {
-            obj->a1 += obj->GetExternalForces() / obj->m;
+    // Sets aside the massless bodies the KS, Encke and frame propagators move this step, then records the massive
+    // bodies' start states once for all three. Setting aside only moves massless bodies, so the record is the same
+    void BeginPropagatedSteps(double h)
+    {
+        BeginEncounterStep(h);
+        BeginEnckeStep();
+        BeginFrameStep();
+        if (!encounterBodies.empty() || !enckeBodies.empty() || !frameBodies.empty()) {
+            sourcePaths.Begin(bodies, h);
         }
-        else if (RKStep == 2) {
-            obj->a2 += obj->GetExternalForces() / obj->m;
+    }
+
+    /// <summary>
+    /// Picks out the massless bodies passing close to a massive one this step and moves them behind the end of the
+    /// store, so neither the step integrator nor its step-size control sees them and the rest of the system keeps
+    /// its step. Encke bodies and frame members have propagators of their own and are left to them.
+    /// </summary>
+    void BeginEncounterStep(double h)
+    {
+        encounterBodies.clear();
+        if (!regularizeEncounters)
+            return;
+        const bool adaptive = useRKF || (!useRK && updateType == UpdateType::IAS15);
+        const double encounterTime = (adaptive ? KSPropagator::AdaptiveStepEncounter : KSPropagator::FixedStepEncounter) * std::abs(h);
+        for (size_t i = bodies.massiveCount; i < bodies.count; i++)
+        {
+            const PhysicsObject* object = bodyHandles[i];
+            if (object->enckePrimary || (object->frame && AnchorIndex(object->frame) >= 0))
+                continue;
+            const int neighbour = ksPropagator.Neighbour(bodies, i, h, encounterTime);
+            if (neighbour >= 0) {
+                encounterBodies.push_back({ i, (size_t)neighbour });
+            }
         }
-        else if (RKStep == 3) {
-            obj->a3 += obj->GetExternalForces() / obj->m;
+        if (encounterBodies.empty())
+            return;
+        // Walking down from the highest index keeps the slots still to be moved where they were found
+        for (size_t k = encounterBodies.size(); k-- > 0;)
+        {
+            encounterBodies[k].first = SetAside(encounterBodies[k].first);
         }
-        else if (RKStep == 4) {
-            obj->a4 += obj->GetExternalForces() / obj->m;
+    }
+
+    // Swaps massless body i into the last slot of the store and shortens the store past it, so neither the step
+    // integrator nor its step-size control sees it. Returns the slot it went to
+    size_t SetAside(size_t i)
+    {
+        const size_t to = bodies.count - 1;
+        bodies.Swap(i, to);
+        std::swap(bodyHandles[i], bodyHandles[to]);
+        bodyHandles[i]->storeIndex = (int)i;
+        bodyHandles[to]->storeIndex = (int)to;
+        bodies.count--;
+        return to;
+    }
+
+    // Brings the encounter bodies back into the store, moved across the step in regularized coordinates. The objects
+    // still hold the state from the start of the step
+    void FinishEncounterStep()
+    {
+        bodies.count += encounterBodies.size();
+        for (const std::pair<size_t, size_t>& encounter : encounterBodies)
+        {
+            const PhysicsObject* object = bodyHandles[encounter.first];
+            ksPropagator.Advance(bodies, sourcePaths, encounter.first, encounter.second, object->p, object->v);
+            ClampToLightSpeed(encounter.first);
         }
-        
     }
 
-    void CalculateForcesModifiedMT() {
-        std::vector<std::thread> threads;
-        size_t k = gravitationalObjects.size();
-        for (int i = 0; i < k; i++)
+    /// <summary>
+    /// Jumps the simulation to time by Parareal: the window is split into slices (a slice per force pool participant
+    /// when 0) integrated with IAS15 side by side, against pararealCoarseSteps serial steps of pararealCoarse per
+    /// slice, until the corrections fall under pararealTolerance or maxIterations sweeps. Gravity and the external forces
+    /// as they are now only; Encke, frames, regularization and collisions sit the jump out.
+    /// </summary>
+    PararealReport FastForwardTo(double time, int slices = 0, int maxIterations = 16)
+    {
+        const double duration = time - timeElapsed;
+        if (duration <= 0)
+            return PararealReport();
+        GatherBodies();
+        parareal.coarseMethod = pararealCoarse;
+        parareal.coarseSteps = std::max(pararealCoarseSteps, 1);
+        parareal.tolerance = pararealTolerance;
+        PararealReport report = parareal.Integrate(bodies, duration, slices, maxIterations, GetForcePool());
+        for (size_t i = 0; i < bodies.count; i++)
         {
-            threads.push_back(std::thread([this, i, k]()
-                {
-                    for (int j = i; j < k; j++)
-                    {
-                        if (i == j)
-                            continue;
-                        CalculateForceGrav(i, j);
-                    }
-                }));
+            ClampToLightSpeed(i);
         }
-        JoinThreads(threads);
-        threads.clear();
-        size_t l = physicsObjects.size();
-        for (int i = 0; i < l; i++) {
-            for (int j = 0; j < k; j++) {
-                CalculateForcePhys(i, j);
-            }
+        ScatterBodies();
+        bodies.ClearAccelerations();
+        AdvanceClock(duration, true);
+        PublishSnapshot();
+        for (PhysicsObject* object : allObjects)
+        {
+            object->ClearExternalForce();
         }
+        return report;
     }
 
-    void CalculateThisObjectsForces(int i, int k) {
-        for (int j = i; j < k; j++)
+    // Collects the massless bodies that follow Encke's method this step and sets them aside like the encounter bodies,
+    // so they cost the step integrator nothing and leave its step to the rest of the system
+    void BeginEnckeStep()
+    {
+        enckeBodies.clear();
+        for (size_t i = bodies.massiveCount; i < bodies.count; i++)
         {
-            if (i == j)
-                continue;
-            if (allObjects[i]->contributesToGravity || allObjects[j]->contributesToGravity)
-            {
-                CalculateForce(i, j);
+            const PhysicsObject* primary = bodyHandles[i]->enckePrimary;
+            if (primary && primary->storeIndex >= 0 && (size_t)primary->storeIndex < bodies.massiveCount
+                && bodyHandles[primary->storeIndex] == primary) {
+                enckeBodies.push_back(i);
             }
         }
+        for (size_t k = enckeBodies.size(); k-- > 0;)
+        {
+            enckeBodies[k] = SetAside(enckeBodies[k]);
+        }
     }
 
-    void CalculateForcesForObject(int currentObj, int totalNumber)
+    // Brings the Encke bodies back into the store, propagated across the step. The objects still hold the state from
+    // the start of the step
+    void FinishEnckeStep()
     {
-
-        for (int j = currentObj; j < totalNumber; j++)
+        bodies.count += enckeBodies.size();
+        for (size_t i : enckeBodies)
         {
-            if (currentObj == j)
-                continue;
+            PhysicsObject* object = bodyHandles[i];
+            PhysicsObject* primary = object->enckePrimary;
+            enckePropagator.Advance(bodies, sourcePaths, i, (size_t)primary->storeIndex, primary, object->p, object->v, object->encke);
+        }
+    }
 
-            triple displacement = allObjects[j]->p - allObjects[currentObj]->p;
-            triple force = (G * displacement.normalized()) / displacement.sqrMagnitude();
-            triple a1 = force * allObjects[j]->m;
-            triple a2 = force * allObjects[currentObj]->m;
+    // Store index of a frame's anchor, -1 when the anchor is not a massive body in the store
+    int AnchorIndex(const ReferenceFrame* frame) const
+    {
+        const PhysicsObject* anchor = frame->anchor;
+        if (anchor && anchor->storeIndex >= 0 && (size_t)anchor->storeIndex < bodies.massiveCount && bodyHandles[anchor->storeIndex] == anchor)
+            return anchor->storeIndex;
+        return -1;
+    }
 
-            accelMutex.lock();
-            allObjects[currentObj]->a += a1;
-            allObjects[j]->a -= a2;
-            accelMutex.unlock();
+    // Collects the reference frame members FramePropagator moves this step and sets them aside like the encounter
+    // bodies, so the step integrator neither moves them nor sizes its step to them. Encke bodies stay with Encke
+    void BeginFrameStep()
+    {
+        frameBodies.clear();
+        for (size_t i = bodies.massiveCount; i < bodies.count; i++)
+        {
+            const PhysicsObject* object = bodyHandles[i];
+            if (object->frame && !object->enckePrimary && AnchorIndex(object->frame) >= 0) {
+                frameBodies.push_back(i);
+            }
+        }
+        for (size_t k = frameBodies.size(); k-- > 0;)
+        {
+            frameBodies[k] = SetAside(frameBodies[k]);
         }
     }
 
-    void CalculateForcesForMT(int lowerObj, int upperObj, int totalObjs)
+    // Integrates the frame members across the step in their frames, then hands members that left their frame's radius
+    // up the hierarchy. The objects still hold the state from the start of the step, the store the state at its end
+    void FinishFrameStep()
     {
-        for (int i = lowerObj; i < upperObj; i++)
+        bodies.count += frameBodies.size();
+        for (size_t i : frameBodies)
         {
-            allObjects[i]->GPE = 0;
-            for (int j = i; j < totalObjs; j++)
+            PhysicsObject* object = bodyHandles[i];
+            framePropagator.Advance(bodies, sourcePaths, i, (size_t)AnchorIndex(object->frame), object->p, object->v, object->local);
+            // The local state stays current across a hand-over, only the origin it is measured from changes
+            while (object->frame && object->local.position.magnitude() > object->frame->radius)
             {
-                if (i == j)
-                    continue;
+                ReferenceFrame* parent = object->frame->parent;
+                const int from = AnchorIndex(object->frame), to = parent ? AnchorIndex(parent) : -1;
+                if (to >= 0) {
+                    object->local.position += triple(bodies.x[from] - bodies.x[to], bodies.y[from] - bodies.y[to], bodies.z[from] - bodies.z[to]);
+                    object->local.velocity += triple(bodies.vx[from] - bodies.vx[to], bodies.vy[from] - bodies.vy[to], bodies.vz[from] - bodies.vz[to]);
+                }
+                else {
+                    object->local.valid = false;
+                }
+                object->frame = to >= 0 ? parent : nullptr;
+            }
+        }
+    }
 
-                if (allObjects[i]->contributesToGravity || allObjects[j]->contributesToGravity) CalculateForce(i, j);
+    /// <summary>
+    /// Moves an object into a reference frame, or back to absolute coordinates with nullptr. Its absolute state is
+    /// unchanged; a member that moves between frames carries its local state across by the offset between the
+    /// two anchors rather than going through its own absolute coordinates. Only massless objects are integrated
+    /// in their frame, massive ones keep the frame for RelativePosition and collisions.
+    /// </summary>
+    void SetFrame(PhysicsObject* object, ReferenceFrame* frame)
+    {
+        if (frame == object->frame)
+            return;
+        if (frame) {
+            if (object->frame && object->local.Current(object->p, object->v)) {
+                object->local.position += object->frame->anchor->p - frame->anchor->p;
+                object->local.velocity += object->frame->anchor->v - frame->anchor->v;
             }
+            else {
+                object->local.position = object->p - frame->anchor->p;
+                object->local.velocity = object->v - frame->anchor->v;
+            }
+            object->local.lastPosition = object->p;
+            object->local.lastVelocity = object->v;
+            object->local.valid = true;
+        }
+        else {
+            object->local.valid = false;
         }
+        object->frame = frame;
     }
 
-    void CalculateForceBetween(int i, int j)
+    // Puts an object in a frame at a state given relative to the frame's origin, which far from the absolute origin is
+    // more than its absolute coordinates can hold
+    void PlaceInFrame(PhysicsObject* object, ReferenceFrame* frame, const triple& position, const triple& velocity)
     {
-        triple displacement = allObjects[j]->p - allObjects[i]->p;
-        triple force = (G * displacement.normalized()) / displacement.sqrMagnitude();
-        triple a1 = force * allObjects[j]->m;
-        triple a2 = force * allObjects[i]->m;
+        object->frame = frame;
+        object->p = frame->anchor->p + position;
+        object->v = frame->anchor->v + velocity;
+        object->local.position = position;
+        object->local.velocity = velocity;
+        object->local.lastPosition = object->p;
+        object->local.lastVelocity = object->v;
+        object->local.valid = true;
+    }
 
-        allObjects[i]->a += a1;
-        allObjects[j]->a -= a2;
+    // Position of an object relative to a frame's origin, from its local state when it is a current member of the frame
+    static triple FramePosition(const PhysicsObject* object, const ReferenceFrame* frame)
+    {
+        if (object == frame->anchor)
+            return triple::zero();
+        if (object->frame == frame && object->local.Current(object->p, object->v))
+            return object->local.position;
+        return object->p - frame->anchor->p;
     }
 
-    void DoNothing()
+    static triple FrameVelocity(const PhysicsObject* object, const ReferenceFrame* frame)
     {
+        if (object == frame->anchor)
+            return triple::zero();
+        if (object->frame == frame && object->local.Current(object->p, object->v))
+            return object->local.velocity;
+        return object->v - frame->anchor->v;
+    }
 
+    // Position of a relative to b, differenced in a's frame (or b's) so that members of one frame, and a member
+    // against its frame's anchor, keep full precision however far the frame is from the absolute origin
+    static triple RelativePosition(const PhysicsObject* a, const PhysicsObject* b)
+    {
+        const ReferenceFrame* frame = a->frame ? a->frame : b->frame;
+        if (frame && frame->anchor)
+            return FramePosition(a, frame) - FramePosition(b, frame);
+        return a->p - b->p;
     }
 
-    void JoinThreads(std::vector<std::thread>& threads) {
-        for (auto& thread : threads) { thread.join(); }
+    static triple RelativeVelocity(const PhysicsObject* a, const PhysicsObject* b)
+    {
+        const ReferenceFrame* frame = a->frame ? a->frame : b->frame;
+        if (frame && frame->anchor)
+            return FrameVelocity(a, frame) - FrameVelocity(b, frame);
+        return a->v - b->v;
     }
 
-    void CalculateForcesMTOld2()
+    // Moves an object by dp and changes its velocity by dv, in its frame's coordinates too when its local state is current
+    static void Nudge(PhysicsObject* object, const triple& dp, const triple& dv)
     {
-        size_t k = allObjects.size();
-        int numberOfLoops = ((int)k / numThreads) + 1;
-        std::vector<std::thread> threads;
-        int currentThread = 0;
-        for (int i = 0; i < numberOfLoops; i++)
+        const bool current = object->frame && object->local.Current(object->p, object->v);
+        object->p += dp;
+        object->v += dv;
+        if (current) {
+            object->local.position += dp;
+            object->local.velocity += dv;
+            object->local.lastPosition = object->p;
+            object->local.lastVelocity = object->v;
+        }
+    }
+
+    // Points each massless object at the body whose sphere of influence it ended the step in, when that has changed.
+    // Massive bodies keep the reference objects their scenario gave them
+    void UpdateSpheresOfInfluence()
+    {
+        for (size_t i = bodies.massiveCount; i < bodies.count; i++)
         {
-            threads.push_back(std::thread([this, i, k]() {CalculateForcesForObject(i, (int)k); }));
-            currentThread++;
-            if (currentThread > numThreads - 1) {
-                currentThread = 0;
-                for (auto& thread : threads) { thread.join(); }
-                threads.clear();
+            const int primary = patchedConics.Parent(i);
+            PhysicsObject* sphere = primary >= 0 ? bodyHandles[primary] : nullptr;
+            PhysicsObject* object = bodyHandles[i];
+            if (sphere && object->sphereOfInfluence != sphere) {
+                object->sphereOfInfluence = sphere;
+                object->referenceObject = sphere;
             }
         }
-        for (auto& thread : threads) { thread.join(); }
-        threads.clear();
     }
 
-    void CalculateForcesMTOld()
+    // Moves the clock on by one simulated step and stores trail points when they are due. A jump that no step
+    // integrator took restarts the recorded trajectories rather than bridging it with one segment
+    void AdvanceClock(double h, bool jump = false)
     {
-        int k = (int)allObjects.size();
-        int numberOfBatches = (int)std::floorf((k / (float)numThreads)) + 1;
+        const double previous = timeElapsed;
+        timeElapsed += h;
+        if (recordTrajectories) {
+            RecordTrajectories(previous, jump);
+        }
+        seconds += h;
+        if (seconds >= 60.0) {
+            minutes += static_cast<int>(seconds) / 60;
+            seconds = fmod(seconds, 60.0); // Remainder after dividing by 60
+
+            if (minutes >= 60) {
+                hours += minutes / 60;
+                minutes %= 60; // Remainder after dividing by 60
+            }
 
-        for (int batch = 0; batch < numberOfBatches; batch++)
-        {
-            int a = batch * numThreads;
-            int numThreadsToCreate = k - a;
-            if (numThreadsToCreate > numThreads) numThreadsToCreate = numThreads;
+            if (hours >= 24) {
+                days += hours / 24;
+                hours %= 24; // Remainder after dividing by 24
+            }
+
+            if (days >= 365) {
+                years += days / 365;
+                days %= 365; // Remainder after dividing by 365
+            }
+        }
+        // The renderer holds the mutex while it draws the trails; rather than wait for it the points are stored
+        // at the first step after it lets go
+        if (timeElapsed > nextStorageTime && storingPositions && storingPositionsMutex.try_lock()) {
+            StoreAllPositions(std::max((double)positionStoreDelay, std::abs(h)));
+            storingPositionsMutex.unlock();
+            if (positionStoreDelay < h) {
+                nextStorageTime += h;
+            }
+            else { nextStorageTime += positionStoreDelay; }
+        }
+    }
+
+    void ResetUniverseOrigin(PhysicsObject* selectedObject) {
+        if(selectedObject != nullptr){
+            for (PhysicsObject* object : allObjects)
             {
-                std::vector<std::thread> threads(numThreadsToCreate);
-                for (int i = a; i < (batch + 1) * numThreads; i++)
-                {
-                    if (i < k)
-                    {
-                        int currentThread = i - (a);
-                        threads[currentThread] = std::thread([this, i, k]()
-                            {
-                                CalculateForcesForObject(i, k);
-                            });
-                    }
+                if (object == selectedObject) {
+                    continue;
                 }
-
-                /*for (int i = 0; i < k; i++)
-                {
-                    if (i < k)
-                    {
-                        threads[i] = std::thread([this, i, k]()
-                            {
-                                CalculateForcesForObject(i, k);
-                            });
-                    }
-                }*/
-                for (auto& thread : threads) {
-                    thread.join();
+                else {
+                    object->p -= selectedObject->p;
                 }
             }
+            selectedObject->p = vec3(0, 0, 0);
         }
     }
 
-    void CalculateForcesAsync()
-    {
+    void SolveDistanceConstraints() {
         size_t k = allObjects.size();
-        const size_t numThreads = std::thread::hardware_concurrency();
-        std::vector<std::future<void>> futures;
-
-        auto calculateForObject = [&](size_t index) {
-            allObjects[index]->GPE = 0;
-            for (size_t j = 0; j < k; ++j) {
-                if (index != j) {
-                    CalculateForce((int)index, (int)j);
-                }
+        if (type == SimType::WorkerThreads) {
+            SolveDistanceConstraintsParallel();
+            return;
+        }
+        for (int i = 0; i < k; i++) {
+            for (int j = i + 1; j < k; j++) {
+                ResolveContact(i, j);
             }
-            };
+        }
+    }
 
-        for (size_t i = 0; i < numThreads; ++i) {
-            futures.emplace_back(std::async(std::launch::async, [=]() {
-                for (size_t j = i; j < k; j += numThreads) {
-                    calculateForObject(j);
+    // The pair search runs on the task scheduler and only collects overlapping pairs, which are then resolved in the
+    // same (i, j) order as the serial sweep. A pair pushed into overlap by a correction earlier in this pass is
+    // picked up on the next step instead of this one
+    void SolveDistanceConstraintsParallel() {
+        const size_t k = allObjects.size();
+        contactCandidates.clear();
+        GetTaskScheduler().ParallelFor(k, 1, [this, k](size_t begin, size_t end) {
+            std::vector<std::pair<size_t, size_t>> found;
+            for (size_t i = begin; i < end; i++)
+            {
+                const double ri = allObjects[i]->radius;
+                for (size_t j = i + 1; j < k; j++)
+                {
+                    triple displacement = RelativePosition(allObjects[j], allObjects[i]);
+                    double distance2 = displacement.x * displacement.x + displacement.y * displacement.y + displacement.z * displacement.z;
+                    double combinedRadii = ri + allObjects[j]->radius;
+                    if (distance2 < combinedRadii * combinedRadii || distance2 == 0) {
+                        found.emplace_back(i, j);
+                    }
                 }
-                }));
+            }
+            if (!found.empty()) {
+                std::lock_guard<std::mutex> lock(contactCandidatesMutex);
+                contactCandidates.insert(contactCandidates.end(), found.begin(), found.end());
+            }
+            });
+        std::sort(contactCandidates.begin(), contactCandidates.end());
+        for (const std::pair<size_t, size_t>& contact : contactCandidates)
+        {
+            ResolveContact(contact.first, contact.second);
         }
+    }
 
-        for (auto& future : futures) {
-            future.get();
+    void ResolveContact(size_t i, size_t j) {
+        triple displacement = RelativePosition(allObjects[j], allObjects[i]);
+        double distance = displacement.magnitude();
+        if (distance == 0) {
+            Nudge(allObjects[i], triple(0, -1, 0), triple::zero());
+            Nudge(allObjects[j], triple(0, 1, 0), triple::zero());
+            triple displacement = RelativePosition(allObjects[j], allObjects[i]);
+            double distance = displacement.magnitude();
         }
+        double combinedRadii = allObjects[i]->radius + allObjects[j]->radius;
+
+        // Check if the objects are intersecting
+        if (distance < combinedRadii) {
+            // Normalize the displacement vector to get the collision normal
+            triple normal = displacement.normalized();
+
+            // Calculate the overlap (negative means penetration)
+            double overlap = distance - combinedRadii;
+
+            // Adjust positions to resolve the overlap
+            double totalMass = allObjects[i]->m + allObjects[j]->m;
+            Nudge(allObjects[j], normal * (-overlap * (allObjects[i]->m / totalMass)), triple::zero());
+            Nudge(allObjects[i], normal * (overlap * (allObjects[j]->m / totalMass)), triple::zero());
+            double e = 0.5;
+            triple* v1 = &allObjects[i]->v;
+            triple* v2 = &allObjects[j]->v;
+            double m1 = allObjects[i]->m;
+            double m2 = allObjects[j]->m;
+            triple relativeVelocity = RelativeVelocity(allObjects[j], allObjects[i]);
+            double velocityAlongNormal = relativeVelocity.Dot(normal);
+            if (velocityAlongNormal > 0) return; // Skip if moving apart
+
+            double restitution = 0.5; // Coefficient of restitution
+            double impulseMagnitude = -(1 + restitution) * velocityAlongNormal / (1 / m1 + 1 / m2);
+            triple impulse = normal * impulseMagnitude;
+
+            Nudge(allObjects[i], triple::zero(), impulse / -m1);
+            Nudge(allObjects[j], triple::zero(), impulse / m2);
+
+            /**v1 =    (e * *v1 * m2 - e * *v2 * m2 + m1 * *v1 + m2 * *v2) / (m1 + m2);
+            *v2 = -1*(e * *v1 * m1 - e * *v2 * m1 - m1 * *v1 - m2 * *v2) / (m1 + m2);*/
+            if (v1->magnitude() > LIGHTSPEED) {
+                *v1 = v1->normalized() * LIGHTSPEED;
+            }
+            if (v2->magnitude() > LIGHTSPEED) {
+                *v2 = v2->normalized() * LIGHTSPEED;
+            }
+        }
+    }
+
+    void PurgeObjects()
+    {
+        allObjects.clear();
+        bodiesDirty = true;
     }
 
-    void CalculateForce(int i, int j)
+    // Repacks the body store when objects were added or removed, then copies the live object state into it.
+    // PhysicsObject keeps its own p and v rather than viewing the store, so scenario code, the renderer and the
+    // per-object hooks (PreForceUpdate, GetExternalForces) work unchanged. The price is this copy in and ScatterBodies'
+    // copy out around every substep, 20-40 ns a body for the pair: more than a whole force pass for massless bodies
+    // about a single massive one, small next to anything with several massive bodies
+    void GatherBodies()
     {
-        PhysicsObject* object1 = allObjects[i];
-        PhysicsObject* object2 = allObjects[j];
-        if (!useRK)
+        if (bodiesDirty)
         {
-            triple displacement = object2->p - object1->p;
-            double magnitude = displacement.magnitude();
-            if (magnitude < object1->swartzchildRadius) {
-                RemoveObject(object2);
+            bodyHandles.clear();
+            bodyHandles.insert(bodyHandles.end(), gravitationalObjects.begin(), gravitationalObjects.end());
+            bodyHandles.insert(bodyHandles.end(), physicsObjects.begin(), physicsObjects.end());
+            bodies.Resize(bodyHandles.size(), gravitationalObjects.size());
+            for (size_t i = 0; i < bodyHandles.size(); i++)
+            {
+                bodyHandles[i]->storeIndex = (int)i;
             }
-            triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-            object1->a += force * object2->m;
-            object2->a -= force * object1->m;
+            bodiesDirty = false;
         }
-        else
+        for (size_t i = 0; i < bodies.count; i++)
         {
-            switch (RKStep)
-            {
-            case 1:
-            {
-                triple displacement = object2->p - object1->p;
-                double magnitude = displacement.magnitude();
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a1 += force * object2->m;
-                object2->a1 -= force * object1->m;
+            const PhysicsObject* object = bodyHandles[i];
+            bodies.x[i] = object->p.x;
+            bodies.y[i] = object->p.y;
+            bodies.z[i] = object->p.z;
+            bodies.vx[i] = object->v.x;
+            bodies.vy[i] = object->v.y;
+            bodies.vz[i] = object->v.z;
+            bodies.m[i] = object->m;
+            bodies.mu[i] = object->mu;
+            triple external = object->GetExternalForces() / object->m;
+            bodies.extAx[i] = external.x;
+            bodies.extAy[i] = external.y;
+            bodies.extAz[i] = external.z;
+        }
+        RemoveCapturedBodies();
+    }
 
+    // Writes the integrated state back to the objects so scenario code and the renderer see it
+    void ScatterBodies()
+    {
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            PhysicsObject* object = bodyHandles[i];
+            object->p = triple(bodies.x[i], bodies.y[i], bodies.z[i]);
+            object->v = triple(bodies.vx[i], bodies.vy[i], bodies.vz[i]);
+            object->outputPosition[0] = (float)bodies.x[i];
+            object->outputPosition[1] = (float)bodies.y[i];
+            object->outputPosition[2] = (float)bodies.z[i];
+        }
+    }
 
-            }break;
-            case 2:
+    // Anything inside a massive body's Schwarzschild radius is swallowed. Checked once per step so the force kernels stay branch-free
+    void RemoveCapturedBodies()
+    {
+        std::vector<PhysicsObject*> captured;
+        for (size_t i = 0; i < bodies.massiveCount; i++)
+        {
+            double rs = bodyHandles[i]->swartzchildRadius;
+            double rs2 = rs * rs;
+            for (size_t j = 0; j < bodies.count; j++)
             {
-                triple displacement = object2->p2 - object1->p2;
-                double magnitude = displacement.magnitude();
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a2 += force * object2->m;
-                object2->a2 -= force * object1->m;
+                double dx = bodies.x[j] - bodies.x[i];
+                double dy = bodies.y[j] - bodies.y[i];
+                double dz = bodies.z[j] - bodies.z[i];
+                if (i != j && dx * dx + dy * dy + dz * dz < rs2) {
+                    captured.push_back(bodyHandles[j]);
+                }
+            }
+        }
+        if (captured.empty())
+            return;
+        for (PhysicsObject* object : captured)
+        {
+            RemoveObject(object);
+        }
+        GatherBodies();
+    }
 
-            }break;
-            case 3:
-            {
-                triple displacement = object2->p3 - object1->p3;
-                double magnitude = displacement.magnitude();
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a3 += force * object2->m;
-                object2->a3 -= force * object1->m;
-
-            }break;
-            case 4:
-            {
-                triple displacement = object2->p4 - object1->p4;
-                double magnitude = displacement.magnitude();
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a4 += force * object2->m;
-                object2->a4 -= force * object1->m;
+    // Stage the force kernels write into: one per RK4 or Dormand-Prince evaluation, stage 0 for the single-evaluation integrators
+    int CurrentStage() const
+    {
+        return useRKF ? RKFStep : useRK ? RKStep : 0;
+    }
 
-            }break;
+    void CalculateForcesForRunMode()
+    {
+        switch (type) {
+        case 0:   CalculateForces();      break;
+        case 1:   CalculateForcesMT();    break;
+        case 2:   CalculateForcesWorker();    break;
+        case 3:   CalculateForcesModified();  break;
+        case 4:   CalculateForcesVectorized();  break;
+        case 5:   CalculateForcesBarnesHut();  break;
+        case 6:   CalculateForcesFastMultipole();  break;
         }
     }
-    }
 
-    void CalculateFriction(int i, int j) {
-        PhysicsObject* object1 = allObjects[i];
-        PhysicsObject* object2 = allObjects[j];
-        triple displacement = object2->p - object1->p;
-        double magnitude = displacement.magnitude();
-        triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-        // Friction Model
-        if (magnitude < object1->radius + object2->radius + 0.01f)
+    void CalculateForces()
+    {
+        StageView s = bodies.View(CurrentStage());
+        size_t k = bodies.count;
+        // Pairs of massless bodies do not interact, and the sources sit at the front of the store
+        for (size_t i = 0; i < bodies.massiveCount; i++)
+        {
+            for (size_t j = i + 1; j < bodies.massiveCount; j++)
+            {
+                CalculateForce(s, i, j);
+            }
+        }
+        AccumulateTestParticles(s);
+        for (size_t i = 0; i < k; i++)
         {
-            std::clog << "Friction applied no rk" << std::endl;
-            triple relativeV = object2->v - object1->v;
+            CalculateExternalForce(s, i);
+        }
+    }
 
-            // Coefficient of friction (kinetic friction)
-            float mu = 1000.0f; // Example value, you can adjust this
+    // Sphere-of-influence hierarchy and crossing counters of onRails
+    const PatchedConicPropagator& GetPatchedConics() const
+    {
+        return patchedConics;
+    }
 
-            // Calculate the normal force (magnitude of the contact force)
-            triple normalForce = (force * (object2->m / (object1->m + object2->m))); // Approximation of normal contact force
+    // Encounter and substep counters of regularizeEncounters
+    const KSPropagator& GetKSPropagator() const
+    {
+        return ksPropagator;
+    }
 
-            // Calculate the frictional force direction (opposite to the relative velocity)
-            triple frictionForce = -mu * normalForce.magnitude() * relativeV.normalized();
+    // Step and evaluation counters of UpdateType::IAS15
+    const IAS15Integrator& GetIAS15() const
+    {
+        return ias15;
+    }
 
-            // Apply the friction forces
-            object1->a += frictionForce / object1->m;
-            object2->a -= frictionForce / object2->m;
+    // Evaluation and interaction counters of UpdateType::RESPA
+    const RespaIntegrator& GetRespa() const
+    {
+        return respa;
+    }
+
+    ThreadPool& GetForcePool()
+    {
+        if (!forcePool || forcePool->GetNumberOfParticipants() != std::max(numThreads, 1)) {
+            forcePool.reset();
+            forcePool = std::make_unique<ThreadPool>(std::max(numThreads, 1));
         }
+        return *forcePool;
     }
 
-    void CalculateForceGrav(int i, int j) {
-        PhysicsObject* object1 = gravitationalObjects[i];
-        PhysicsObject* object2 = gravitationalObjects[j];
-        if (!useRK)
-        {
-            triple displacement = object2->p - object1->p;
-            double magnitude = displacement.magnitude();
-            if (magnitude < object1->swartzchildRadius) {
-                RemoveObject(object2);
-            }
-            if (magnitude < object2->swartzchildRadius) {
-                RemoveObject(object1);
+    /// <summary>
+    /// Parallel symmetric sweep over the pairs (i, j) with i < rows and i < j < cols. Each pair is evaluated once and
+    /// applied to both bodies. Participant 0 accumulates straight into the stage and every other participant into its
+    /// own AccelerationBuffer; a second pass then folds the buffers into the stage by body range and re-zeroes them.
+    /// No two threads ever write the same element, so no locks are needed.
+    /// </summary>
+    void AccumulatePairsSymmetricMT(const StageView& s, size_t rows, size_t cols)
+    {
+        ThreadPool& pool = GetForcePool();
+        const int participants = pool.GetNumberOfParticipants();
+        if ((int)threadAccelerations.size() != participants || (participants > 1 && threadAccelerations[1].ax.size() < cols)) {
+            threadAccelerations.resize(participants);
+            for (int p = 1; p < participants; p++)
+            {
+                threadAccelerations[p].Resize(cols);
             }
-            triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-            object1->a += force * object2->m;
-            object2->a -= force * object1->m;
         }
-        else
+
+        // Row i holds cols - 1 - i pairs, so split the rows where the running pair count crosses each participant's share
+        size_t totalPairs = 0;
+        for (size_t i = 0; i < rows; i++)
         {
-            switch (RKStep)
-            {
-            case 1:
+            totalPairs += cols - 1 - i;
+        }
+        rowBounds.assign(participants + 1, rows);
+        rowBounds[0] = 0;
+        size_t pairsSoFar = 0;
+        int nextBound = 1;
+        for (size_t i = 0; i < rows && nextBound < participants; i++)
+        {
+            pairsSoFar += cols - 1 - i;
+            while (nextBound < participants && pairsSoFar * participants >= totalPairs * nextBound)
             {
-                triple displacement = object2->p - object1->p;
-                double magnitude = displacement.magnitude();
-                if (magnitude < object1->swartzchildRadius) {
-                    RemoveObject(object2);
-                }
-                if (magnitude < object2->swartzchildRadius) {
-                    RemoveObject(object1);
-                }
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a1 += force * object2->m;
-                object2->a1 -= force * object1->m;
-            }break;
-            case 2:
+                rowBounds[nextBound++] = i + 1;
+            }
+        }
+
+        auto pairJob = [this, &s, cols](int participant) {
+            double* ax = s.ax;
+            double* ay = s.ay;
+            double* az = s.az;
+            if (participant != 0) {
+                ax = threadAccelerations[participant].ax.data();
+                ay = threadAccelerations[participant].ay.data();
+                az = threadAccelerations[participant].az.data();
+            }
+            for (size_t i = rowBounds[participant]; i < rowBounds[participant + 1]; i++)
             {
-                triple displacement = object2->p2 - object1->p2;
-                double magnitude = displacement.magnitude();
-                if (magnitude < object1->swartzchildRadius) {
-                    RemoveObject(object2);
-                }
-                if (magnitude < object2->swartzchildRadius) {
-                    RemoveObject(object1);
-                }
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a2 += force * object2->m;
-                object2->a2 -= force * object1->m;
-            }break;
-            case 3:
+                AccumulateGravitySymmetricRow(s, bodies.mu.data(), i, i + 1, cols, ax, ay, az);
+            }
+            };
+        pool.Run(pairJob);
+
+        if (participants == 1)
+            return;
+        pool.ParallelFor(cols, [this, &s, participants](size_t begin, size_t end, int) {
+            for (int p = 1; p < participants; p++)
             {
-                triple displacement = object2->p3 - object1->p3;
-                double magnitude = displacement.magnitude();
-                if (magnitude < object1->swartzchildRadius) {
-                    RemoveObject(object2);
-                }
-                if (magnitude < object2->swartzchildRadius) {
-                    RemoveObject(object1);
+                AccelerationBuffer& buffer = threadAccelerations[p];
+                for (size_t i = begin; i < end; i++)
+                {
+                    s.ax[i] += buffer.ax[i];
+                    s.ay[i] += buffer.ay[i];
+                    s.az[i] += buffer.az[i];
+                    buffer.ax[i] = 0;
+                    buffer.ay[i] = 0;
+                    buffer.az[i] = 0;
                 }
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a3 += force * object2->m;
-                object2->a3 -= force * object1->m;
-            }break;
-            case 4:
+            }
+            });
+    }
+
+    // Same interactions as CalculateForces, using the symmetric parallel sweep so each pair is only evaluated once
+    void CalculateForcesMT()
+    {
+        StageView s = bodies.View(CurrentStage());
+        AccumulatePairsSymmetricMT(s, bodies.massiveCount, bodies.massiveCount);
+        AccumulateTestParticlesMT(s);
+    }
+
+    // Massless bodies [massiveCount, count) against the massive prefix, which is packed once per evaluation
+    void AccumulateTestParticles(const StageView& s)
+    {
+        if (bodies.massiveCount == 0 || bodies.massiveCount == bodies.count)
+            return;
+        testParticleSources.Load(s, bodies.mu.data(), 0, bodies.massiveCount);
+        testParticleSources.Accumulate(s, bodies.massiveCount, bodies.count);
+    }
+
+    // Parallel form of AccumulateTestParticles that also adds every body's external force. Each participant
+    // writes only its own range of bodies, so nothing has to be reduced afterwards
+    void AccumulateTestParticlesMT(const StageView& s)
+    {
+        const size_t massive = bodies.massiveCount;
+        testParticleSources.Load(s, bodies.mu.data(), 0, massive);
+        GetForcePool().ParallelFor(bodies.count, [this, &s, massive](size_t begin, size_t end, int) {
+            size_t split = std::max(begin, massive);
+            if (split < end && massive > 0) {
+                testParticleSources.Accumulate(s, split, end);
+            }
+            for (size_t i = begin; i < end; i++)
             {
-                triple displacement = object2->p4 - object1->p4;
-                double magnitude = displacement.magnitude();
-                if (magnitude < object1->swartzchildRadius) {
-                    RemoveObject(object2);
-                }
-                if (magnitude < object2->swartzchildRadius) {
-                    RemoveObject(object1);
-                }
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a4 += force * object2->m;
-                object2->a4 -= force * object1->m;
-            }break;
-            default:
+                CalculateExternalForce(s, i);
+            }
+            });
+    }
+
+    // Each task pulls a range of bodies towards the massive prefix and writes only those bodies, so the scheduler can
+    // split and steal ranges freely
+    void CalculateForcesWorker() {
+        StageView s = bodies.View(CurrentStage());
+        GetTaskScheduler().ParallelFor(bodies.count, WorkerGrain, [this, &s](size_t begin, size_t end) {
+            AccumulateGravityBlock(s, bodies.mu.data(), begin, end, 0, bodies.massiveCount);
+            for (size_t i = begin; i < end; i++)
             {
-                triple displacement = object2->p - object1->p;
-                double magnitude = displacement.magnitude();
-                if (magnitude < object1->swartzchildRadius) {
-                    RemoveObject(object2);
-                }
-                if (magnitude < object2->swartzchildRadius) {
-                    RemoveObject(object1);
-                }
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a += force * object2->m;
-                object2->a -= force * object1->m;
-            }break;
+                CalculateExternalForce(s, i);
             }
+            });
+    }
+
+    TaskScheduler& GetTaskScheduler()
+    {
+        if (!taskScheduler || taskScheduler->GetNumberOfParticipants() != std::max(numThreads, 1)) {
+            taskScheduler.reset();
+            taskScheduler = std::make_unique<TaskScheduler>(std::max(numThreads, 1));
         }
+        return *taskScheduler;
     }
 
-    void CalculateForcePhys(int i, int j) {
-        PhysicsObject* object1 = physicsObjects[i];
-        PhysicsObject* object2 = gravitationalObjects[j];
-        if (!useRK)
+    // Appends every object's state to its trajectory, restarting any that does not end at previous
+    void RecordTrajectories(double previous, bool restart)
+    {
+        for (PhysicsObject* object : allObjects)
         {
-            triple displacement = object2->p - object1->p;
-            double magnitude = displacement.magnitude();
-            if (magnitude < object1->swartzchildRadius) {
-                RemoveObject(object2);
-            }
-            if (magnitude < object2->swartzchildRadius) {
-                RemoveObject(object1);
+            TrajectoryStore& trajectory = object->trajectory;
+            if (restart || trajectory.Empty() || trajectory.EndTime() != previous) {
+                trajectory.Reset(timeElapsed, object->p, object->v, storingPositionsMutex);
+                continue;
             }
-            triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-            object1->a += force * object2->m;
+            trajectory.Append(timeElapsed, object->p, object->v, trajectoryTolerance, (size_t)std::max(maxTrajectorySegments, 1), storingPositionsMutex);
         }
-        else
-        {
-            switch (RKStep)
+    }
+
+    /// <summary>
+    /// Position of object at time t, interpolated from its recorded trajectory, held at the ends of what is
+    /// recorded, or where the object is now when recordTrajectories is off. For the simulation thread; the renderer
+    /// reads the closed segments under storingPositionsMutex instead (TrajectoryStore::ClosedPosition).
+    /// </summary>
+    triple PositionAt(const PhysicsObject* object, double t) const
+    {
+        return object->trajectory.Empty() ? object->p : object->trajectory.Position(t);
+    }
+
+    triple VelocityAt(const PhysicsObject* object, double t) const
+    {
+        return object->trajectory.Empty() ? object->v : object->trajectory.Velocity(t);
+    }
+
+    // Trail simplification tolerance in metres, trailTolerance pixels at the renderer's last posted scale
+    double TrailTolerance() const
+    {
+        return decimateTrails ? trailTolerance * trailMetresPerPixel : 0.0;
+    }
+
+    // Stores every object's trail point; with simplification on, a trail keeps the span of time numberOfStoredPositions
+    // samples a storeInterval apart would cover, rather than that many points
+    void StoreAllPositions(double storeInterval)
+    {
+        const double tolerance = TrailTolerance();
+        const double oldest = tolerance > 0 ? timeElapsed - storeInterval * numberOfStoredPositions : -HUGE_VAL;
+        if (type != SimType::WorkerThreads) {
+            for (PhysicsObject* object : allObjects)
             {
-            case 1:
+                object->StoreCurrentPosition(timeElapsed, tolerance, oldest);
+            }
+            return;
+        }
+        GetTaskScheduler().ParallelFor(allObjects.size(), WorkerGrain, [this, tolerance, oldest](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
             {
-                triple displacement = object2->p - object1->p;
-                double magnitude = displacement.magnitude();
-                if (magnitude < object1->swartzchildRadius) {
-                    RemoveObject(object2);
-                }
-                if (magnitude < object2->swartzchildRadius) {
-                    RemoveObject(object1);
-                }
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a1 += force * object2->m;
-            }break;
-            case 2:
+                allObjects[i]->StoreCurrentPosition(timeElapsed, tolerance, oldest);
+            }
+            });
+    }
+
+    // Systems whose sources fit in one tile are already L1-resident and keep the exact pair loop. Past that every body
+    // is swept against the massive prefix tile by tile (see TiledGravity.h)
+    void CalculateForcesModified() {
+        StageView s = bodies.View(CurrentStage());
+        size_t k = bodies.massiveCount;
+        if (k > tiledGravity.GetTileSize()) {
+            tiledGravity.Accumulate(s, bodies.mu.data(), 0, bodies.count, 0, k);
+            for (size_t i = 0; i < bodies.count; i++) {
+                CalculateExternalForce(s, i);
+            }
+            return;
+        }
+        for (size_t i = 0; i < k; i++)
+        {
+            for (size_t j = i + 1; j < k; j++)
             {
-                triple displacement = object2->p2 - object1->p2;
-                double magnitude = displacement.magnitude();
-                if (magnitude < object1->swartzchildRadius) {
-                    RemoveObject(object2);
-                }
-                if (magnitude < object2->swartzchildRadius) {
-                    RemoveObject(object1);
-                }
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a2 += force * object2->m;
-            }break;
-            case 3:
+                CalculateForce(s, i, j);
+            }
+        }
+        size_t l = bodies.count;
+        AccumulateTestParticles(s);
+        for (size_t i = 0; i < l; i++) {
+            CalculateExternalForce(s, i);
+        }
+    }
+
+    // Every body against the massive sources in one SIMD sweep (see GravityKernels.h). Massive pairs are evaluated
+    // from both sides rather than through symmetry so the kernel never scatters writes into other bodies
+    void CalculateForcesVectorized() {
+        StageView s = bodies.View(CurrentStage());
+        AccumulateGravityBlock(s, bodies.mu.data(), 0, bodies.count, 0, bodies.massiveCount);
+        for (size_t i = 0; i < bodies.count; i++) {
+            CalculateExternalForce(s, i);
+        }
+    }
+
+    // Massive bodies go into an octree that every body is walked against in parallel. The tree is rebuilt at the start
+    // of each step; the later RK stages only move the bodies slightly, so they refit that topology instead
+    void CalculateForcesBarnesHut() {
+        int stage = CurrentStage();
+        StageView s = bodies.View(stage);
+        double theta = std::clamp(barnesHutTheta, 0.0, BarnesHutTree::MaxTheta);
+        ThreadPool& pool = GetForcePool();
+        if (stage <= 1) {
+            barnesHutTree.Build(s, bodies.mu.data(), 0, bodies.massiveCount, theta, pool);
+        }
+        else {
+            barnesHutTree.Refit(s, bodies.mu.data(), 0, theta, pool);
+        }
+        pool.ParallelFor(bodies.count, [this, &s](size_t begin, size_t end, int) {
+            barnesHutTree.Accumulate(s, begin, end);
+            for (size_t i = begin; i < end; i++)
             {
-                triple displacement = object2->p3 - object1->p3;
-                double magnitude = displacement.magnitude();
-                if (magnitude < object1->swartzchildRadius) {
-                    RemoveObject(object2);
-                }
-                if (magnitude < object2->swartzchildRadius) {
-                    RemoveObject(object1);
-                }
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a3 += force * object2->m;
-            }break;
-            case 4:
+                CalculateExternalForce(s, i);
+            }
+            });
+    }
+
+    // Every body, massless ones included, is a target of the multipole tree and the massive prefix are its sources.
+    // Like the Barnes-Hut mode the topology is built once per step and refitted for the later RK stages
+    void CalculateForcesFastMultipole() {
+        int stage = CurrentStage();
+        StageView s = bodies.View(stage);
+        ThreadPool& pool = GetForcePool();
+        if (stage <= 1) {
+            fastMultipole.Build(s, bodies.count, bodies.massiveCount, pool);
+        }
+        fastMultipole.Evaluate(s, bodies.mu.data(), fmmOrder, fmmTheta, pool);
+        pool.ParallelFor(bodies.count, [this, &s](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; i++)
             {
-                triple displacement = object2->p4 - object1->p4;
-                double magnitude = displacement.magnitude();
-                if (magnitude < object1->swartzchildRadius) {
-                    RemoveObject(object2);
-                }
-                if (magnitude < object2->swartzchildRadius) {
-                    RemoveObject(object1);
-                }
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a4 += force * object2->m;
-            }break;
-            default:
+                CalculateExternalForce(s, i);
+            }
+            });
+    }
+
+    void CalculateExternalForce(const StageView& s, size_t i) {
+        s.ax[i] += bodies.extAx[i];
+        s.ay[i] += bodies.extAy[i];
+        s.az[i] += bodies.extAz[i];
+    }
+
+    // Same interactions as CalculateForcesModified: massive pairs through the symmetric parallel sweep, massless bodies split by target
+    void CalculateForcesModifiedMT() {
+        StageView s = bodies.View(CurrentStage());
+        AccumulatePairsSymmetricMT(s, bodies.massiveCount, bodies.massiveCount);
+        AccumulateTestParticlesMT(s);
+    }
+
+    void DoNothing()
+    {
+
+    }
+
+    void JoinThreads(std::vector<std::thread>& threads) {
+        for (auto& thread : threads) { thread.join(); }
+    }
+
+    // Mutual attraction between two bodies of the store, accumulated into both
+    void CalculateForce(const StageView& s, size_t i, size_t j)
+    {
+        double dx = s.x[j] - s.x[i];
+        double dy = s.y[j] - s.y[i];
+        double dz = s.z[j] - s.z[i];
+        double r2 = dx * dx + dy * dy + dz * dz;
+        double invR3 = 1.0 / (r2 * std::sqrt(r2));
+        double fi = bodies.mu[j] * invR3;
+        double fj = bodies.mu[i] * invR3;
+        s.ax[i] += dx * fi;
+        s.ay[i] += dy * fi;
+        s.az[i] += dz * fi;
+        s.ax[j] -= dx * fj;
+        s.ay[j] -= dy * fj;
+        s.az[j] -= dz * fj;
+    }
+
+    // Integrators that call the force kernels themselves: block time steps only for the bodies due at each block time,
+    // the compositions once per leapfrog, Wisdom-Holman between its Kepler drifts, IAS15 at its Gauss-Radau nodes
+    // and RESPA once per level step
+    static bool EvaluatesOwnForces(UpdateType type)
+    {
+        return type == UpdateType::BlockTimestep || type == UpdateType::Yoshida4 || type == UpdateType::Yoshida6
+            || type == UpdateType::WisdomHolman || type == UpdateType::IAS15 || type == UpdateType::RESPA;
+    }
+
+    void Drift(double h)
+    {
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            bodies.x[i] += bodies.vx[i] * h;
+            bodies.y[i] += bodies.vy[i] * h;
+            bodies.z[i] += bodies.vz[i] * h;
+        }
+    }
+
+    /// <summary>
+    /// Symmetric composition of drift-kick-drift leapfrogs of dt * weights[k]. The half drifts where two
+    /// leapfrogs meet are merged into one, so each weight costs a single evaluation of the run mode's kernel.
+    /// </summary>
+    void ComposeLeapfrogs(double dt, const double* weights, int count)
+    {
+        const BodyStage& s = bodies.stages[0];
+        double drift = 0.5 * weights[0] * dt;
+        for (int k = 0; k < count; k++)
+        {
+            Drift(drift);
+            bodies.stages[0].ClearAcceleration();
+            CalculateForcesForRunMode();
+            const double kick = weights[k] * dt;
+            for (size_t i = 0; i < bodies.count; i++)
             {
-                triple displacement = object2->p - object1->p;
-                double magnitude = displacement.magnitude();
-                if (magnitude < object1->swartzchildRadius) {
-                    RemoveObject(object2);
-                }
-                if (magnitude < object2->swartzchildRadius) {
-                    RemoveObject(object1);
-                }
-                triple force = (G * displacement) / (magnitude * magnitude * magnitude);
-                object1->a += force * object2->m;
-            }break;
+                bodies.vx[i] += s.ax[i] * kick;
+                bodies.vy[i] += s.ay[i] * kick;
+                bodies.vz[i] += s.az[i] * kick;
+                ClampToLightSpeed(i);
             }
+            drift = 0.5 * (weights[k] + (k + 1 < count ? weights[k + 1] : 0.0)) * dt;
         }
+        Drift(drift);
+        bodies.ClearAccelerations();
     }
 
     void UpdateObjects(double dt, int type)
     {
-        for (PhysicsObject* object : allObjects)
+        if (type == 2)
+        {
+            RK4Combine(dt);
+            bodies.ClearAccelerations();
+            return;
+        }
+        if (type == UpdateType::Yoshida4)
+        {
+            ComposeLeapfrogs(dt, YoshidaWeights::Fourth, 3);
+            return;
+        }
+        if (type == UpdateType::Yoshida6)
+        {
+            ComposeLeapfrogs(dt, YoshidaWeights::Sixth, 7);
+            return;
+        }
+        if (type == UpdateType::WisdomHolman)
+        {
+            wisdomHolman.Step(bodies, dt, GetForcePool(), [this] { CalculateForcesForRunMode(); });
+            for (size_t i = 0; i < bodies.count; i++)
+            {
+                ClampToLightSpeed(i);
+            }
+            bodies.ClearAccelerations();
+            return;
+        }
+        if (type == UpdateType::IAS15)
+        {
+            ias15.Integrate(bodies, dt, [this] { CalculateForcesForRunMode(); });
+            for (size_t i = 0; i < bodies.count; i++)
+            {
+                ClampToLightSpeed(i);
+            }
+            bodies.ClearAccelerations();
+            return;
+        }
+        if (type == UpdateType::RESPA)
+        {
+            // Direct sums per level whatever the run mode, since each level needs its own subset of sources
+            respaLevels.resize(bodies.count);
+            for (size_t i = 0; i < bodies.count; i++)
+            {
+                respaLevels[i] = bodyHandles[i]->respaLevel;
+            }
+            respa.Step(bodies, dt, respaLevels.data(), respaSubsteps, GetForcePool());
+            for (size_t i = 0; i < bodies.count; i++)
+            {
+                ClampToLightSpeed(i);
+            }
+            return;
+        }
+        if (type == 4)
+        {
+            // Direct Hermite sum over the massive bodies whatever the run mode, since it needs jerks and a subset of targets
+            blockHermite.Integrate(bodies, dt, blockTimestepEta, GetForcePool());
+            for (size_t i = 0; i < bodies.count; i++)
+            {
+                ClampToLightSpeed(i);
+            }
+            return;
+        }
+        const BodyStage& s = bodies.stages[0];
+        const double halfDt2 = dt * dt * 0.5;
+        for (size_t i = 0; i < bodies.count; i++)
         {
             switch (type)
             {
-            case 0:  object->VerletStep(dt); break;
-            case 1:  object->EulerStep(dt); break;
-            case 2:  object->RK4Step4(dt);  break;
-            case 3:  object->EulerStep2(dt);  break;
-            default: object->EulerStep(dt); break;
+            case 0:
+                bodies.x[i] += bodies.vx[i] * dt + s.ax[i] * halfDt2;
+                bodies.y[i] += bodies.vy[i] * dt + s.ay[i] * halfDt2;
+                bodies.z[i] += bodies.vz[i] * dt + s.az[i] * halfDt2;
+                bodies.vx[i] += s.ax[i] * dt;
+                bodies.vy[i] += s.ay[i] * dt;
+                bodies.vz[i] += s.az[i] * dt;
+                break;
+            case 3:
+                bodies.vx[i] += s.ax[i] * dt;
+                bodies.vy[i] += s.ay[i] * dt;
+                bodies.vz[i] += s.az[i] * dt;
+                bodies.x[i] += bodies.vx[i] * dt;
+                bodies.y[i] += bodies.vy[i] * dt;
+                bodies.z[i] += bodies.vz[i] * dt;
+                break;
+            default:
+                bodies.x[i] += bodies.vx[i] * dt;
+                bodies.y[i] += bodies.vy[i] * dt;
+                bodies.z[i] += bodies.vz[i] * dt;
+                bodies.vx[i] += s.ax[i] * dt;
+                bodies.vy[i] += s.ay[i] * dt;
+                bodies.vz[i] += s.az[i] * dt;
+                break;
             }
-            object->ClearForce();
+            ClampToLightSpeed(i);
         }
+        bodies.ClearAccelerations();
     }
 
     triple CalculateAcceleration(PhysicsObject* object1, triple location)
@@ -920,8 +1673,9 @@ public:
             physicsObjects.push_back(object);
         }
         object->index = currentObjectIndex++;
-        object->pastPositions.push_back(object->p);
         allObjects.push_back(object);
+        bodiesDirty = true;
+        trailsDirty = true;
     }
 
     void RemoveObject(PhysicsObject* object)
@@ -929,6 +1683,11 @@ public:
         std::erase(allObjects, object);
         std::erase(gravitationalObjects, object);
         std::erase(physicsObjects, object);
+        object->storeIndex = -1;
+        bodiesDirty = true;
+        // Its ring points into the slab until the next layout frees that, so the object must outlive the frame
+        removedTrails.push_back(object);
+        trailsDirty = true;
     }
     
     int GetNumberOfObjects()
@@ -959,74 +1718,6 @@ public:
 
     }
 
-    // Worker thread function
-    void workerThread() {
-        while (true) {
-            std::function<void()> task;
-
-            // Lock the queue and wait for work
-            {
-                std::unique_lock<std::mutex> lock(queueMutex);
-                condition.wait(lock, [this] { return !workQueue.empty() || stop; });
-
-                if (stop && workQueue.empty())
-                    return;
-
-                task = workQueue.front();
-                workQueue.pop();
-            }
-
-            // Execute the task
-            task();
-        }
-    }
-
-    // Function to make the thread do work
-    static void work(int id) {
-        std::this_thread::sleep_for(1ms);
-        int result = 0;
-        for (int i = 0; i < id + 1; i++) {
-            result += i;
-        }
-        std::cout << result << " ";
-    }
-
-    // Function to add work to the queue
-    void addWork(int id) {
-        {
-            std::lock_guard<std::mutex> lock(queueMutex);
-            workQueue.push([id] { work(id); });
-        }
-        condition.notify_one();
-    }
-
-    void startThreads(int numberOfWorkerThreads) {
-        stop = false;
-        // Start worker threads
-        for (int i = 0; i < numberOfWorkerThreads; ++i) {
-            threads.push_back(std::thread(&GravitySimulator::workerThread, this));
-        }
-    }
-
-    void stopThreads() {
-        // Stop the workers
-        {
-            std::lock_guard<std::mutex> lock(queueMutex);
-            stop = true;
-        }
-        condition.notify_all();
-
-        // Join all threads
-        for (std::thread& t : threads) {
-            if (t.joinable()) {
-                t.join();
-            }
-        }
-
-        // Clear the thread vector to prevent reuse issues
-        threads.clear();
-    }
-
     void SetReferenceObjects()
     {
         for (PhysicsObject* object : allObjects)
@@ -0,0 +1,416 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+#include "BodyStore.h"
+
+/// <summary>
+/// IAS15 (Rein and Spiegel 2015): 15th-order implicit Gauss-Radau integrator with adaptive steps. Within a
+/// step the acceleration of every coordinate is a degree-7 polynomial in the step fraction t,
+/// a(t) = a0 + b0 t + b1 t^2 + ... + b6 t^7, fitted at seven Gauss-Radau nodes by predictor-corrector
+/// iteration until the coefficients stop changing. The next step comes from the shortest time scale of
+/// any body's acceleration, |a| over its first two derivatives at the end of the step (the criterion of
+/// Pham, Rein and Spiegel 2024), scaled so the truncation error sits at Epsilon, below double roundoff.
+/// The original b6 / a estimate is not used: the kernels difference absolute positions, so a satellite
+/// 1e11 m from the origin sees acceleration noise that b6, a seventh divided difference, amplifies
+/// past Epsilon at any step. The fitted polynomial is carried over as the starting guess for the next
+/// step, so a smooth orbit converges in two or three iterations (7 evaluations each) per step.
+/// </summary>
+class IAS15Integrator
+{
+private:
+    static constexpr int Nodes = 7;
+    static constexpr double Epsilon = 1e-9;            // Truncation error per step relative to the acceleration
+    static constexpr double SafetyFactor = 0.25;       // Steps shrinking below this ratio are redone, growth is capped at its inverse
+    static constexpr double ConvergedError = 1e-16;    // Predictor-corrector stops when b6 changes by less than this against a
+    static constexpr int MaxIterations = 12;
+    static constexpr double MinStep = 1e-6;            // Steps this short are accepted whatever their error, so an encounter cannot stall the frame
+
+    // Gauss-Radau spacings, h[0] = 0 is the start of the step
+    static constexpr double h[Nodes + 1] = { 0.0, 0.0562625605369221464656521910318, 0.180240691736892364987579942780,
+        0.352624717113169637373907769648, 0.547153626330555383001448554766, 0.734210177215410531523210605558,
+        0.885320946839095768090359771030, 0.977520613561287501891174488626 };
+
+    // c[k][j]: coefficient of t^(k+1) in t (t - h1) ... (t - hj), so b = c g; d is its inverse, g = d b
+    double c[Nodes][Nodes] = {};
+    double d[Nodes][Nodes] = {};
+
+    // Per coordinate, laid out as x[0..n), y[0..n), z[0..n)
+    AlignedDoubles b[Nodes], g[Nodes], e[Nodes];
+    AlignedDoubles x0, v0, a0;
+    AlignedDoubles compensationX, compensationV;   // Kahan residuals of the position and velocity sums
+    size_t n = 0;
+    double step = 0;
+    bool havePrediction = false;
+    size_t acceptedSteps = 0, rejectedSteps = 0, evaluations = 0;
+
+    void Resize(size_t count)
+    {
+        if (count == n)
+            return;
+        n = count;
+        for (int k = 0; k < Nodes; k++)
+        {
+            b[k].assign(3 * n, 0.0);
+            g[k].assign(3 * n, 0.0);
+            e[k].assign(3 * n, 0.0);
+        }
+        x0.resize(3 * n); v0.resize(3 * n); a0.resize(3 * n);
+        compensationX.resize(3 * n); compensationV.resize(3 * n);
+        havePrediction = false;
+    }
+
+    static double* Coordinate(BodyStore& bodies, int axis)
+    {
+        return axis == 0 ? bodies.x.data() : axis == 1 ? bodies.y.data() : bodies.z.data();
+    }
+
+    static double* Velocity(BodyStore& bodies, int axis)
+    {
+        return axis == 0 ? bodies.vx.data() : axis == 1 ? bodies.vy.data() : bodies.vz.data();
+    }
+
+    static const double* Acceleration(const BodyStage& stage, int axis)
+    {
+        return axis == 0 ? stage.ax.data() : axis == 1 ? stage.ay.data() : stage.az.data();
+    }
+
+    template <typename Evaluate>
+    void EvaluateInto(BodyStore& bodies, Evaluate& evaluate)
+    {
+        bodies.stages[0].ClearAcceleration();
+        evaluate();
+        evaluations++;
+    }
+
+    // Positions at fraction s of a step of dt from the current polynomial. Velocities are left at the step start,
+    // since none of the force kernels reads them
+    void Predict(BodyStore& bodies, double s, double dt)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            double* position = Coordinate(bodies, axis);
+            const size_t offset = axis * n;
+            for (size_t i = 0; i < n; i++)
+            {
+                const size_t k = offset + i;
+                double inner = b[6][k] / 72.0;
+                inner = inner * s + b[5][k] / 56.0;
+                inner = inner * s + b[4][k] / 42.0;
+                inner = inner * s + b[3][k] / 30.0;
+                inner = inner * s + b[2][k] / 20.0;
+                inner = inner * s + b[1][k] / 12.0;
+                inner = inner * s + b[0][k] / 6.0;
+                position[i] = x0[k] + s * dt * (v0[k] + s * dt * (0.5 * a0[k] + s * inner));
+            }
+        }
+    }
+
+    // Refits g[node - 1] to the acceleration just evaluated at that node and carries the change into b. Returns the
+    // largest change of b6 when the last node is refitted, which is what decides convergence
+    double Correct(const BodyStage& stage, int node)
+    {
+        double largestChange = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const double* acceleration = Acceleration(stage, axis);
+            const size_t offset = axis * n;
+            for (size_t i = 0; i < n; i++)
+            {
+                const size_t k = offset + i;
+                // Divided difference of the node accelerations
+                double value = (acceleration[i] - a0[k]) / h[node];
+                for (int m = 1; m < node; m++)
+                {
+                    value = (value - g[m - 1][k]) / (h[node] - h[m]);
+                }
+                const double change = value - g[node - 1][k];
+                g[node - 1][k] = value;
+                for (int j = 0; j < node; j++)
+                {
+                    b[j][k] += c[j][node - 1] * change;
+                }
+                if (node == Nodes) {
+                    largestChange = std::max(largestChange, std::abs(c[Nodes - 1][Nodes - 1] * change));
+                }
+            }
+        }
+        return largestChange;
+    }
+
+    /// <summary>
+    /// Square of the shortest acceleration time scale over all bodies, in units of a step. With a the
+    /// acceleration, j and s its first two derivatives per step, all at the end of the step, the time
+    /// scale of a body is sqrt(2 |a|^2 / (|j|^2 + |s| |a|)). Returns infinity if no body accelerates.
+    /// </summary>
+    double ShortestTimescaleSquared() const
+    {
+        double shortest = HUGE_VAL;
+        for (size_t i = 0; i < n; i++)
+        {
+            double a2 = 0, j2 = 0, s2 = 0;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                const size_t k = axis * n + i;
+                double a = a0[k] + b[0][k] + b[1][k] + b[2][k] + b[3][k] + b[4][k] + b[5][k] + b[6][k];
+                double j = b[0][k] + 2.0 * b[1][k] + 3.0 * b[2][k] + 4.0 * b[3][k] + 5.0 * b[4][k] + 6.0 * b[5][k] + 7.0 * b[6][k];
+                double s = 2.0 * b[1][k] + 6.0 * b[2][k] + 12.0 * b[3][k] + 20.0 * b[4][k] + 30.0 * b[5][k] + 42.0 * b[6][k];
+                a2 += a * a;
+                j2 += j * j;
+                s2 += s * s;
+            }
+            if (a2 > 0 && std::isfinite(a2)) {
+                double denominator = j2 + std::sqrt(s2 * a2);
+                if (denominator > 0) {
+                    shortest = std::min(shortest, 2.0 * a2 / denominator);
+                }
+            }
+        }
+        return shortest;
+    }
+
+    static double LargestMagnitude(const BodyStage& stage, size_t count)
+    {
+        double largest = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            largest = std::max({ largest, std::abs(stage.ax[i]), std::abs(stage.ay[i]), std::abs(stage.az[i]) });
+        }
+        return largest;
+    }
+
+    // Coefficients of the same polynomial measured in a step q times as long and starting where the accepted
+    // step ended: a(1 + q s) expanded in s
+    void PredictNextStep(double q)
+    {
+        static constexpr double binomial[Nodes + 1][Nodes + 1] = {
+            { 1 }, { 1, 1 }, { 1, 2, 1 }, { 1, 3, 3, 1 }, { 1, 4, 6, 4, 1 }, { 1, 5, 10, 10, 5, 1 },
+            { 1, 6, 15, 20, 15, 6, 1 }, { 1, 7, 21, 35, 35, 21, 7, 1 } };
+        double power[Nodes];
+        power[0] = q;
+        for (int k = 1; k < Nodes; k++)
+        {
+            power[k] = power[k - 1] * q;
+        }
+        for (size_t k = 0; k < 3 * n; k++)
+        {
+            double predicted[Nodes];
+            for (int m = 0; m < Nodes; m++)
+            {
+                double sum = 0;
+                for (int j = m; j < Nodes; j++)
+                {
+                    sum += binomial[j + 1][m + 1] * b[j][k];
+                }
+                predicted[m] = power[m] * sum;
+            }
+            // The previous prediction's miss is kept as a correction, as in the original
+            for (int m = 0; m < Nodes; m++)
+            {
+                double miss = havePrediction ? b[m][k] - e[m][k] : 0.0;
+                e[m][k] = predicted[m];
+                b[m][k] = predicted[m] + miss;
+            }
+        }
+        havePrediction = true;
+        RefreshG();
+    }
+
+    // Same start, step q times as long: a(q s) expanded in s
+    void RescaleStep(double q)
+    {
+        double power = 1;
+        for (int m = 0; m < Nodes; m++)
+        {
+            power *= q;
+            for (size_t k = 0; k < 3 * n; k++)
+            {
+                b[m][k] *= power;
+                e[m][k] = b[m][k];
+            }
+        }
+        RefreshG();
+    }
+
+    void RefreshG()
+    {
+        for (size_t k = 0; k < 3 * n; k++)
+        {
+            for (int j = 0; j < Nodes; j++)
+            {
+                double sum = 0;
+                for (int m = j; m < Nodes; m++)
+                {
+                    sum += d[j][m] * b[m][k];
+                }
+                g[j][k] = sum;
+            }
+        }
+    }
+
+    // Kahan-compensated value += increment
+    static void AddCompensated(double& value, double& compensation, double increment)
+    {
+        double y = increment - compensation;
+        double t = value + y;
+        compensation = (t - value) - y;
+        value = t;
+    }
+
+public:
+    IAS15Integrator()
+    {
+        // Expand t (t - h1) ... (t - hj) for each j to get c, then invert the unit upper triangular c for d
+        for (int j = 0; j < Nodes; j++)
+        {
+            double polynomial[Nodes] = { 1.0 };   // Coefficients of t^0..t^j of (t - h1) ... (t - hj)
+            for (int m = 1; m <= j; m++)
+            {
+                for (int p = m; p > 0; p--)
+                {
+                    polynomial[p] = polynomial[p - 1] - h[m] * polynomial[p];
+                }
+                polynomial[0] *= -h[m];
+            }
+            for (int k = 0; k <= j; k++)
+            {
+                c[k][j] = polynomial[k];
+            }
+        }
+        for (int j = Nodes - 1; j >= 0; j--)
+        {
+            d[j][j] = 1.0;
+            for (int m = j + 1; m < Nodes; m++)
+            {
+                double sum = 0;
+                for (int k = j; k < m; k++)
+                {
+                    sum += d[j][k] * c[k][m];
+                }
+                d[j][m] = -sum;
+            }
+        }
+    }
+
+    size_t GetAcceptedSteps() const
+    {
+        return acceptedSteps;
+    }
+
+    size_t GetRejectedSteps() const
+    {
+        return rejectedSteps;
+    }
+
+    size_t GetEvaluations() const
+    {
+        return evaluations;
+    }
+
+    // Step the next call will try first, carried from call to call
+    double GetStepSize() const
+    {
+        return step;
+    }
+
+    void ResetCounters()
+    {
+        acceptedSteps = rejectedSteps = evaluations = 0;
+    }
+
+    /// <summary>
+    /// Advances every body of the store by exactly dt in as many adaptive steps as the error control asks for.
+    /// evaluate() must fill stage 0 of the store with the accelerations at the store's current positions.
+    /// </summary>
+    template <typename Evaluate>
+    void Integrate(BodyStore& bodies, double dt, Evaluate&& evaluate)
+    {
+        if (bodies.count == 0 || dt <= 0)
+            return;
+        Resize(bodies.count);
+        if (step <= 0) {
+            step = dt;
+        }
+        std::fill(compensationX.begin(), compensationX.end(), 0.0);
+        std::fill(compensationV.begin(), compensationV.end(), 0.0);
+
+        EvaluateInto(bodies, evaluate);
+        const BodyStage& s = bodies.stages[0];
+        double remaining = dt;
+        while (remaining > 0)
+        {
+            const double trial = std::min(step, remaining);
+            for (int axis = 0; axis < 3; axis++)
+            {
+                const double* position = Coordinate(bodies, axis);
+                const double* velocity = Velocity(bodies, axis);
+                const double* acceleration = Acceleration(s, axis);
+                std::copy(position, position + n, x0.begin() + axis * n);
+                std::copy(velocity, velocity + n, v0.begin() + axis * n);
+                std::copy(acceleration, acceleration + n, a0.begin() + axis * n);
+            }
+
+            double correctorError = HUGE_VAL, lastCorrectorError = 2.0;
+            for (int iteration = 0; iteration < MaxIterations; iteration++)
+            {
+                if (correctorError < ConvergedError || (iteration > 2 && correctorError >= lastCorrectorError))
+                    break;
+                lastCorrectorError = correctorError;
+                double change = 0;
+                for (int node = 1; node <= Nodes; node++)
+                {
+                    Predict(bodies, h[node], trial);
+                    EvaluateInto(bodies, evaluate);
+                    change = Correct(s, node);
+                }
+                const double scale = LargestMagnitude(s, n);
+                correctorError = scale > 0 ? change / scale : 0.0;
+            }
+
+            // A seventh-order method keeps the error at Epsilon with steps of (7! Epsilon)^(1/7) time scales
+            const double timescale2 = ShortestTimescaleSquared();
+            double next = std::isfinite(timescale2) ? trial * std::sqrt(timescale2) * std::pow(5040.0 * Epsilon, 1.0 / 7.0) : trial / SafetyFactor;
+
+            if (next < SafetyFactor * trial && trial > MinStep) {
+                // Redo from the start of the step with the shorter one
+                rejectedSteps++;
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    std::copy(x0.begin() + axis * n, x0.begin() + (axis + 1) * n, Coordinate(bodies, axis));
+                }
+                step = std::max(next, MinStep);
+                RescaleStep(step / trial);
+                EvaluateInto(bodies, evaluate);
+                continue;
+            }
+            next = std::min(next, trial / SafetyFactor);
+
+            for (int axis = 0; axis < 3; axis++)
+            {
+                double* position = Coordinate(bodies, axis);
+                double* velocity = Velocity(bodies, axis);
+                const size_t offset = axis * n;
+                for (size_t i = 0; i < n; i++)
+                {
+                    const size_t k = offset + i;
+                    double dx = trial * v0[k] + trial * trial * (0.5 * a0[k] + b[0][k] / 6.0 + b[1][k] / 12.0 + b[2][k] / 20.0
+                        + b[3][k] / 30.0 + b[4][k] / 42.0 + b[5][k] / 56.0 + b[6][k] / 72.0);
+                    double dv = trial * (a0[k] + b[0][k] / 2.0 + b[1][k] / 3.0 + b[2][k] / 4.0 + b[3][k] / 5.0
+                        + b[4][k] / 6.0 + b[5][k] / 7.0 + b[6][k] / 8.0);
+                    position[i] = x0[k];
+                    velocity[i] = v0[k];
+                    AddCompensated(position[i], compensationX[k], dx);
+                    AddCompensated(velocity[i], compensationV[k], dv);
+                }
+            }
+            acceptedSteps++;
+            remaining -= trial;
+            // A step trimmed to the end of the call says little about the one after it, so only a shorter step is taken from it
+            step = trial < step ? std::min(step, next) : next;
+            PredictNextStep(step / trial);
+            if (remaining > 0) {
+                EvaluateInto(bodies, evaluate);
+            }
+        }
+    }
+};
@@ -0,0 +1,145 @@
+#pragma once
+#include <cmath>
+#include <algorithm>
+#include <cstddef>
+#include "SimdKernels.h"
+
+// Stumpff functions c2(z) = (1 - cos sqrt z) / z and c3(z) = (sqrt z - sin sqrt z) / z^1.5, continued to z <= 0.
+// Near zero the closed forms cancel badly, so they switch to their series
+inline void StumpffC2C3(double z, double& c2, double& c3)
+{
+    if (std::abs(z) < 0.1) {
+        c2 = 1.0 / 2.0 - z * (1.0 / 24.0 - z * (1.0 / 720.0 - z * (1.0 / 40320.0 - z * (1.0 / 3628800.0 - z / 479001600.0))));
+        c3 = 1.0 / 6.0 - z * (1.0 / 120.0 - z * (1.0 / 5040.0 - z * (1.0 / 362880.0 - z * (1.0 / 39916800.0 - z / 6227020800.0))));
+    }
+    else if (z > 0) {
+        double s = std::sqrt(z);
+        c2 = (1.0 - std::cos(s)) / z;
+        c3 = (s - std::sin(s)) / (z * s);
+    }
+    else {
+        double s = std::sqrt(-z);
+        c2 = (std::cosh(s) - 1.0) / -z;
+        c3 = (std::sinh(s) - s) / (-z * s);
+    }
+}
+
+// Starting universal anomaly for a flight of dt: mean motion for bound orbits, and for hyperbolic ones Vallado's
+// logarithmic estimate, as the anomaly only grows with the log of the time once the body has escaped. Static so that
+// GravityKernelsAVX2.cpp, built with AVX2 enabled, gets its own copy rather than one shared with the rest of the program
+static inline double KeplerInitialAnomaly(double sqrtMu, double alpha, double r0, double sigma0, double dt)
+{
+    if (alpha > 1e-12 / r0)
+        return sqrtMu * dt * alpha;
+    if (alpha < -1e-12 / r0) {
+        const double a = 1.0 / alpha, sign = dt >= 0 ? 1.0 : -1.0;
+        const double argument = -2.0 * sqrtMu * sqrtMu * alpha * dt / (sigma0 * sqrtMu + sign * sqrtMu * std::sqrt(-a) * (1.0 - r0 * alpha));
+        if (argument > 0)
+            return sign * std::sqrt(-a) * std::log(argument);
+    }
+    return sqrtMu * dt / r0;
+}
+
+/// <summary>
+/// Moves a body along its two-body orbit about a fixed mass mu for time dt, for any eccentricity. The
+/// universal Kepler equation is solved for the universal anomaly with Laguerre-Conway iterations,
+/// which converge from a rough start where Newton's method can wander, and the state is advanced with
+/// the f and g functions. Bound orbits first drop whole periods from dt. Returns false, leaving the
+/// state untouched, if the solver did not converge.
+/// </summary>
+inline bool KeplerDrift(double mu, double dt, double& x, double& y, double& z, double& vx, double& vy, double& vz)
+{
+    const double r0 = std::sqrt(x * x + y * y + z * z);
+    if (mu <= 0 || r0 <= 0 || dt == 0) {
+        x += vx * dt;
+        y += vy * dt;
+        z += vz * dt;
+        return mu <= 0 || dt == 0;
+    }
+    const double sqrtMu = std::sqrt(mu);
+    const double v2 = vx * vx + vy * vy + vz * vz;
+    const double alpha = 2.0 / r0 - v2 / mu;     // Reciprocal of the semi-major axis
+    const double sigma0 = (x * vx + y * vy + z * vz) / sqrtMu;
+
+    if (alpha > 1e-12 / r0) {
+        double period = 2.0 * 3.14159265358979323846 / (sqrtMu * alpha * std::sqrt(alpha));
+        dt = std::fmod(dt, period);
+    }
+    double chi = KeplerInitialAnomaly(sqrtMu, alpha, r0, sigma0, dt);
+
+    const double n = 5.0;    // Laguerre-Conway order
+    double c2 = 0.5, c3 = 1.0 / 6.0, r = r0;
+    bool converged = false;
+    for (int iteration = 0; iteration < 50; iteration++)
+    {
+        double chi2 = chi * chi;
+        double zeta = alpha * chi2;
+        StumpffC2C3(zeta, c2, c3);
+        double f = sigma0 * chi2 * c2 + (1.0 - alpha * r0) * chi2 * chi * c3 + r0 * chi - sqrtMu * dt;
+        double df = sigma0 * chi * (1.0 - zeta * c3) + (1.0 - alpha * r0) * chi2 * c2 + r0;
+        double ddf = sigma0 * (1.0 - zeta * c2) + (1.0 - alpha * r0) * chi * (1.0 - zeta * c3);
+        r = df;
+        double root = std::sqrt(std::abs((n - 1.0) * (n - 1.0) * df * df - n * (n - 1.0) * f * ddf));
+        double step = n * f / (df + (df >= 0 ? root : -root));
+        chi -= step;
+        if (std::abs(step) <= 1e-14 * std::max(std::abs(chi), 1e-300)) {
+            converged = true;
+            break;
+        }
+    }
+    if (!converged || !std::isfinite(chi))
+        return false;
+
+    double chi2 = chi * chi;
+    StumpffC2C3(alpha * chi2, c2, c3);
+    r = sigma0 * chi * (1.0 - alpha * chi2 * c3) + (1.0 - alpha * r0) * chi2 * c2 + r0;
+    const double f = 1.0 - chi2 * c2 / r0;
+    const double g = dt - chi2 * chi * c3 / sqrtMu;
+    const double fDot = sqrtMu * chi * (alpha * chi2 * c3 - 1.0) / (r * r0);
+    const double gDot = 1.0 - chi2 * c2 / r;
+
+    const double x0 = x, y0 = y, z0 = z;
+    x = f * x0 + g * vx;
+    y = f * y0 + g * vy;
+    z = f * z0 + g * vz;
+    vx = fDot * x0 + gDot * vx;
+    vy = fDot * y0 + gDot * vy;
+    vz = fDot * z0 + gDot * vz;
+    return true;
+}
+
+/// <summary>
+/// KeplerDrift for many bodies over the same dt, each about its own mu (the arrays are structure-of-arrays,
+/// as in BodyStore). On processors with AVX2 four bodies share each register through the whole solve
+/// (KeplerDriftAVX2x4): the Stumpff functions come from StumpffC2C3x4, bound orbits drop whole periods with a floor rather than fmod, and the
+/// Laguerre-Conway iterations run until every lane has converged. A lane that does not converge, or that
+/// KeplerDrift would treat specially (mu <= 0, a body on its centre), is left to KeplerDrift, which is also
+/// all that runs without AVX2. Returns the number of bodies KeplerDrift could not move.
+/// </summary>
+inline size_t KeplerDriftBatch(const double* mu, double dt, size_t count, double* x, double* y, double* z, double* vx, double* vy, double* vz)
+{
+    size_t failures = 0;
+    size_t i = 0;
+    if (GetSimdLevel() != SimdLevel::Scalar) {
+        for (; i + 4 <= count; i += 4)
+        {
+            const int moved = KeplerDriftAVX2x4(mu + i, dt, x + i, y + i, z + i, vx + i, vy + i, vz + i);
+            if (moved < 0)
+                break;   // Rare enough to hand the rest of the array to the scalar loop
+            for (int lane = 0; lane < 4; lane++)
+            {
+                const size_t k = i + lane;
+                if (!(moved & (1 << lane)) && !KeplerDrift(mu[k], dt, x[k], y[k], z[k], vx[k], vy[k], vz[k])) {
+                    failures++;
+                }
+            }
+        }
+    }
+    for (; i < count; i++)
+    {
+        if (!KeplerDrift(mu[i], dt, x[i], y[i], z[i], vx[i], vy[i], vz[i])) {
+            failures++;
+        }
+    }
+    return failures;
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <utility>
+#include "BodyStore.h"
+#include "ThreadPool.h"
+
+// Axis-aligned box, used for both the bounding cube of a sort and the tight boxes of tree nodes
+struct BodyBounds {
+    double minX, minY, minZ;
+    double maxX, maxY, maxZ;
+
+    static BodyBounds Empty()
+    {
+        return { std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+            std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest() };
+    }
+
+    void Add(double x, double y, double z)
+    {
+        minX = std::min(minX, x); maxX = std::max(maxX, x);
+        minY = std::min(minY, y); maxY = std::max(maxY, y);
+        minZ = std::min(minZ, z); maxZ = std::max(maxZ, z);
+    }
+
+    void Add(const BodyBounds& other)
+    {
+        minX = std::min(minX, other.minX); maxX = std::max(maxX, other.maxX);
+        minY = std::min(minY, other.minY); maxY = std::max(maxY, other.maxY);
+        minZ = std::min(minZ, other.minZ); maxZ = std::max(maxZ, other.maxZ);
+    }
+};
+
+/// <summary>
+/// Orders a range of bodies along a Morton (Z-order) curve inside their bounding cube. After Sort()
+/// every octree cell at every level covers a contiguous run of keys, which is what the tree solvers
+/// build their depth-first node arrays from. Keys are computed and sorted per pool participant, then
+/// the sorted runs are merged.
+/// </summary>
+class MortonSort
+{
+private:
+    std::vector<BodyBounds> participantBounds;
+    std::vector<size_t> runEnds;    // End of the run each participant sorted, 0 for one given no keys
+
+    static uint64_t SpreadBits(uint64_t v)
+    {
+        v &= 0x1FFFFF;
+        v = (v | v << 32) & 0x1F00000000FFFFULL;
+        v = (v | v << 16) & 0x1F0000FF0000FFULL;
+        v = (v | v << 8) & 0x100F00F00F00F00FULL;
+        v = (v | v << 4) & 0x10C30C30C30C30C3ULL;
+        v = (v | v << 2) & 0x1249249249249249ULL;
+        return v;
+    }
+
+public:
+    static constexpr int MaxDepth = 21; // 21 bits per axis in a 63-bit key
+
+    // (key, offset from the start of the sorted range), ascending after Sort()
+    std::vector<std::pair<uint64_t, uint32_t>> keys;
+
+    // Octant (0..7) of a key at the given tree level, level 0 being the children of the root
+    static uint64_t Octant(uint64_t key, int level)
+    {
+        return (key >> (3 * (MaxDepth - 1 - level))) & 7;
+    }
+
+    // Sorts bodies [begin, end) at the stage positions
+    void Sort(const StageView& s, size_t begin, size_t end, ThreadPool& pool)
+    {
+        size_t n = end - begin;
+        keys.resize(n);
+        if (n == 0)
+            return;
+
+        const int participants = pool.GetNumberOfParticipants();
+        participantBounds.assign(participants, BodyBounds::Empty());
+        pool.ParallelFor(n, [&](size_t first, size_t last, int participant) {
+            BodyBounds& box = participantBounds[participant];
+            for (size_t i = begin + first; i < begin + last; i++)
+            {
+                box.Add(s.x[i], s.y[i], s.z[i]);
+            }
+            });
+        BodyBounds cube = participantBounds[0];
+        for (int p = 1; p < participants; p++)
+        {
+            cube.Add(participantBounds[p]);
+        }
+        double side = std::max({ cube.maxX - cube.minX, cube.maxY - cube.minY, cube.maxZ - cube.minZ });
+        double scale = side > 0 ? (double)((1 << MaxDepth) - 1) / side : 0.0;
+
+        runEnds.assign(participants, 0);
+        pool.ParallelFor(n, [&](size_t first, size_t last, int participant) {
+            runEnds[participant] = last;
+            for (size_t i = first; i < last; i++)
+            {
+                size_t body = begin + i;
+                uint64_t qx = (uint64_t)((s.x[body] - cube.minX) * scale);
+                uint64_t qy = (uint64_t)((s.y[body] - cube.minY) * scale);
+                uint64_t qz = (uint64_t)((s.z[body] - cube.minZ) * scale);
+                keys[i] = { SpreadBits(qx) << 2 | SpreadBits(qy) << 1 | SpreadBits(qz), (uint32_t)i };
+            }
+            std::sort(keys.begin() + first, keys.begin() + last);
+            });
+        // Merge neighbouring runs pairwise at the boundaries ParallelFor actually chose, which differ in width by
+        // one key whenever n is not a multiple of the participant count
+        runEnds.erase(std::remove(runEnds.begin(), runEnds.end(), (size_t)0), runEnds.end());
+        while (runEnds.size() > 1)
+        {
+            size_t kept = 0, left = 0;
+            for (size_t r = 0; r < runEnds.size(); r += 2)
+            {
+                if (r + 1 < runEnds.size()) {
+                    std::inplace_merge(keys.begin() + left, keys.begin() + runEnds[r], keys.begin() + runEnds[r + 1]);
+                    left = runEnds[r + 1];
+                }
+                else {
+                    left = runEnds[r];
+                }
+                runEnds[kept++] = left;
+            }
+            runEnds.resize(kept);
+        }
+    }
+
+    // Whether the keys of the last Sort() are in ascending order, which every tree built from them relies on
+    bool IsSorted() const
+    {
+        return std::is_sorted(keys.begin(), keys.end());
+    }
+
+    // End of the run in [first, last) whose keys fall in octants up to and including the given one at this level
+    uint32_t OctantEnd(uint32_t first, uint32_t last, int level, uint64_t octant) const
+    {
+        return (uint32_t)(std::partition_point(keys.begin() + first, keys.begin() + last,
+            [level, octant](const std::pair<uint64_t, uint32_t>& key) { return Octant(key.first, level) <= octant; }) - keys.begin());
+    }
+};
@@ -0,0 +1,252 @@
+#pragma once
+#include <cmath>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include "BodyStore.h"
+#include "GravityKernels.h"
+#include "ThreadPool.h"
+#include "IAS15.h"
+#include "PatchedConics.h"
+
+// Positions and velocities of every body in a store, one Parareal slice boundary
+struct PhaseState {
+    AlignedDoubles x, y, z, vx, vy, vz;
+
+    void Load(const BodyStore& bodies)
+    {
+        x.assign(bodies.x.begin(), bodies.x.begin() + bodies.count);
+        y.assign(bodies.y.begin(), bodies.y.begin() + bodies.count);
+        z.assign(bodies.z.begin(), bodies.z.begin() + bodies.count);
+        vx.assign(bodies.vx.begin(), bodies.vx.begin() + bodies.count);
+        vy.assign(bodies.vy.begin(), bodies.vy.begin() + bodies.count);
+        vz.assign(bodies.vz.begin(), bodies.vz.begin() + bodies.count);
+    }
+
+    void Store(BodyStore& bodies) const
+    {
+        std::copy(x.begin(), x.end(), bodies.x.begin());
+        std::copy(y.begin(), y.end(), bodies.y.begin());
+        std::copy(z.begin(), z.end(), bodies.z.begin());
+        std::copy(vx.begin(), vx.end(), bodies.vx.begin());
+        std::copy(vy.begin(), vy.end(), bodies.vy.begin());
+        std::copy(vz.begin(), vz.end(), bodies.vz.begin());
+    }
+};
+
+// Coarse propagators: a kick-drift-kick leapfrog, or patched conics (PatchedConics.h), which follow satellites
+// around their planets exactly and leave the fine propagator only the perturbations to correct
+enum class PararealCoarse { Leapfrog, PatchedConics };
+
+// What one fast-forward cost and how it converged
+struct PararealReport {
+    int slices = 0;
+    int iterations = 0;            // Fine sweeps taken
+    bool converged = false;
+    double change = 0;             // Largest position change of the last correction (m)
+    double wallSeconds = 0;        // On this machine, with however many threads the pool has
+    double serialSeconds = 0;      // Fine propagator across the whole window, the first sweep's slices added up
+    double criticalSeconds = 0;    // Coarse sweeps plus the slowest slice of every fine sweep: the wall time with a core per slice
+
+    // Speedup over running the fine propagator serially, with a core per slice
+    double Speedup() const { return criticalSeconds > 0 ? serialSeconds / criticalSeconds : 0.0; }
+};
+
+/// <summary>
+/// Parareal (Lions, Maday and Turinici 2001) across a window of time split into slices. A cheap coarse
+/// propagator G of a few long steps per slice runs serially through the window; the accurate fine
+/// propagator F, IAS15, then runs every slice from its current start state at once, and the serial sweep
+/// U[n+1] = G(U[n]) + F(U[n]) - G(U[n]) using the coarse result of the previous sweep carries the correction
+/// forward. After k sweeps the first k slices are exact, so it always converges in as many sweeps as there are
+/// slices; it pays when the coarse propagator is good enough to converge in a few. Both propagators see gravity
+/// from the massive bodies and the external accelerations as they were at the start of the window.
+/// </summary>
+class PararealIntegrator
+{
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::vector<PhaseState> boundaries;     // U: the state at the start of each slice, and at the end of the window
+    std::vector<PhaseState> coarse;         // G(U) of each slice from the last sweep
+    std::vector<PhaseState> fine;           // F(U) of each slice
+    std::vector<BodyStore> sliceStores;     // Scratch store of each slice's fine propagator
+    std::vector<IAS15Integrator> fineIntegrators;
+    std::vector<double> fineSeconds;
+    BodyStore coarseStore;
+    PhaseState coarseResult;
+    PatchedConicPropagator patchedConics;
+
+    static double Seconds(Clock::time_point start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    // Direct sum over the massive bodies into stage 0, plus the external accelerations
+    static void Evaluate(BodyStore& bodies)
+    {
+        const StageView s = bodies.View(0);
+        AccumulateGravityBlock(s, bodies.mu.data(), 0, bodies.count, 0, bodies.massiveCount);
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            s.ax[i] += bodies.extAx[i];
+            s.ay[i] += bodies.extAy[i];
+            s.az[i] += bodies.extAz[i];
+        }
+    }
+
+    // Copies masses and external accelerations, everything the propagators read besides the state
+    static void Prepare(BodyStore& store, const BodyStore& bodies)
+    {
+        if (store.count != bodies.count || store.massiveCount != bodies.massiveCount) {
+            store.Resize(bodies.count, bodies.massiveCount);
+        }
+        std::copy(bodies.m.begin(), bodies.m.begin() + bodies.count, store.m.begin());
+        std::copy(bodies.mu.begin(), bodies.mu.begin() + bodies.count, store.mu.begin());
+        std::copy(bodies.extAx.begin(), bodies.extAx.begin() + bodies.count, store.extAx.begin());
+        std::copy(bodies.extAy.begin(), bodies.extAy.begin() + bodies.count, store.extAy.begin());
+        std::copy(bodies.extAz.begin(), bodies.extAz.begin() + bodies.count, store.extAz.begin());
+    }
+
+    // coarseSteps steps of the coarse propagator across h
+    void Coarse(const PhaseState& start, double h, PhaseState& end)
+    {
+        start.Store(coarseStore);
+        const double step = h / coarseSteps;
+        if (coarseMethod == PararealCoarse::PatchedConics) {
+            for (int k = 0; k < coarseSteps; k++)
+            {
+                patchedConics.Advance(coarseStore, step);
+            }
+            end.Load(coarseStore);
+            return;
+        }
+        const BodyStage& s = coarseStore.stages[0];
+        coarseStore.stages[0].ClearAcceleration();
+        Evaluate(coarseStore);
+        for (int k = 0; k < coarseSteps; k++)
+        {
+            for (size_t i = 0; i < coarseStore.count; i++)
+            {
+                coarseStore.vx[i] += 0.5 * step * s.ax[i];
+                coarseStore.vy[i] += 0.5 * step * s.ay[i];
+                coarseStore.vz[i] += 0.5 * step * s.az[i];
+                coarseStore.x[i] += step * coarseStore.vx[i];
+                coarseStore.y[i] += step * coarseStore.vy[i];
+                coarseStore.z[i] += step * coarseStore.vz[i];
+            }
+            coarseStore.stages[0].ClearAcceleration();
+            Evaluate(coarseStore);
+            for (size_t i = 0; i < coarseStore.count; i++)
+            {
+                coarseStore.vx[i] += 0.5 * step * s.ax[i];
+                coarseStore.vy[i] += 0.5 * step * s.ay[i];
+                coarseStore.vz[i] += 0.5 * step * s.az[i];
+            }
+        }
+        end.Load(coarseStore);
+    }
+
+    void Fine(size_t n, double h)
+    {
+        const Clock::time_point start = Clock::now();
+        BodyStore& store = sliceStores[n];
+        boundaries[n].Store(store);
+        fineIntegrators[n].Integrate(store, h, [&store] { Evaluate(store); });
+        fine[n].Load(store);
+        fineSeconds[n] = Seconds(start);
+    }
+
+public:
+    PararealCoarse coarseMethod = PararealCoarse::PatchedConics;
+    int coarseSteps = 1;        // Steps per slice of the coarse propagator
+    double tolerance = 1.0;     // Largest change in any body's position (m) at which the corrections stop
+
+    /// <summary>
+    /// Advances the store by duration in slices run side by side on the pool, a slice per participant when slices
+    /// is 0. Stops when a correction moves no body by more than tolerance or after maxIterations sweeps.
+    /// </summary>
+    PararealReport Integrate(BodyStore& bodies, double duration, int slices, int maxIterations, ThreadPool& pool)
+    {
+        PararealReport report;
+        const Clock::time_point start = Clock::now();
+        const size_t n = (size_t)(slices > 0 ? slices : pool.GetNumberOfParticipants());
+        report.slices = (int)n;
+        if (bodies.count == 0 || duration == 0)
+            return report;
+        const double h = duration / n;
+
+        boundaries.resize(n + 1);
+        coarse.resize(n);
+        fine.resize(n);
+        sliceStores.resize(n);
+        fineIntegrators.resize(n);
+        fineSeconds.assign(n, 0.0);
+        Prepare(coarseStore, bodies);
+        for (BodyStore& store : sliceStores)
+        {
+            Prepare(store, bodies);
+        }
+
+        // Serial coarse sweep for the first guess
+        Clock::time_point sweep = Clock::now();
+        boundaries[0].Load(bodies);
+        for (size_t k = 0; k < n; k++)
+        {
+            Coarse(boundaries[k], h, coarse[k]);
+            boundaries[k + 1] = coarse[k];
+        }
+        report.criticalSeconds += Seconds(sweep);
+
+        for (size_t first = 0; first < n && report.iterations < maxIterations; first++)
+        {
+            // Slices before first already start from the fine solution and need no more sweeps
+            pool.ParallelFor(n - first, [this, first, h](size_t begin, size_t end, int) {
+                for (size_t k = first + begin; k < first + end; k++)
+                {
+                    Fine(k, h);
+                }
+                });
+            report.iterations++;
+            double slowest = 0;
+            for (size_t k = first; k < n; k++)
+            {
+                slowest = std::max(slowest, fineSeconds[k]);
+                if (first == 0) {
+                    report.serialSeconds += fineSeconds[k];
+                }
+            }
+            report.criticalSeconds += slowest;
+
+            sweep = Clock::now();
+            report.change = 0;
+            for (size_t k = first; k < n; k++)
+            {
+                Coarse(boundaries[k], h, coarseResult);
+                PhaseState& next = boundaries[k + 1];
+                for (size_t i = 0; i < bodies.count; i++)
+                {
+                    const double x = coarseResult.x[i] + fine[k].x[i] - coarse[k].x[i];
+                    const double y = coarseResult.y[i] + fine[k].y[i] - coarse[k].y[i];
+                    const double z = coarseResult.z[i] + fine[k].z[i] - coarse[k].z[i];
+                    const double dx = x - next.x[i], dy = y - next.y[i], dz = z - next.z[i];
+                    report.change = std::max(report.change, std::sqrt(dx * dx + dy * dy + dz * dz));
+                    next.x[i] = x; next.y[i] = y; next.z[i] = z;
+                    next.vx[i] = coarseResult.vx[i] + fine[k].vx[i] - coarse[k].vx[i];
+                    next.vy[i] = coarseResult.vy[i] + fine[k].vy[i] - coarse[k].vy[i];
+                    next.vz[i] = coarseResult.vz[i] + fine[k].vz[i] - coarse[k].vz[i];
+                }
+                std::swap(coarse[k], coarseResult);
+            }
+            report.criticalSeconds += Seconds(sweep);
+            if (report.change <= tolerance || first + 1 == n) {
+                report.converged = true;
+                break;
+            }
+        }
+
+        boundaries[n].Store(bodies);
+        report.wallSeconds = Seconds(start);
+        return report;
+    }
+};
@@ -0,0 +1,381 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include "triple.h"
+#include "BodyStore.h"
+#include "Kepler.h"
+
+/// <summary>
+/// On-rails propagation with patched conics. Every body moves on a two-body conic about the body whose sphere
+/// of influence holds it, so a step of any length costs one Kepler solve per body and the long warps that
+/// would take thousands of integrator steps run in a single frame.
+///
+/// The hierarchy is rebuilt at the start of each step from the current states. Massive bodies are placed in
+/// order of decreasing mu, each inside the smallest sphere of a heavier body that contains it; the heaviest
+/// body is the root and coasts in a straight line. The sphere of influence of a body of mu_j about mu_p is
+/// a (mu_j / mu_p)^(2/5), with a its osculating semi-major axis (its distance if unbound). Massive bodies keep
+/// their place for the whole step and are advanced in one KeplerDriftBatch about mu_p + mu_j.
+///
+/// Massless bodies can change sphere inside the step. One whose conic cannot reach the edge of its sphere or the
+/// sphere of any body orbiting its primary is advanced in the batch with the rest. For the others the step is
+/// sampled, finely enough not to miss a crossing at the speeds involved, and the first sign change of distance
+/// minus sphere radius is refined by bisection. At the crossing the state is re-expressed about the new primary
+/// and the rest of the step is propagated about it, crossing again if it has to.
+///
+/// Everything else is left out by design: there is no perturbation from bodies outside the current sphere, no
+/// external force, and massive bodies do not pull on their primary.
+/// </summary>
+class PatchedConicPropagator
+{
+private:
+    static constexpr double SampleFraction = 0.1;   // Sample spacing as a fraction of the quickest crossing time scale
+    static constexpr size_t MaxSamples = 4096;      // Per leg, a step that needs more still finds the crossings the grid resolves
+    static constexpr int MaxTransitions = 16;       // Sphere changes per body per step
+    static constexpr int BisectionSteps = 60;
+    static constexpr double CrossingTolerance = 1e-3; // Seconds
+
+    std::vector<int> parent;               // Store index of the primary, -1 for the root
+    std::vector<double> sphere;            // Sphere of influence of each massive body, HUGE_VAL for the root
+    std::vector<size_t> order;             // Massive bodies, parents before children
+    std::vector<triple> relativePosition, relativeVelocity;    // Massive bodies about their parent at the start of the step
+    std::vector<triple> startPosition, startVelocity;          // Massive bodies at the start of the step
+    AlignedDoubles laneMu, lx, ly, lz, lvx, lvy, lvz;          // Batch lanes
+    std::vector<size_t> lanes;
+    size_t transitions = 0;
+    size_t sampledBodies = 0;
+    size_t failures = 0;
+
+    // Two-body conic of a relative state: mu, periapsis and apoapsis distances (apoapsis HUGE_VAL if unbound)
+    struct Conic {
+        double mu = 0, periapsis = 0, apoapsis = 0, alpha = 0;
+    };
+
+    static Conic ConicOf(double mu, const triple& r, const triple& v)
+    {
+        Conic conic;
+        conic.mu = mu;
+        const double distance = r.magnitude();
+        conic.alpha = 2.0 / distance - (v * v) / mu;
+        const triple h = triple::Cross(r, v);
+        const double p = (h * h) / mu;     // Semi-latus rectum
+        const double e2 = std::max(0.0, 1.0 - p * conic.alpha);
+        const double e = std::sqrt(e2);
+        conic.periapsis = p / (1.0 + e);
+        conic.apoapsis = conic.alpha > 0 && e < 1.0 ? p / (1.0 - e) : HUGE_VAL;
+        return conic;
+    }
+
+    // Speed on a conic at a given distance, from vis-viva
+    static double SpeedAt(const Conic& conic, double distance)
+    {
+        return std::sqrt(std::max(0.0, conic.mu * (2.0 / distance - conic.alpha)));
+    }
+
+    static void Drift(double mu, double t, triple& r, triple& v, size_t& failures)
+    {
+        if (!KeplerDrift(mu, t, r.x, r.y, r.z, v.x, v.y, v.z)) {
+            failures++;
+        }
+    }
+
+    double PairMu(const BodyStore& bodies, size_t j) const
+    {
+        return bodies.mu[parent[j]] + bodies.mu[j];
+    }
+
+    // Massive body j relative to its parent, t into the step
+    void RelativeAt(const BodyStore& bodies, size_t j, double t, triple& r, triple& v)
+    {
+        r = relativePosition[j];
+        v = relativeVelocity[j];
+        Drift(PairMu(bodies, j), t, r, v, failures);
+    }
+
+    void BuildHierarchy(const BodyStore& bodies)
+    {
+        const size_t massive = bodies.massiveCount;
+        parent.assign(bodies.count, -1);
+        sphere.assign(massive, HUGE_VAL);
+        relativePosition.assign(massive, triple::zero());
+        relativeVelocity.assign(massive, triple::zero());
+        startPosition.assign(massive, triple::zero());
+        startVelocity.assign(massive, triple::zero());
+        order.resize(massive);
+        std::iota(order.begin(), order.end(), size_t(0));
+        std::stable_sort(order.begin(), order.end(), [&bodies](size_t a, size_t b) { return bodies.mu[a] > bodies.mu[b]; });
+
+        for (size_t k = 0; k < massive; k++)
+        {
+            const size_t j = order[k];
+            const triple position(bodies.x[j], bodies.y[j], bodies.z[j]);
+            const triple velocity(bodies.vx[j], bodies.vy[j], bodies.vz[j]);
+            startPosition[j] = position;
+            startVelocity[j] = velocity;
+            if (k == 0 || bodies.mu[j] <= 0)
+                continue;
+            const int p = DeepestSphere(position, k);
+            parent[j] = p;
+            relativePosition[j] = position - startPosition[p];
+            relativeVelocity[j] = velocity - startVelocity[p];
+            const double distance = relativePosition[j].magnitude();
+            const double alpha = 2.0 / distance - (relativeVelocity[j] * relativeVelocity[j]) / PairMu(bodies, j);
+            const double a = alpha > 0 ? 1.0 / alpha : distance;
+            sphere[j] = a * std::pow(bodies.mu[j] / bodies.mu[p], 0.4);
+        }
+        for (size_t i = massive; i < bodies.count; i++)
+        {
+            parent[i] = massive > 0 ? DeepestSphere(triple(bodies.x[i], bodies.y[i], bodies.z[i]), massive) : -1;
+        }
+    }
+
+    // Of the first placed bodies in order, the one with the smallest sphere that contains position
+    int DeepestSphere(const triple& position, size_t placed) const
+    {
+        size_t best = order[0];
+        for (size_t k = 1; k < placed; k++)
+        {
+            const size_t j = order[k];
+            if (parent[j] < 0 || sphere[j] >= sphere[best])
+                continue;
+            const triple offset = position - startPosition[j];
+            if (offset * offset < sphere[j] * sphere[j]) {
+                best = j;
+            }
+        }
+        return (int)best;
+    }
+
+    // Sphere boundaries a body on conic about primary can reach: leaving the primary's sphere, or entering one of
+    // its children's. Returns the quickest crossing time scale among them, HUGE_VAL when none is reachable
+    double CrossingTimescale(const BodyStore& bodies, size_t primary, const Conic& conic, std::vector<size_t>& children)
+    {
+        children.clear();
+        double quickest = HUGE_VAL;
+        if (parent[primary] >= 0 && conic.apoapsis >= sphere[primary]) {
+            // The distance only turns back near the edge on orbits whose period there is set by the edge itself
+            quickest = std::sqrt(sphere[primary] * sphere[primary] * sphere[primary] / conic.mu);
+        }
+        for (size_t j : order)
+        {
+            if (parent[j] != (int)primary)
+                continue;
+            const Conic orbit = ConicOf(PairMu(bodies, j), relativePosition[j], relativeVelocity[j]);
+            const double inner = std::max(orbit.periapsis - sphere[j], 0.0), outer = orbit.apoapsis + sphere[j];
+            if (conic.apoapsis < inner || conic.periapsis > outer)
+                continue;
+            children.push_back(j);
+            const double closest = std::max(std::max(inner, conic.periapsis), 1.0);
+            const double speed = SpeedAt(conic, closest) + SpeedAt(orbit, std::max(orbit.periapsis, 1.0));
+            quickest = std::min(quickest, speed > 0 ? sphere[j] / speed : HUGE_VAL);
+        }
+        return quickest;
+    }
+
+    // Distance outside the sphere of interest at time t into the step: positive once the body has crossed
+    double Boundary(const BodyStore& bodies, size_t primary, int child, double legStart, const triple& r0, const triple& v0, double t)
+    {
+        triple r = r0, v = v0;
+        Drift(bodies.mu[primary], t - legStart, r, v, failures);
+        if (child < 0)
+            return r.magnitude() - sphere[primary];
+        triple cr, cv;
+        RelativeAt(bodies, (size_t)child, t, cr, cv);
+        return sphere[child] - (r - cr).magnitude();
+    }
+
+    /// <summary>
+    /// Carries massless body i across the step, switching primary at every sphere crossing the samples bracket.
+    /// r and v are relative to the primary on entry and on return
+    /// </summary>
+    void AdvanceWithCrossings(const BodyStore& bodies, size_t i, double h, triple& r, triple& v)
+    {
+        std::vector<size_t> children;
+        double t = 0;
+        size_t primary = (size_t)parent[i];
+        for (int transition = 0; transition <= MaxTransitions && t < h; transition++)
+        {
+            const Conic conic = ConicOf(bodies.mu[primary], r, v);
+            const double timescale = transition < MaxTransitions ? CrossingTimescale(bodies, primary, conic, children) : HUGE_VAL;
+            const double remaining = h - t;
+            if (timescale == HUGE_VAL) {
+                Drift(bodies.mu[primary], remaining, r, v, failures);
+                t = h;
+                break;
+            }
+            const size_t samples = (size_t)std::clamp(std::ceil(remaining / (SampleFraction * timescale)), 1.0, (double)MaxSamples);
+
+            // Earliest crossing of any boundary, bracketed by the samples
+            const double legStart = t;
+            double crossing = HUGE_VAL;
+            int crossed = -2;
+            double before = legStart;
+            for (size_t s = 1; s <= samples && crossing == HUGE_VAL; s++)
+            {
+                const double after = legStart + remaining * (double)s / (double)samples;
+                for (int event = -1; event < (int)children.size(); event++)
+                {
+                    const int child = event < 0 ? -1 : (int)children[event];
+                    if (child < 0 && parent[primary] < 0)
+                        continue;
+                    if (Boundary(bodies, primary, child, legStart, r, v, after) <= 0)
+                        continue;
+                    double low = before, high = after;
+                    for (int k = 0; k < BisectionSteps && high - low > CrossingTolerance; k++)
+                    {
+                        const double middle = 0.5 * (low + high);
+                        (Boundary(bodies, primary, child, legStart, r, v, middle) > 0 ? high : low) = middle;
+                    }
+                    if (high < crossing) {
+                        crossing = high;
+                        crossed = child;
+                    }
+                }
+                before = after;
+            }
+            if (crossing == HUGE_VAL) {
+                Drift(bodies.mu[primary], remaining, r, v, failures);
+                t = h;
+                break;
+            }
+
+            // Re-express the state about the new primary just past the crossing
+            Drift(bodies.mu[primary], crossing - legStart, r, v, failures);
+            triple offset, offsetVelocity;
+            if (crossed < 0) {
+                RelativeAt(bodies, primary, crossing, offset, offsetVelocity);
+                r += offset;
+                v += offsetVelocity;
+                primary = (size_t)parent[primary];
+            }
+            else {
+                RelativeAt(bodies, (size_t)crossed, crossing, offset, offsetVelocity);
+                r -= offset;
+                v -= offsetVelocity;
+                primary = (size_t)crossed;
+            }
+            t = crossing;
+            transitions++;
+        }
+        parent[i] = (int)primary;
+    }
+
+public:
+    /// <summary>
+    /// Moves every body in the store along its patched conic for h and leaves parent() pointing at each body's
+    /// primary at the end of the step
+    /// </summary>
+    void Advance(BodyStore& bodies, double h)
+    {
+        sampledBodies = 0;
+        if (bodies.count == 0 || bodies.massiveCount == 0 || h == 0)
+            return;
+        BuildHierarchy(bodies);
+        const size_t massive = bodies.massiveCount;
+
+        // Everything that stays on one conic for the whole step goes through the batch: the massive bodies and
+        // the massless ones whose conic cannot reach a sphere boundary
+        std::vector<size_t> children;
+        std::vector<size_t> sampled;
+        lanes.clear();
+        for (size_t j = 0; j < massive; j++)
+        {
+            if (parent[j] >= 0) {
+                lanes.push_back(j);
+            }
+        }
+        for (size_t i = massive; i < bodies.count; i++)
+        {
+            const size_t p = (size_t)parent[i];
+            const triple r = triple(bodies.x[i], bodies.y[i], bodies.z[i]) - startPosition[p];
+            const triple v = triple(bodies.vx[i], bodies.vy[i], bodies.vz[i]) - startVelocity[p];
+            if (CrossingTimescale(bodies, p, ConicOf(bodies.mu[p], r, v), children) == HUGE_VAL) {
+                lanes.push_back(i);
+            }
+            else {
+                sampled.push_back(i);
+            }
+        }
+        for (AlignedDoubles* array : { &laneMu, &lx, &ly, &lz, &lvx, &lvy, &lvz })
+        {
+            array->resize(lanes.size());
+        }
+        for (size_t k = 0; k < lanes.size(); k++)
+        {
+            const size_t i = lanes[k];
+            const size_t p = (size_t)parent[i];
+            const bool isMassive = i < massive;
+            laneMu[k] = isMassive ? PairMu(bodies, i) : bodies.mu[p];
+            lx[k] = bodies.x[i] - startPosition[p].x; ly[k] = bodies.y[i] - startPosition[p].y; lz[k] = bodies.z[i] - startPosition[p].z;
+            lvx[k] = bodies.vx[i] - startVelocity[p].x; lvy[k] = bodies.vy[i] - startVelocity[p].y; lvz[k] = bodies.vz[i] - startVelocity[p].z;
+        }
+        failures = KeplerDriftBatch(laneMu.data(), h, lanes.size(), lx.data(), ly.data(), lz.data(), lvx.data(), lvy.data(), lvz.data());
+
+        // Massive bodies in hierarchy order, so each parent's end state is in the store before its children need it
+        for (size_t k = 0; k < lanes.size() && lanes[k] < massive; k++)
+        {
+            const size_t j = lanes[k];
+            // The lanes hold the massive bodies in store order; the end states are placed in hierarchy order below
+            relativePosition[j] = triple(lx[k], ly[k], lz[k]);
+            relativeVelocity[j] = triple(lvx[k], lvy[k], lvz[k]);
+        }
+        std::vector<triple> endPosition(massive), endVelocity(massive);
+        for (size_t j : order)
+        {
+            if (parent[j] < 0) {
+                endPosition[j] = startPosition[j] + h * startVelocity[j];
+                endVelocity[j] = startVelocity[j];
+            }
+            else {
+                endPosition[j] = endPosition[parent[j]] + relativePosition[j];
+                endVelocity[j] = endVelocity[parent[j]] + relativeVelocity[j];
+            }
+        }
+        // The sampled bodies need the massive states at any time in the step, so the start states go back in
+        for (size_t k = 0; k < lanes.size() && lanes[k] < massive; k++)
+        {
+            const size_t j = lanes[k];
+            relativePosition[j] = startPosition[j] - startPosition[parent[j]];
+            relativeVelocity[j] = startVelocity[j] - startVelocity[parent[j]];
+        }
+
+        for (size_t k = 0; k < lanes.size(); k++)
+        {
+            const size_t i = lanes[k];
+            if (i < massive)
+                continue;
+            const size_t p = (size_t)parent[i];
+            bodies.x[i] = endPosition[p].x + lx[k]; bodies.y[i] = endPosition[p].y + ly[k]; bodies.z[i] = endPosition[p].z + lz[k];
+            bodies.vx[i] = endVelocity[p].x + lvx[k]; bodies.vy[i] = endVelocity[p].y + lvy[k]; bodies.vz[i] = endVelocity[p].z + lvz[k];
+        }
+        for (size_t i : sampled)
+        {
+            const size_t p = (size_t)parent[i];
+            triple r = triple(bodies.x[i], bodies.y[i], bodies.z[i]) - startPosition[p];
+            triple v = triple(bodies.vx[i], bodies.vy[i], bodies.vz[i]) - startVelocity[p];
+            AdvanceWithCrossings(bodies, i, h, r, v);
+            const size_t q = (size_t)parent[i];
+            bodies.x[i] = endPosition[q].x + r.x; bodies.y[i] = endPosition[q].y + r.y; bodies.z[i] = endPosition[q].z + r.z;
+            bodies.vx[i] = endVelocity[q].x + v.x; bodies.vy[i] = endVelocity[q].y + v.y; bodies.vz[i] = endVelocity[q].z + v.z;
+        }
+        for (size_t j = 0; j < massive; j++)
+        {
+            bodies.x[j] = endPosition[j].x; bodies.y[j] = endPosition[j].y; bodies.z[j] = endPosition[j].z;
+            bodies.vx[j] = endVelocity[j].x; bodies.vy[j] = endVelocity[j].y; bodies.vz[j] = endVelocity[j].z;
+        }
+        sampledBodies = sampled.size();
+    }
+
+    // Store index of the body whose sphere of influence held body i at the end of the last step, -1 for the root
+    int Parent(size_t i) const { return i < parent.size() ? parent[i] : -1; }
+    // Sphere of influence of massive body j at the start of the last step
+    double SphereOfInfluence(size_t j) const { return j < sphere.size() ? sphere[j] : HUGE_VAL; }
+    // Sphere changes since the counters were reset, bodies that needed crossing searches in the last step, and
+    // Kepler solves in the last step that did not converge
+    size_t GetTransitions() const { return transitions; }
+    size_t GetSampledBodies() const { return sampledBodies; }
+    size_t GetFailures() const { return failures; }
+    void ResetCounters() { transitions = 0; }
+};
@@ -1,6 +1,10 @@
 #pragma once
 #include "triple.h"
 #include "GravitySimulator.h"
+#include "Encke.h"
+#include "ReferenceFrame.h"
+#include "Trajectory.h"
+#include "TrailHistory.h"
 #include <cmath>
 
 class PhysicsObject
@@ -8,12 +12,14 @@ class PhysicsObject
 public:
 	const double c = 299792458.0;
 	triple p, v, a;
-	triple p1, p2, p3, p4, p5, p6;
-	triple v1, v2, v3, v4;
-	triple a1, a2, a3, a4, a5, a6;
 	triple ExternalForces;
-	std::vector<triple> pastPositions;
+	// Most recent stored positions relative to trailReference, oldest first, in GravitySimulator's trail slab, see TrailHistory.h
+	TrailRing pastPositions;
+	TrailFilter trailFilter;
+	PhysicsObject* trailReference = nullptr; // referenceObject as it was when the trail started
 	std::vector<triple> pastPositionstemp;
+	// Path as Hermite segments while GravitySimulator::recordTrajectories is on, see Trajectory.h
+	TrajectoryStore trajectory;
 	PhysicsObject* referenceObject = nullptr;
 	const std::string name;
 	double GPE;
@@ -25,6 +31,7 @@ public:
 	float radius;
 	float swartzchildRadius;
 	int index;
+	int storeIndex = -1; // Slot in GravitySimulator::bodies, -1 until the simulator has packed this object
 	int referenceObjectIndex = 0;
 	bool firstIter = true;
 	bool contributesToGravity = true;
@@ -32,6 +39,16 @@ public:
 	bool requestedAlready = false;
 	bool resumeTimeWarp = false;
 	bool isNoneObject = false;
+	// Massless objects with a primary are moved by Encke's method about it instead of by the step integrator, see Encke.h
+	PhysicsObject* enckePrimary = nullptr;
+	EnckeState encke;
+	// Body whose sphere of influence held this one at the end of the last on-rails step, see PatchedConics.h
+	PhysicsObject* sphereOfInfluence = nullptr;
+	// Massless objects in a frame are integrated relative to its origin, see ReferenceFrame.h and GravitySimulator::SetFrame
+	ReferenceFrame* frame = nullptr;
+	FrameState local;
+	// Level under UpdateType::RESPA: the pull between two bodies is summed at the lower of their levels, level 0 once per step and each level above respaSubsteps times as often, see Respa.h
+	int respaLevel = 0;
 	/// <summary>
 	/// Mass, radius, position, velocity
 	/// </summary>
@@ -59,73 +76,6 @@ public:
 	{
 		return a;
 	}
-	void EulerStep(double dt)
-	{
-		this->p = this->p + this->v * dt;
-		this->outputPosition[0] = (float)this->p.x;
-		this->outputPosition[1] = (float)this->p.y;
-		this->outputPosition[2] = (float)this->p.z;
-		this->v = this->v + this->a * dt;
-		if (this->v.magnitude() > c) {
-			this->v = this->v.normalized() * c;
-		}
-		ClearForce();
-	}
-	void VerletStep(double dt)
-	{
-		this->p += this->v * dt + this->a * (dt * dt * 0.5);
-		this->outputPosition[0] = (float)this->p.x;
-		this->outputPosition[1] = (float)this->p.y;
-		this->outputPosition[2] = (float)this->p.z;
-		this->v += this->a * dt;
-		if (this->v.magnitude() > c) {
-			this->v = this->v.normalized() * c;
-		}
-		ClearForce();
-	}
-	void EulerStep2(double dt)
-	{
-		this->v = this->v + this->a * dt;
-		this->p = this->p + this->v * dt;
-		this->outputPosition[0] = (float)this->p.x;
-		this->outputPosition[1] = (float)this->p.y;
-		this->outputPosition[2] = (float)this->p.z;
-		if (this->v.magnitude() > c) {
-			this->v = this->v.normalized() * c;
-		}
-		ClearForce();
-	}
-	void RK4Step1(double dt)
-	{
-		this->p1 = this->p;
-		this->p2 = this->p1 + this->v * dt + 0.5 * this->a1 * dt * dt;
-	}
-
-	void RK4Step2(double dt)
-	{
-		double dtOver2 = dt * 0.5;
-		this->p3 = this->p1 + this->v * dtOver2 + 0.5 * this->a2 * dtOver2 * dtOver2;
-	}
-
-	void RK4Step3(double dt)
-	{
-		double dtOver2 = dt * 0.5;
-		this->p4 = this->p1 + this->v * dtOver2 + 0.5 * this->a3 * dtOver2 * dtOver2;
-	}
-
-	void RK4Step4(double dt)
-	{
-		triple a1 = this->a1;
-		triple a2 = this->a2;
-		triple a3 = this->a3;
-		triple a4 = this->a4;
-		this->a = (a1 + (2 * a4) + (2 * a3) + a2) / 6;
-		this->p = this->p + this->v * dt + 0.5 * this->a * dt * dt;
-		this->v = this->v + this->a * dt;
-		if (this->v.magnitude() > c) {
-			this->v = this->v.normalized() * c;
-		}
-	}
 
 	void AddForce(triple F)
 	{
@@ -135,10 +85,6 @@ public:
 	void ClearForce()
 	{
 		this->a = triple(0, 0, 0);
-		this->a1 = triple(0, 0, 0);
-		this->a2 = triple(0, 0, 0);
-		this->a3 = triple(0, 0, 0);
-		this->a4 = triple(0, 0, 0);
 	}
 
 	void ClearExternalForce()
@@ -146,11 +92,18 @@ public:
 		this->ExternalForces = triple(0, 0, 0);
 	}
 
-	void StoreCurrentPosition(int numberOfStoredPositions)
+	// Stores the position relative to referenceObject, restarting the trail when that has changed, simplified to
+	// tolerance (m) and with the points older than oldest dropped once the one after them is too
+	void StoreCurrentPosition(double t, double tolerance, double oldest)
 	{
-		pastPositions.push_back(this->p);
-		while (pastPositions.size() > numberOfStoredPositions) {
-			pastPositions.erase(pastPositions.begin());
+		if (referenceObject != trailReference) {
+			pastPositions.clear();
+			trailFilter.Reset();
+			trailReference = referenceObject;
+		}
+		trailFilter.Store(pastPositions, referenceObject ? p - referenceObject->p : p, t, tolerance);
+		while (pastPositions.size() > 2 && pastPositions.TimeAt(1) <= oldest) {
+			pastPositions.PopFront();
 		}
 	}
 	
@@ -174,6 +127,12 @@ public:
 		this->v = refObj->v + rdot;
 	}
 
+	// Propagates this object by Encke's method about primary, or by the step integrator again when primary is null
+	void UseEncke(PhysicsObject* primary) {
+		enckePrimary = primary;
+		encke.valid = false;
+	}
+
 	virtual triple GetExternalForces() const {
 		return ExternalForces;
 	}
@@ -0,0 +1,146 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <algorithm>
+#include "triple.h"
+#include "BodyStore.h"
+#include "SourcePaths.h"
+
+class PhysicsObject;
+
+/// <summary>
+/// Local inertial frame whose origin is the centre of a massive body, the anchor, and which can sit inside a
+/// parent frame (a moon's frame inside its planet's, a planet's inside its star's). Massless objects placed in a
+/// frame keep their state relative to the origin, so a metre-scale object light years from the simulator's origin
+/// is as precise as one at the origin. Members that move further than radius from the origin are handed to the
+/// parent frame, or back to absolute coordinates at the top.
+/// </summary>
+class ReferenceFrame
+{
+public:
+    std::string name;
+    PhysicsObject* anchor;
+    ReferenceFrame* parent;
+    double radius;
+
+    ReferenceFrame(const std::string& name, PhysicsObject* anchor, ReferenceFrame* parent = nullptr, double radius = HUGE_VAL)
+        : name(name), anchor(anchor), parent(parent), radius(radius) {}
+
+    // Number of frames above this one
+    int Depth() const
+    {
+        int depth = 0;
+        for (const ReferenceFrame* frame = parent; frame; frame = frame->parent)
+        {
+            depth++;
+        }
+        return depth;
+    }
+};
+
+// Per-object state in its frame, kept on the object; the object's p and v stay the absolute copy everything else reads
+struct FrameState {
+    triple position, velocity;               // Relative to the frame's origin
+    triple lastPosition, lastVelocity;       // Absolute state written at the end of the last step, to spot outside changes
+    bool valid = false;
+
+    // Whether the local state still describes an object whose absolute state is p, v
+    bool Current(const triple& p, const triple& v) const
+    {
+        return valid && lastPosition.x == p.x && lastPosition.y == p.y && lastPosition.z == p.z
+            && lastVelocity.x == v.x && lastVelocity.y == v.y && lastVelocity.z == v.z;
+    }
+};
+
+/// <summary>
+/// Moves the members of reference frames across a step, after the step integrator has moved the massive bodies.
+/// A member's motion relative to its anchor is integrated with RK4 in the frame's own coordinates: the anchor's
+/// pull, plus the tidal pull of every other massive body (its pull on the member less its pull on the anchor,
+/// which is what keeps a free-falling frame inertial), plus the member's external acceleration. The substeps
+/// are sized to the member's distance from the anchor and from every other massive body, as in Encke.h.
+/// </summary>
+class FramePropagator
+{
+private:
+    static constexpr double StepFraction = 0.1;    // Substep as a fraction of the shortest free-fall time scale sqrt(d^3 / mu)
+
+    static triple Acceleration(const BodyStore& bodies, const SourcePaths& paths, size_t i, size_t anchor, double t, const triple& local)
+    {
+        const double r2 = local * local;
+        triple acceleration = r2 > 0 ? (-bodies.mu[anchor] / (r2 * std::sqrt(r2))) * local : triple::zero();
+        const triple origin = paths.Position(bodies, anchor, t);
+        for (size_t j = 0; j < paths.MassiveCount(); j++)
+        {
+            if (j == anchor)
+                continue;
+            const triple toOrigin = paths.Position(bodies, j, t) - origin;
+            const triple toBody = toOrigin - local;
+            const double d2 = toBody * toBody, o2 = toOrigin * toOrigin;
+            if (d2 > 0) {
+                acceleration += (bodies.mu[j] / (d2 * std::sqrt(d2))) * toBody;
+            }
+            if (o2 > 0) {
+                acceleration -= (bodies.mu[j] / (o2 * std::sqrt(o2))) * toOrigin;
+            }
+        }
+        return acceleration + triple(bodies.extAx[i], bodies.extAy[i], bodies.extAz[i]);
+    }
+
+    static double SubstepLimit(const BodyStore& bodies, const SourcePaths& paths, size_t anchor, double t, const triple& local)
+    {
+        const double d2 = local * local;
+        double shortest = bodies.mu[anchor] > 0 ? d2 * std::sqrt(d2) / bodies.mu[anchor] : HUGE_VAL;
+        const triple origin = paths.Position(bodies, anchor, t);
+        for (size_t j = 0; j < paths.MassiveCount(); j++)
+        {
+            if (j == anchor || bodies.mu[j] <= 0)
+                continue;
+            const triple toBody = paths.Position(bodies, j, t) - origin - local;
+            const double s2 = toBody * toBody;
+            shortest = std::min(shortest, s2 * std::sqrt(s2) / bodies.mu[j]);
+        }
+        return shortest == HUGE_VAL ? paths.StepLength() : StepFraction * std::sqrt(shortest);
+    }
+
+public:
+    /// <summary>
+    /// Moves massless body i across the step recorded in paths in the frame centred on massive body anchor, and
+    /// writes its absolute end state into the store over whatever the step integrator left there. start is the
+    /// body's absolute state at the start of the step; when it is not what the last step wrote (something moved
+    /// the body from outside) the local state is taken afresh from it.
+    /// </summary>
+    void Advance(BodyStore& bodies, const SourcePaths& paths, size_t i, size_t anchor, const triple& startPosition, const triple& startVelocity, FrameState& state)
+    {
+        if (!state.Current(startPosition, startVelocity)) {
+            state.position = startPosition - paths.StartPosition(anchor);
+            state.velocity = startVelocity - paths.StartVelocity(anchor);
+            state.valid = true;
+        }
+
+        const double stepLength = paths.StepLength();
+        double t = 0;
+        while (t < stepLength)
+        {
+            const double h = std::min(stepLength - t, SubstepLimit(bodies, paths, anchor, t, state.position));
+            const triple x1 = state.position, v1 = state.velocity;
+            const triple a1 = Acceleration(bodies, paths, i, anchor, t, x1);
+            const triple x2 = x1 + 0.5 * h * v1, v2 = v1 + 0.5 * h * a1;
+            const triple a2 = Acceleration(bodies, paths, i, anchor, t + 0.5 * h, x2);
+            const triple x3 = x1 + 0.5 * h * v2, v3 = v1 + 0.5 * h * a2;
+            const triple a3 = Acceleration(bodies, paths, i, anchor, t + 0.5 * h, x3);
+            const triple x4 = x1 + h * v3, v4 = v1 + h * a3;
+            const triple a4 = Acceleration(bodies, paths, i, anchor, t + h, x4);
+            state.position += (h / 6.0) * (v1 + 2.0 * v2 + 2.0 * v3 + v4);
+            state.velocity += (h / 6.0) * (a1 + 2.0 * a2 + 2.0 * a3 + a4);
+            t += h;
+        }
+
+        const triple position = triple(bodies.x[anchor], bodies.y[anchor], bodies.z[anchor]) + state.position;
+        const triple velocity = triple(bodies.vx[anchor], bodies.vy[anchor], bodies.vz[anchor]) + state.velocity;
+        bodies.x[i] = position.x; bodies.y[i] = position.y; bodies.z[i] = position.z;
+        bodies.vx[i] = velocity.x; bodies.vy[i] = velocity.y; bodies.vz[i] = velocity.z;
+        state.lastPosition = position;
+        state.lastVelocity = velocity;
+    }
+};
@@ -0,0 +1,216 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+#include "triple.h"
+#include "BodyStore.h"
+#include "SourcePaths.h"
+
+/// <summary>
+/// Kustaanheimo-Stiefel regularization of close encounters between a massless body and a massive one. The
+/// body's position relative to its neighbour, r, is written as r = L(u) u for a four-vector u with |u|^2 = |r|,
+/// and time is replaced by the fictitious time s with dt = |r| ds. The two-body problem becomes a harmonic
+/// oscillator in u, smooth straight through r = 0, so a particle grazing or diving through a planet's centre
+/// takes a handful of even steps in s where it would take thousands of shrinking steps in t. Everything else,
+/// the tidal pull of the other massive bodies and the body's external acceleration, enters as a perturbation,
+/// with the other bodies on the SourcePaths of the step as in Encke.h.
+/// </summary>
+class KSPropagator
+{
+private:
+    static constexpr double StepFraction = 0.02;     // Fictitious-time step as a fraction of the oscillator's period over 2 pi
+    static constexpr double MinSubsteps = 4.0;       // No single substep covers more than this fraction of the step in t
+    static constexpr double TimeTolerance = 1e-12;   // Relative miss of the end of the step at which the substeps stop
+    static constexpr int MaxSubsteps = 1 << 20;
+
+    // u, its derivative w = du/ds, the Kepler energy about the neighbour per unit mass and the time into the step
+    struct State {
+        double u[4], w[4], energy, t;
+    };
+
+    size_t encounters = 0, substeps = 0;
+
+    static triple Position(const double* u)
+    {
+        return triple(u[0] * u[0] - u[1] * u[1] - u[2] * u[2] + u[3] * u[3], 2 * (u[0] * u[1] - u[2] * u[3]), 2 * (u[0] * u[2] + u[1] * u[3]));
+    }
+
+    // L(u) w, which is r |dr/dt| / 2 when w = du/ds
+    static triple Apply(const double* u, const double* w)
+    {
+        return triple(u[0] * w[0] - u[1] * w[1] - u[2] * w[2] + u[3] * w[3], u[1] * w[0] + u[0] * w[1] - u[3] * w[2] - u[2] * w[3],
+            u[2] * w[0] + u[3] * w[1] + u[0] * w[2] + u[1] * w[3]);
+    }
+
+    // L(u)^T p
+    static void ApplyTransposed(const double* u, const triple& p, double* out)
+    {
+        out[0] = u[0] * p.x + u[1] * p.y + u[2] * p.z;
+        out[1] = -u[1] * p.x + u[0] * p.y + u[3] * p.z;
+        out[2] = -u[2] * p.x - u[3] * p.y + u[0] * p.z;
+        out[3] = u[3] * p.x - u[2] * p.y + u[1] * p.z;
+    }
+
+    static State ToRegularized(const triple& position, const triple& velocity, double mu)
+    {
+        State state = {};
+        const double r = position.magnitude();
+        if (position.x >= 0) {
+            state.u[0] = std::sqrt(0.5 * (r + position.x));
+            state.u[1] = state.u[0] > 0 ? 0.5 * position.y / state.u[0] : 0.0;
+            state.u[2] = state.u[0] > 0 ? 0.5 * position.z / state.u[0] : 0.0;
+        }
+        else {
+            state.u[1] = std::sqrt(0.5 * (r - position.x));
+            state.u[0] = 0.5 * position.y / state.u[1];
+            state.u[3] = 0.5 * position.z / state.u[1];
+        }
+        ApplyTransposed(state.u, 0.5 * velocity, state.w);
+        state.energy = 0.5 * (velocity * velocity) - (r > 0 ? mu / r : 0.0);
+        return state;
+    }
+
+    // Pull of every massive body except the neighbour, less its pull on the neighbour, plus the external accelerations
+    static triple Perturbation(const BodyStore& bodies, const SourcePaths& paths, size_t i, size_t neighbour, double t, const triple& local)
+    {
+        triple acceleration(bodies.extAx[i] - bodies.extAx[neighbour], bodies.extAy[i] - bodies.extAy[neighbour], bodies.extAz[i] - bodies.extAz[neighbour]);
+        const triple origin = paths.Position(bodies, neighbour, t);
+        for (size_t j = 0; j < paths.MassiveCount(); j++)
+        {
+            if (j == neighbour)
+                continue;
+            const triple toOrigin = paths.Position(bodies, j, t) - origin;
+            const triple toBody = toOrigin - local;
+            const double d2 = toBody * toBody, o2 = toOrigin * toOrigin;
+            if (d2 > 0) {
+                acceleration += (bodies.mu[j] / (d2 * std::sqrt(d2))) * toBody;
+            }
+            if (o2 > 0) {
+                acceleration -= (bodies.mu[j] / (o2 * std::sqrt(o2))) * toOrigin;
+            }
+        }
+        return acceleration;
+    }
+
+    // Derivatives with respect to s: u' = w, w' = (energy / 2) u + (r / 2) L^T P, energy' = 2 w . L^T P, t' = r
+    static State Derivative(const BodyStore& bodies, const SourcePaths& paths, size_t i, size_t neighbour, const State& state)
+    {
+        const double r = state.u[0] * state.u[0] + state.u[1] * state.u[1] + state.u[2] * state.u[2] + state.u[3] * state.u[3];
+        double pull[4];
+        ApplyTransposed(state.u, Perturbation(bodies, paths, i, neighbour, state.t, Position(state.u)), pull);
+        State derivative;
+        derivative.energy = 0;
+        for (int k = 0; k < 4; k++)
+        {
+            derivative.u[k] = state.w[k];
+            derivative.w[k] = 0.5 * state.energy * state.u[k] + 0.5 * r * pull[k];
+            derivative.energy += 2 * state.w[k] * pull[k];
+        }
+        derivative.t = r;
+        return derivative;
+    }
+
+    static State Offset(const State& state, const State& derivative, double ds)
+    {
+        State result;
+        for (int k = 0; k < 4; k++)
+        {
+            result.u[k] = state.u[k] + ds * derivative.u[k];
+            result.w[k] = state.w[k] + ds * derivative.w[k];
+        }
+        result.energy = state.energy + ds * derivative.energy;
+        result.t = state.t + ds * derivative.t;
+        return result;
+    }
+
+public:
+    // Encounters with a free-fall time sqrt(d^3 / mu) under this many steps are regularized. A fixed step has no way
+    // to shrink for an encounter and needs a wide margin; an adaptive one takes a fraction of the free-fall time per
+    // step, so an encounter only holds it below the frame once it is shorter than about one frame
+    static constexpr double FixedStepEncounter = 16.0;
+    static constexpr double AdaptiveStepEncounter = 1.0;
+
+    /// <summary>
+    /// Massive body that massless body i passes close enough to over a step of h to need regularizing, or -1:
+    /// the one with the shortest free-fall time, if that is under encounterTime. Each pair is judged at its closest
+    /// approach along the straight line through its relative state, so a fast particle that crosses a planet inside
+    /// the step is caught at its start.
+    /// </summary>
+    int Neighbour(const BodyStore& bodies, size_t i, double h, double encounterTime) const
+    {
+        int neighbour = -1;
+        double shortest = encounterTime;
+        for (size_t j = 0; j < bodies.massiveCount; j++)
+        {
+            if (bodies.mu[j] <= 0)
+                continue;
+            const triple d(bodies.x[i] - bodies.x[j], bodies.y[i] - bodies.y[j], bodies.z[i] - bodies.z[j]);
+            const triple w(bodies.vx[i] - bodies.vx[j], bodies.vy[i] - bodies.vy[j], bodies.vz[i] - bodies.vz[j]);
+            const double w2 = w * w;
+            const double tau = w2 > 0 ? std::clamp(-(d * w) / w2, std::min(h, 0.0), std::max(h, 0.0)) : 0.0;
+            const triple closest = d + tau * w;
+            const double d2 = closest * closest;
+            const double freeFall = std::sqrt(d2 * std::sqrt(d2) / bodies.mu[j]);
+            if (freeFall < shortest) {
+                shortest = freeFall;
+                neighbour = (int)j;
+            }
+        }
+        return neighbour;
+    }
+
+    /// <summary>
+    /// Moves massless body i across the step recorded in paths in regularized coordinates about massive body
+    /// neighbour, and writes its absolute end state into the store. start is the body's absolute state at the start
+    /// of the step. RK4 in s, with the last substeps sized to land on the end of the step in t.
+    /// </summary>
+    void Advance(BodyStore& bodies, const SourcePaths& paths, size_t i, size_t neighbour, const triple& startPosition, const triple& startVelocity)
+    {
+        const double mu = bodies.mu[neighbour];
+        const double stepLength = paths.StepLength();
+        State state = ToRegularized(startPosition - paths.StartPosition(neighbour), startVelocity - paths.StartVelocity(neighbour), mu);
+        encounters++;
+
+        for (int n = 0; n < MaxSubsteps && std::abs(stepLength - state.t) > TimeTolerance * std::abs(stepLength); n++)
+        {
+            const double r = state.u[0] * state.u[0] + state.u[1] * state.u[1] + state.u[2] * state.u[2] + state.u[3] * state.u[3];
+            if (r <= 0)
+                break;
+            const double w2 = state.w[0] * state.w[0] + state.w[1] * state.w[1] + state.w[2] * state.w[2] + state.w[3] * state.w[3];
+            // Oscillator frequency sqrt(-energy / 2) on a bound orbit, the rate u turns over at on any other
+            const double frequency = std::sqrt(0.5 * std::abs(state.energy) + w2 / r);
+            const double limit = std::min(frequency > 0 ? StepFraction / frequency : HUGE_VAL, std::abs(stepLength) / (MinSubsteps * r));
+            const double ds = std::clamp((stepLength - state.t) / r, -limit, limit);
+
+            const State k1 = Derivative(bodies, paths, i, neighbour, state);
+            const State k2 = Derivative(bodies, paths, i, neighbour, Offset(state, k1, 0.5 * ds));
+            const State k3 = Derivative(bodies, paths, i, neighbour, Offset(state, k2, 0.5 * ds));
+            const State k4 = Derivative(bodies, paths, i, neighbour, Offset(state, k3, ds));
+            for (int k = 0; k < 4; k++)
+            {
+                state.u[k] += ds / 6.0 * (k1.u[k] + 2 * k2.u[k] + 2 * k3.u[k] + k4.u[k]);
+                state.w[k] += ds / 6.0 * (k1.w[k] + 2 * k2.w[k] + 2 * k3.w[k] + k4.w[k]);
+            }
+            state.energy += ds / 6.0 * (k1.energy + 2 * k2.energy + 2 * k3.energy + k4.energy);
+            state.t += ds / 6.0 * (k1.t + 2 * k2.t + 2 * k3.t + k4.t);
+            substeps++;
+        }
+
+        const double r = state.u[0] * state.u[0] + state.u[1] * state.u[1] + state.u[2] * state.u[2] + state.u[3] * state.u[3];
+        const triple position = triple(bodies.x[neighbour], bodies.y[neighbour], bodies.z[neighbour]) + Position(state.u);
+        const triple velocity = triple(bodies.vx[neighbour], bodies.vy[neighbour], bodies.vz[neighbour])
+            + (r > 0 ? (2.0 / r) * Apply(state.u, state.w) : triple::zero());
+        bodies.x[i] = position.x; bodies.y[i] = position.y; bodies.z[i] = position.z;
+        bodies.vx[i] = velocity.x; bodies.vy[i] = velocity.y; bodies.vz[i] = velocity.z;
+    }
+
+    // Bodies regularized and RK4 substeps taken since the counters were last reset
+    size_t GetEncounters() const { return encounters; }
+    size_t GetSubsteps() const { return substeps; }
+
+    void ResetCounters()
+    {
+        encounters = 0;
+        substeps = 0;
+    }
+};
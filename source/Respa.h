@@ -0,0 +1,202 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include "BodyStore.h"
+#include "GravityKernels.h"
+#include "ThreadPool.h"
+
+/// <summary>
+/// Reversible multiple time stepping (r-RESPA, Tuckerman, Berne and Martyna 1992). Every body has a level,
+/// 0 the slowest, and the pull between two bodies belongs to the lower of their two levels, so each pair
+/// term sits in exactly one level and the splitting stays symplectic and conserves momentum. A step of h at
+/// level k kicks with the level's forces for h/2, takes substeps steps of h/substeps at level k + 1 (or
+/// drifts for h at the innermost level) and kicks for h/2 again. Levels nest like clusters: put a planet and
+/// the satellites in low orbit about it on level 1 and the Sun, the other planets and the Moon on level 0,
+/// and the planet's pull on its satellites is summed every inner step while everything else, including the
+/// Sun's pull on the planet and on the satellites alike, is summed once per outer step. Splitting the other
+/// way, with the Sun's pull on the planet fast and on its satellites slow, would kick them apart at every
+/// outer step. External forces such as thrust belong to the innermost level. Each level's forces are
+/// kept until the next drift, so the closing kick of one step and the opening kick of the next share one
+/// evaluation, and a plain leapfrog (every level 0) costs one evaluation per step.
+/// </summary>
+class RespaIntegrator
+{
+public:
+    static constexpr int MaxLevels = 4;
+
+private:
+    // Contiguous bodies on one level
+    struct Run {
+        size_t begin, end;
+        int level;
+    };
+
+    std::vector<Run> targetRuns, sourceRuns;
+    std::vector<int> levels;                    // Level of each body in the last step, clamped to [0, MaxLevels)
+    AccelerationBuffer accelerations[MaxLevels];
+    bool current[MaxLevels] = {};               // Whether a level's accelerations belong to the store's positions
+    AlignedDoubles lastX, lastY, lastZ, lastMu; // Store at the end of the last step, to spot changes from outside
+    size_t massiveCount = 0;
+    int depth = 1;                              // Levels in use
+    int substeps = 1;
+    size_t evaluations[MaxLevels] = {};
+    size_t interactions = 0;
+
+    static void AppendRuns(std::vector<Run>& runs, const int* level, size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            if (runs.empty() || runs.back().level != level[i] || runs.back().end != i) {
+                runs.push_back({ i, i + 1, level[i] });
+            }
+            else {
+                runs.back().end = i + 1;
+            }
+        }
+    }
+
+    // Rebuilds the runs when the levels or the body count changed, and drops cached forces the store no longer matches
+    void Prepare(const BodyStore& bodies, const int* level)
+    {
+        bool changed = levels.size() != bodies.count || massiveCount != bodies.massiveCount;
+        massiveCount = bodies.massiveCount;
+        levels.resize(bodies.count);
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            const int clamped = std::clamp(level[i], 0, MaxLevels - 1);
+            changed |= levels[i] != clamped;
+            levels[i] = clamped;
+        }
+        if (changed) {
+            targetRuns.clear();
+            sourceRuns.clear();
+            AppendRuns(targetRuns, levels.data(), 0, bodies.count);
+            AppendRuns(sourceRuns, levels.data(), 0, bodies.massiveCount);
+            depth = 1 + *std::max_element(levels.begin(), levels.end());
+            for (AccelerationBuffer& buffer : accelerations)
+            {
+                buffer.Resize(bodies.count);
+            }
+            lastX.resize(bodies.count); lastY.resize(bodies.count); lastZ.resize(bodies.count); lastMu.resize(bodies.count);
+        }
+        const bool moved = changed || !std::equal(bodies.x.begin(), bodies.x.begin() + bodies.count, lastX.begin())
+            || !std::equal(bodies.y.begin(), bodies.y.begin() + bodies.count, lastY.begin())
+            || !std::equal(bodies.z.begin(), bodies.z.begin() + bodies.count, lastZ.begin())
+            || !std::equal(bodies.mu.begin(), bodies.mu.begin() + bodies.count, lastMu.begin());
+        if (moved) {
+            std::fill(current, current + MaxLevels, false);
+        }
+    }
+
+    // Whether the pull between a target on level `target` and a source on level `source` belongs to level k
+    static bool OnLevel(int target, int source, int k)
+    {
+        return std::min(target, source) == k;
+    }
+
+    // Level k's share of the pull on every body, with the direct kernel over each run of its sources
+    void Evaluate(BodyStore& bodies, int k, ThreadPool& pool)
+    {
+        AccelerationBuffer& buffer = accelerations[k];
+        std::fill(buffer.ax.begin(), buffer.ax.end(), 0.0);
+        std::fill(buffer.ay.begin(), buffer.ay.end(), 0.0);
+        std::fill(buffer.az.begin(), buffer.az.end(), 0.0);
+        const StageView s = { bodies.x.data(), bodies.y.data(), bodies.z.data(), buffer.ax.data(), buffer.ay.data(), buffer.az.data() };
+        const double* mu = bodies.mu.data();
+        pool.ParallelFor(bodies.count, [this, &s, mu, k](size_t begin, size_t end, int) {
+            for (const Run& target : targetRuns)
+            {
+                const size_t targetBegin = std::max(target.begin, begin), targetEnd = std::min(target.end, end);
+                if (targetBegin >= targetEnd || target.level < k)
+                    continue;
+                for (const Run& source : sourceRuns)
+                {
+                    if (OnLevel(target.level, source.level, k)) {
+                        AccumulateGravityBlock(s, mu, targetBegin, targetEnd, source.begin, source.end);
+                    }
+                }
+            }
+            });
+        for (const Run& target : targetRuns)
+        {
+            for (const Run& source : sourceRuns)
+            {
+                if (OnLevel(target.level, source.level, k)) {
+                    interactions += (target.end - target.begin) * (source.end - source.begin);
+                }
+            }
+        }
+        evaluations[k]++;
+        current[k] = true;
+    }
+
+    void Kick(BodyStore& bodies, int k, double h, ThreadPool& pool)
+    {
+        if (!current[k]) {
+            Evaluate(bodies, k, pool);
+        }
+        const AccelerationBuffer& a = accelerations[k];
+        const bool innermost = k == depth - 1;
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            bodies.vx[i] += (a.ax[i] + (innermost ? bodies.extAx[i] : 0.0)) * h;
+            bodies.vy[i] += (a.ay[i] + (innermost ? bodies.extAy[i] : 0.0)) * h;
+            bodies.vz[i] += (a.az[i] + (innermost ? bodies.extAz[i] : 0.0)) * h;
+        }
+    }
+
+    void Drift(BodyStore& bodies, double h)
+    {
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            bodies.x[i] += bodies.vx[i] * h;
+            bodies.y[i] += bodies.vy[i] * h;
+            bodies.z[i] += bodies.vz[i] * h;
+        }
+        std::fill(current, current + MaxLevels, false);
+    }
+
+    void Advance(BodyStore& bodies, int k, double h, ThreadPool& pool)
+    {
+        Kick(bodies, k, 0.5 * h, pool);
+        if (k == depth - 1) {
+            Drift(bodies, h);
+        }
+        else {
+            for (int n = 0; n < substeps; n++)
+            {
+                Advance(bodies, k + 1, h / substeps, pool);
+            }
+        }
+        Kick(bodies, k, 0.5 * h, pool);
+    }
+
+public:
+    /// <summary>
+    /// One outer step of h. level[i] is body i's level, innerSteps the number of steps each level takes
+    /// inside one step of the level below it, so the innermost level steps h / innerSteps^(levels - 1).
+    /// </summary>
+    void Step(BodyStore& bodies, double h, const int* level, int innerSteps, ThreadPool& pool)
+    {
+        if (bodies.count == 0)
+            return;
+        substeps = std::max(innerSteps, 1);
+        Prepare(bodies, level);
+        Advance(bodies, 0, h, pool);
+        std::copy(bodies.x.begin(), bodies.x.begin() + bodies.count, lastX.begin());
+        std::copy(bodies.y.begin(), bodies.y.begin() + bodies.count, lastY.begin());
+        std::copy(bodies.z.begin(), bodies.z.begin() + bodies.count, lastZ.begin());
+        std::copy(bodies.mu.begin(), bodies.mu.begin() + bodies.count, lastMu.begin());
+    }
+
+    size_t GetEvaluations(int level) const { return evaluations[level]; }
+    size_t GetInteractions() const { return interactions; }     // Target-source pairs summed over every evaluation
+    int GetDepth() const { return depth; }
+
+    void ResetCounters()
+    {
+        std::fill(evaluations, evaluations + MaxLevels, 0);
+        interactions = 0;
+    }
+};
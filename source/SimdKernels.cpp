@@ -0,0 +1,73 @@
+#include "SimdKernels.h"
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define SIMD_KERNELS_X86
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define SIMD_KERNELS_X86
+#endif
+
+#if defined(SIMD_KERNELS_X86)
+static void Cpuid(int leaf, int subleaf, unsigned registers[4])
+{
+#if defined(_MSC_VER)
+    int values[4];
+    __cpuidex(values, leaf, subleaf);
+    for (int k = 0; k < 4; k++) registers[k] = (unsigned)values[k];
+#else
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+// Register state the operating system saves on a context switch (XCR0)
+static unsigned long long EnabledState()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned eax, edx;
+    __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+
+static SimdLevel DetectSimdLevel()
+{
+    unsigned leaf0[4], leaf1[4], leaf7[4];
+    Cpuid(0, 0, leaf0);
+    Cpuid(1, 0, leaf1);
+    const bool fma = (leaf1[2] >> 12) & 1, osxsave = (leaf1[2] >> 27) & 1, avx = (leaf1[2] >> 28) & 1;
+    if (leaf0[0] < 7 || !osxsave || !avx || !fma)
+        return SimdLevel::Scalar;
+    Cpuid(7, 0, leaf7);
+    const unsigned long long state = EnabledState();
+    const bool ymm = (state & 0x6) == 0x6, zmm = (state & 0xE6) == 0xE6;
+    const bool avx2 = (leaf7[1] >> 5) & 1, avx512f = (leaf7[1] >> 16) & 1;
+    if (avx2 && avx512f && zmm)
+        return SimdLevel::AVX512;
+    if (avx2 && ymm)
+        return SimdLevel::AVX2;
+    return SimdLevel::Scalar;
+}
+#else
+static SimdLevel DetectSimdLevel()
+{
+    return SimdLevel::Scalar;
+}
+#endif
+
+SimdLevel GetSimdLevel()
+{
+    static const SimdLevel level = DetectSimdLevel();
+    return level;
+}
+
+const char* GetSimdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::AVX512: return "AVX-512";
+    case SimdLevel::AVX2:   return "AVX2";
+    default:                return "scalar";
+    }
+}
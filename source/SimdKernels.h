@@ -0,0 +1,26 @@
+#pragma once
+#include <cstddef>
+
+struct StageView;
+
+// Instruction sets the vector kernels are built for, in order of preference
+enum class SimdLevel { Scalar, AVX2, AVX512 };
+
+// Best level this CPU and operating system support, detected on the first call (SimdKernels.cpp)
+SimdLevel GetSimdLevel();
+const char* GetSimdLevelName(SimdLevel level);
+
+/// <summary>
+/// Vector kernels, each compiled in a translation unit of its own with its instruction set enabled
+/// (GravityKernelsAVX2.cpp, GravityKernelsAVX512.cpp), so the rest of the program runs on any x86-64 CPU and
+/// only calls them once GetSimdLevel() says the CPU has them. The gravity kernels handle whole registers of
+/// targets from targetBegin and return the first target they left to the scalar code.
+/// </summary>
+size_t AccumulateGravityBlockAVX2(const StageView& s, const double* mu, size_t targetBegin, size_t targetEnd, size_t sourceBegin, size_t sourceEnd);
+size_t AccumulateGravityBlockAVX512(const StageView& s, const double* mu, size_t targetBegin, size_t targetEnd, size_t sourceBegin, size_t sourceEnd);
+size_t AccumulateTestParticlesAVX2(const StageView& s, const double* packed, size_t targetBegin, size_t targetEnd, size_t first, size_t last);
+size_t AccumulateTestParticlesAVX512(const StageView& s, const double* packed, size_t targetBegin, size_t targetEnd, size_t first, size_t last);
+
+// KeplerDrift of the four bodies at the given pointers. Returns a bit per body it moved, the others are left for
+// KeplerDrift, or -1 without touching any when one of them needs KeplerDrift's special cases
+int KeplerDriftAVX2x4(const double* mu, double dt, double* x, double* y, double* z, double* vx, double* vy, double* vz);
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <algorithm>
+#include "triple.h"
+#include "BodyStore.h"
+
+/// <summary>
+/// Paths of the massive bodies across one step, for propagators that move massless bodies after the step
+/// integrator has moved the massive ones. Begin records the start states; once the store holds the end states,
+/// Position is the Hermite cubic through both at any time inside the step.
+/// </summary>
+class SourcePaths
+{
+private:
+    AlignedDoubles x0, y0, z0, vx0, vy0, vz0;
+    size_t massiveCount = 0;
+    double stepLength = 0;
+
+public:
+    // Records the massive bodies at the start of a step of h, before the step integrator moves them
+    void Begin(const BodyStore& bodies, double h)
+    {
+        massiveCount = bodies.massiveCount;
+        stepLength = h;
+        for (AlignedDoubles* array : { &x0, &y0, &z0, &vx0, &vy0, &vz0 })
+        {
+            array->resize(massiveCount);
+        }
+        std::copy(bodies.x.begin(), bodies.x.begin() + massiveCount, x0.begin());
+        std::copy(bodies.y.begin(), bodies.y.begin() + massiveCount, y0.begin());
+        std::copy(bodies.z.begin(), bodies.z.begin() + massiveCount, z0.begin());
+        std::copy(bodies.vx.begin(), bodies.vx.begin() + massiveCount, vx0.begin());
+        std::copy(bodies.vy.begin(), bodies.vy.begin() + massiveCount, vy0.begin());
+        std::copy(bodies.vz.begin(), bodies.vz.begin() + massiveCount, vz0.begin());
+    }
+
+    // Hermite interpolant of massive body j at time t into the step, from its start state and the store's end state
+    triple Position(const BodyStore& bodies, size_t j, double t) const
+    {
+        const double s = stepLength > 0 ? t / stepLength : 1.0;
+        const double s2 = s * s, s3 = s2 * s;
+        const double h00 = 2 * s3 - 3 * s2 + 1, h10 = (s3 - 2 * s2 + s) * stepLength;
+        const double h01 = -2 * s3 + 3 * s2, h11 = (s3 - s2) * stepLength;
+        return triple(h00 * x0[j] + h10 * vx0[j] + h01 * bodies.x[j] + h11 * bodies.vx[j],
+            h00 * y0[j] + h10 * vy0[j] + h01 * bodies.y[j] + h11 * bodies.vy[j],
+            h00 * z0[j] + h10 * vz0[j] + h01 * bodies.z[j] + h11 * bodies.vz[j]);
+    }
+
+    triple StartPosition(size_t j) const { return triple(x0[j], y0[j], z0[j]); }
+    triple StartVelocity(size_t j) const { return triple(vx0[j], vy0[j], vz0[j]); }
+    size_t MassiveCount() const { return massiveCount; }
+    double StepLength() const { return stepLength; }
+};
@@ -0,0 +1,165 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include "BodyStore.h"
+#include "ThreadPool.h"
+#include "Kepler.h"
+
+// Weights of the leapfrogs that Yoshida's symmetric compositions chain together: x1, x0, x1 for fourth order and
+// Yoshida's solution A for sixth order. Each weight costs one force evaluation
+struct YoshidaWeights {
+    static constexpr double CubeRootOfTwo = 1.25992104989487316477;
+    static constexpr double Fourth[3] = {
+        1.0 / (2.0 - CubeRootOfTwo), -CubeRootOfTwo / (2.0 - CubeRootOfTwo), 1.0 / (2.0 - CubeRootOfTwo)
+    };
+    static constexpr double W1 = -1.17767998417887, W2 = 0.235573213359357, W3 = 0.784513610477560;
+    static constexpr double Sixth[7] = { W3, W2, W1, 1.0 - 2.0 * (W1 + W2 + W3), W1, W2, W3 };
+};
+
+/// <summary>
+/// Wisdom-Holman map in democratic heliocentric coordinates: positions relative to the central body,
+/// velocities relative to the barycentre. A step is the symmetric splitting
+/// Kepler(h/2) Jump(h/2) Kick(h) Jump(h/2) Kepler(h/2), where Kepler moves every body along its
+/// two-body orbit about the central body, Jump shifts positions by the momentum of the other massive
+/// bodies over the central mass, and Kick applies everything except the central body's pull. The kick
+/// reuses whichever force kernel the simulator runs and subtracts the central term, so it costs one
+/// evaluation per step. Orbits dominated by the central body are integrated exactly, which is what
+/// allows much longer steps than a non-symplectic method; bodies bound to something else (a moon, a
+/// satellite in low orbit around a planet) see their primary as a perturbation and need short steps.
+/// </summary>
+class WisdomHolmanMapping
+{
+private:
+    size_t central = 0;
+    double centralMu = 0;
+    double totalMu = 0;
+    double cmx = 0, cmy = 0, cmz = 0;       // Barycentre of the massive bodies
+    double cmvx = 0, cmvy = 0, cmvz = 0;    // and its velocity
+
+    // Positions relative to the central body, velocities relative to the barycentre, central body at the origin
+    void ToDemocraticHeliocentric(BodyStore& bodies)
+    {
+        central = 0;
+        for (size_t i = 1; i < bodies.massiveCount; i++)
+        {
+            if (bodies.mu[i] > bodies.mu[central]) {
+                central = i;
+            }
+        }
+        centralMu = bodies.mu[central];
+        totalMu = 0;
+        cmx = cmy = cmz = cmvx = cmvy = cmvz = 0;
+        for (size_t i = 0; i < bodies.massiveCount; i++)
+        {
+            totalMu += bodies.mu[i];
+            cmx += bodies.mu[i] * bodies.x[i]; cmy += bodies.mu[i] * bodies.y[i]; cmz += bodies.mu[i] * bodies.z[i];
+            cmvx += bodies.mu[i] * bodies.vx[i]; cmvy += bodies.mu[i] * bodies.vy[i]; cmvz += bodies.mu[i] * bodies.vz[i];
+        }
+        cmx /= totalMu; cmy /= totalMu; cmz /= totalMu;
+        cmvx /= totalMu; cmvy /= totalMu; cmvz /= totalMu;
+
+        const double x0 = bodies.x[central], y0 = bodies.y[central], z0 = bodies.z[central];
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            bodies.x[i] -= x0; bodies.y[i] -= y0; bodies.z[i] -= z0;
+            bodies.vx[i] -= cmvx; bodies.vy[i] -= cmvy; bodies.vz[i] -= cmvz;
+        }
+    }
+
+    // Back to the inertial frame after the barycentre has moved on by h
+    void FromDemocraticHeliocentric(BodyStore& bodies, double h)
+    {
+        cmx += cmvx * h; cmy += cmvy * h; cmz += cmvz * h;
+        double qx = 0, qy = 0, qz = 0, px = 0, py = 0, pz = 0;
+        for (size_t i = 0; i < bodies.massiveCount; i++)
+        {
+            if (i == central)
+                continue;
+            qx += bodies.mu[i] * bodies.x[i]; qy += bodies.mu[i] * bodies.y[i]; qz += bodies.mu[i] * bodies.z[i];
+            px += bodies.mu[i] * bodies.vx[i]; py += bodies.mu[i] * bodies.vy[i]; pz += bodies.mu[i] * bodies.vz[i];
+        }
+        const double x0 = cmx - qx / totalMu, y0 = cmy - qy / totalMu, z0 = cmz - qz / totalMu;
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            if (i == central)
+                continue;
+            bodies.x[i] += x0; bodies.y[i] += y0; bodies.z[i] += z0;
+            bodies.vx[i] += cmvx; bodies.vy[i] += cmvy; bodies.vz[i] += cmvz;
+        }
+        bodies.x[central] = x0; bodies.y[central] = y0; bodies.z[central] = z0;
+        bodies.vx[central] = cmvx - px / centralMu;
+        bodies.vy[central] = cmvy - py / centralMu;
+        bodies.vz[central] = cmvz - pz / centralMu;
+    }
+
+    void Kepler(BodyStore& bodies, double h, ThreadPool& pool)
+    {
+        pool.ParallelFor(bodies.count, [this, &bodies, h](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; i++)
+            {
+                if (i == central)
+                    continue;
+                if (!KeplerDrift(centralMu, h, bodies.x[i], bodies.y[i], bodies.z[i], bodies.vx[i], bodies.vy[i], bodies.vz[i])) {
+                    // Only reachable for a body sitting on the central one; let it coast rather than stop the step
+                    bodies.x[i] += bodies.vx[i] * h;
+                    bodies.y[i] += bodies.vy[i] * h;
+                    bodies.z[i] += bodies.vz[i] * h;
+                }
+            }
+            });
+    }
+
+    void Jump(BodyStore& bodies, double h)
+    {
+        double px = 0, py = 0, pz = 0;
+        for (size_t i = 0; i < bodies.massiveCount; i++)
+        {
+            if (i == central)
+                continue;
+            px += bodies.mu[i] * bodies.vx[i]; py += bodies.mu[i] * bodies.vy[i]; pz += bodies.mu[i] * bodies.vz[i];
+        }
+        const double dx = h * px / centralMu, dy = h * py / centralMu, dz = h * pz / centralMu;
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            if (i == central)
+                continue;
+            bodies.x[i] += dx; bodies.y[i] += dy; bodies.z[i] += dz;
+        }
+    }
+
+    // The stage holds the full acceleration at the current positions; the central body's share is taken back out
+    void Kick(BodyStore& bodies, const BodyStage& stage, double h)
+    {
+        for (size_t i = 0; i < bodies.count; i++)
+        {
+            if (i == central)
+                continue;
+            double r2 = bodies.x[i] * bodies.x[i] + bodies.y[i] * bodies.y[i] + bodies.z[i] * bodies.z[i];
+            double f = r2 > 0 ? centralMu / (r2 * std::sqrt(r2)) : 0.0;
+            bodies.vx[i] += (stage.ax[i] + f * bodies.x[i]) * h;
+            bodies.vy[i] += (stage.ay[i] + f * bodies.y[i]) * h;
+            bodies.vz[i] += (stage.az[i] + f * bodies.z[i]) * h;
+        }
+    }
+
+public:
+    /// <summary>
+    /// One step of h. evaluate() must fill stage 0 of the store with the accelerations at the store's
+    /// current positions, which during the step are relative to the central body.
+    /// </summary>
+    template <typename Evaluate>
+    void Step(BodyStore& bodies, double h, ThreadPool& pool, Evaluate&& evaluate)
+    {
+        if (bodies.massiveCount == 0)
+            return;
+        ToDemocraticHeliocentric(bodies);
+        Kepler(bodies, 0.5 * h, pool);
+        Jump(bodies, 0.5 * h);
+        bodies.stages[0].ClearAcceleration();
+        evaluate();
+        Kick(bodies, bodies.stages[0], h);
+        Jump(bodies, 0.5 * h);
+        Kepler(bodies, 0.5 * h, pool);
+        FromDemocraticHeliocentric(bodies, h);
+    }
+};
@@ -0,0 +1,275 @@
+#pragma once
+#include <thread>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include "ThreadPool.h"
+
+// Completion counter for a batch of tasks handed to a TaskScheduler. It has to outlive the Wait() on it
+class TaskGroup
+{
+    friend class TaskScheduler;
+    std::atomic<size_t> pending{ 0 };
+
+public:
+    bool IsDone() const
+    {
+        return pending.load(std::memory_order_acquire) == 0;
+    }
+};
+
+/// <summary>
+/// Work-stealing task scheduler. Every participant owns a deque: it pushes and pops its own work at
+/// the bottom, and idle participants steal from the top of the others, which is where the largest
+/// pieces of a split range sit. Ranges are split lazily, halving until they are no larger than
+/// their grain and leaving the other halves to thieves, so a parallel-for costs one push per split
+/// rather than one allocation per task. The calling thread is participant 0 and helps run tasks
+/// while it waits; like ThreadPool, only one outside thread may drive the scheduler at a time.
+/// </summary>
+class TaskScheduler
+{
+private:
+    static constexpr int SpinIterations = 4000;
+    static constexpr int YieldInterval = 64;
+
+    struct Task {
+        void (*invoke)(void*, size_t, size_t);
+        void* context;
+        size_t begin, end;
+        size_t grain;
+        TaskGroup* group;
+    };
+
+    // Bounded ring of tasks. The short lock is only ever contended when a thief and the owner meet on
+    // the same deque, and size lets thieves skip empty deques without touching the lock at all
+    struct alignas(64) TaskDeque {
+        static constexpr size_t Capacity = 256;
+        std::atomic_flag lock;
+        std::atomic<size_t> size{ 0 };
+        size_t top = 0, bottom = 0;
+        Task tasks[Capacity];
+
+        void Lock()
+        {
+            while (lock.test_and_set(std::memory_order_acquire))
+            {
+                CpuRelax();
+            }
+        }
+
+        void Unlock()
+        {
+            lock.clear(std::memory_order_release);
+        }
+
+        bool Push(const Task& task)
+        {
+            Lock();
+            bool pushed = bottom - top < Capacity;
+            if (pushed) {
+                tasks[bottom++ % Capacity] = task;
+                size.store(bottom - top, std::memory_order_seq_cst);
+            }
+            Unlock();
+            return pushed;
+        }
+
+        bool Pop(Task& task)
+        {
+            if (size.load(std::memory_order_seq_cst) == 0)
+                return false;
+            Lock();
+            bool popped = bottom != top;
+            if (popped) {
+                task = tasks[--bottom % Capacity];
+                size.store(bottom - top, std::memory_order_relaxed);
+            }
+            Unlock();
+            return popped;
+        }
+
+        bool Steal(Task& task)
+        {
+            if (size.load(std::memory_order_seq_cst) == 0)
+                return false;
+            Lock();
+            bool stolen = bottom != top;
+            if (stolen) {
+                task = tasks[top++ % Capacity];
+                size.store(bottom - top, std::memory_order_relaxed);
+            }
+            Unlock();
+            return stolen;
+        }
+    };
+
+    std::unique_ptr<TaskDeque[]> deques;
+    int numberOfParticipants;
+    std::vector<std::thread> workers;
+    std::atomic<bool> stopping{ false };
+    std::atomic<int> sleepers{ 0 };
+    std::atomic<uint32_t> wakeEpoch{ 0 };
+    std::atomic<uint32_t> completionEpoch{ 0 };
+
+    void Push(int participant, const Task& task)
+    {
+        task.group->pending.fetch_add(1, std::memory_order_relaxed);
+        if (!deques[participant].Push(task)) {
+            // Deque full: run it here instead
+            Execute(participant, task);
+            return;
+        }
+        if (sleepers.load(std::memory_order_seq_cst) > 0) {
+            wakeEpoch.fetch_add(1, std::memory_order_release);
+            wakeEpoch.notify_one();
+        }
+    }
+
+    // Own work first, newest first; otherwise the oldest task of the next non-empty deque
+    bool FindTask(int participant, Task& task)
+    {
+        if (deques[participant].Pop(task))
+            return true;
+        for (int offset = 1; offset < numberOfParticipants; offset++)
+        {
+            if (deques[(participant + offset) % numberOfParticipants].Steal(task))
+                return true;
+        }
+        return false;
+    }
+
+    void Execute(int participant, Task task)
+    {
+        while (task.end - task.begin > task.grain)
+        {
+            Task upper = task;
+            upper.begin = task.begin + (task.end - task.begin) / 2;
+            task.end = upper.begin;
+            Push(participant, upper);
+        }
+        task.invoke(task.context, task.begin, task.end);
+        if (task.group->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            // The group may be gone as soon as pending reads zero, so waiters are woken through the scheduler
+            completionEpoch.fetch_add(1, std::memory_order_release);
+            completionEpoch.notify_all();
+        }
+    }
+
+    void WorkerLoop(int participant)
+    {
+        Task task;
+        while (!stopping.load(std::memory_order_acquire))
+        {
+            bool found = FindTask(participant, task);
+            for (int spin = 0; !found && spin < SpinIterations; spin++)
+            {
+                // Hand the core back now and then, so oversubscribed workers don't spin on the thread they wait for
+                if (spin % YieldInterval == YieldInterval - 1) {
+                    std::this_thread::yield();
+                }
+                else {
+                    CpuRelax();
+                }
+                found = FindTask(participant, task);
+            }
+            if (!found) {
+                uint32_t epoch = wakeEpoch.load(std::memory_order_acquire);
+                sleepers.fetch_add(1, std::memory_order_seq_cst);
+                found = FindTask(participant, task);
+                if (!found && !stopping.load(std::memory_order_acquire)) {
+                    wakeEpoch.wait(epoch, std::memory_order_acquire);
+                }
+                sleepers.fetch_sub(1, std::memory_order_relaxed);
+            }
+            if (found) {
+                Execute(participant, task);
+            }
+        }
+    }
+
+public:
+    // numberOfParticipants includes the calling thread
+    explicit TaskScheduler(int participants)
+        : deques(new TaskDeque[participants > 1 ? participants : 1]), numberOfParticipants(participants > 1 ? participants : 1)
+    {
+        for (int i = 1; i < numberOfParticipants; i++)
+        {
+            workers.emplace_back(&TaskScheduler::WorkerLoop, this, i);
+        }
+    }
+
+    ~TaskScheduler()
+    {
+        stopping.store(true, std::memory_order_release);
+        wakeEpoch.fetch_add(1, std::memory_order_release);
+        wakeEpoch.notify_all();
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    int GetNumberOfParticipants() const
+    {
+        return numberOfParticipants;
+    }
+
+    // Queues fn() as one task of the group. fn is called through a pointer, so it has to live until Wait(group) returns
+    template <typename Fn>
+    void Spawn(TaskGroup& group, Fn& fn)
+    {
+        Push(0, { [](void* context, size_t, size_t) { (*static_cast<Fn*>(context))(); }, &fn, 0, 1, 1, &group });
+    }
+
+    // Queues body(begin, end) over [0, count) in pieces of at most grain items. body has to live until Wait(group) returns
+    template <typename Body>
+    void ParallelFor(TaskGroup& group, size_t count, size_t grain, Body& body)
+    {
+        if (count == 0)
+            return;
+        Push(0, { [](void* context, size_t begin, size_t end) { (*static_cast<Body*>(context))(begin, end); }, &body, 0, count, grain > 0 ? grain : 1, &group });
+    }
+
+    // Runs queued tasks on the calling thread until every task of the group has finished
+    void Wait(TaskGroup& group)
+    {
+        Task task;
+        while (!group.IsDone())
+        {
+            uint32_t epoch = completionEpoch.load(std::memory_order_acquire);
+            if (FindTask(0, task)) {
+                Execute(0, task);
+                continue;
+            }
+            for (int spin = 0; spin < SpinIterations && !group.IsDone(); spin++)
+            {
+                if (spin % YieldInterval == YieldInterval - 1) {
+                    std::this_thread::yield();
+                }
+                else {
+                    CpuRelax();
+                }
+            }
+            if (!group.IsDone() && !FindTask(0, task)) {
+                completionEpoch.wait(epoch, std::memory_order_acquire);
+            }
+            else if (!group.IsDone()) {
+                Execute(0, task);
+            }
+        }
+    }
+
+    // Blocking parallel-for: body(begin, end) over [0, count) in pieces of at most grain items
+    template <typename Body>
+    void ParallelFor(size_t count, size_t grain, Body&& body)
+    {
+        TaskGroup group;
+        ParallelFor(group, count, grain, body);
+        Wait(group);
+    }
+};
@@ -0,0 +1,92 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include "BodyStore.h"
+#include "GravityKernels.h"
+#include "SimdKernels.h"
+
+/// <summary>
+/// Gravity sources packed for the massless test-particle sweep. Load() copies x, y, z and mu of every
+/// source side by side into one aligned block, so a handful of planets and moons occupy a few cache
+/// lines that stay in L1 while millions of particles stream past them. Accumulate() only writes the
+/// accelerations of the particles it is given, so disjoint particle ranges can run on separate
+/// threads with no synchronisation.
+/// </summary>
+class TestParticleSources
+{
+private:
+    AlignedDoubles packed;
+    size_t count = 0;
+
+    // Pull of loaded sources [first, last) on the single particle t
+    void AccumulateScalar(const StageView& s, size_t t, size_t first, size_t last) const
+    {
+        const double xt = s.x[t], yt = s.y[t], zt = s.z[t];
+        double ax = 0, ay = 0, az = 0;
+        for (size_t j = first; j < last; j++)
+        {
+            const double* source = &packed[4 * j];
+            double dx = source[0] - xt;
+            double dy = source[1] - yt;
+            double dz = source[2] - zt;
+            double r2 = dx * dx + dy * dy + dz * dz;
+            if (r2 <= 0.0)
+                continue;
+            double f = source[3] / (r2 * std::sqrt(r2));
+            ax += dx * f;
+            ay += dy * f;
+            az += dz * f;
+        }
+        s.ax[t] += ax;
+        s.ay[t] += ay;
+        s.az[t] += az;
+    }
+
+public:
+    size_t GetCount() const
+    {
+        return count;
+    }
+
+    // Snapshots sources [sourceBegin, sourceEnd) at the stage positions
+    void Load(const StageView& s, const double* mu, size_t sourceBegin, size_t sourceEnd)
+    {
+        count = sourceEnd - sourceBegin;
+        packed.resize(4 * count);
+        for (size_t j = 0; j < count; j++)
+        {
+            packed[4 * j] = s.x[sourceBegin + j];
+            packed[4 * j + 1] = s.y[sourceBegin + j];
+            packed[4 * j + 2] = s.z[sourceBegin + j];
+            packed[4 * j + 3] = mu[sourceBegin + j];
+        }
+    }
+
+    // Adds the pull of the loaded sources to particles [targetBegin, targetEnd)
+    void Accumulate(const StageView& s, size_t targetBegin, size_t targetEnd) const
+    {
+        Accumulate(s, targetBegin, targetEnd, 0, count);
+    }
+
+    // Same, restricted to loaded sources [first, last) (counted from the first loaded source)
+    void Accumulate(const StageView& s, size_t targetBegin, size_t targetEnd, size_t first, size_t last) const
+    {
+        size_t t = targetBegin;
+        switch (GetSimdLevel())
+        {
+        case SimdLevel::AVX512:
+            t = AccumulateTestParticlesAVX512(s, packed.data(), targetBegin, targetEnd, first, last);
+            break;
+        case SimdLevel::AVX2:
+            t = AccumulateTestParticlesAVX2(s, packed.data(), targetBegin, targetEnd, first, last);
+            break;
+        default:
+            break;
+        }
+        // Particles left over after the last full pair of registers, or all of them on processors without AVX2
+        for (; t < targetEnd; t++)
+        {
+            AccumulateScalar(s, t, first, last);
+        }
+    }
+};
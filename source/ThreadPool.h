@@ -0,0 +1,140 @@
+#pragma once
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Polite busy-wait hint for the spin phases below
+inline void CpuRelax()
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+/// <summary>
+/// Persistent fork/join pool. Workers are started once and park between jobs; Run() releases them by
+/// bumping a generation counter and the calling thread takes part as participant 0, so a job with N
+/// participants only needs N - 1 worker threads. Both the release and the join spin for a short while
+/// before falling back to a blocking wait, which keeps the per-job cost in the microsecond range when
+/// jobs arrive back to back (every RK stage of every step).
+/// </summary>
+class ThreadPool
+{
+private:
+    static constexpr int SpinIterations = 4000;
+
+    std::vector<std::thread> workers;
+    std::atomic<uint64_t> generation{ 0 };
+    std::atomic<int> pending{ 0 };
+    std::atomic<bool> stopping{ false };
+    void* jobContext = nullptr;
+    void (*jobInvoke)(void*, int) = nullptr;
+
+    void WorkerLoop(int participant)
+    {
+        uint64_t seen = 0;
+        while (true)
+        {
+            uint64_t current = generation.load(std::memory_order_acquire);
+            for (int spin = 0; current == seen && spin < SpinIterations; spin++)
+            {
+                CpuRelax();
+                current = generation.load(std::memory_order_acquire);
+            }
+            while (current == seen)
+            {
+                generation.wait(seen, std::memory_order_acquire);
+                current = generation.load(std::memory_order_acquire);
+            }
+            seen = current;
+            if (stopping.load(std::memory_order_acquire))
+                return;
+
+            jobInvoke(jobContext, participant);
+            if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                pending.notify_one();
+            }
+        }
+    }
+
+public:
+    // numberOfParticipants includes the calling thread
+    explicit ThreadPool(int numberOfParticipants)
+    {
+        int numberOfWorkers = numberOfParticipants > 1 ? numberOfParticipants - 1 : 0;
+        for (int i = 0; i < numberOfWorkers; i++)
+        {
+            workers.emplace_back(&ThreadPool::WorkerLoop, this, i + 1);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        stopping.store(true, std::memory_order_release);
+        generation.fetch_add(1, std::memory_order_release);
+        generation.notify_all();
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int GetNumberOfParticipants() const
+    {
+        return (int)workers.size() + 1;
+    }
+
+    // Runs job(participant) once on every participant and returns when all of them have finished
+    template <typename Job>
+    void Run(Job& job)
+    {
+        if (workers.empty()) {
+            job(0);
+            return;
+        }
+        jobContext = &job;
+        jobInvoke = [](void* context, int participant) { (*static_cast<Job*>(context))(participant); };
+        pending.store((int)workers.size(), std::memory_order_relaxed);
+        generation.fetch_add(1, std::memory_order_release);
+        generation.notify_all();
+
+        job(0);
+
+        int remaining = pending.load(std::memory_order_acquire);
+        for (int spin = 0; remaining != 0 && spin < SpinIterations; spin++)
+        {
+            CpuRelax();
+            remaining = pending.load(std::memory_order_acquire);
+        }
+        while (remaining != 0)
+        {
+            pending.wait(remaining, std::memory_order_acquire);
+            remaining = pending.load(std::memory_order_acquire);
+        }
+    }
+
+    // Splits [0, count) into one contiguous, equally sized range per participant and runs body(begin, end, participant) on each
+    template <typename Body>
+    void ParallelFor(size_t count, Body&& body)
+    {
+        const size_t participants = (size_t)GetNumberOfParticipants();
+        auto job = [&](int participant) {
+            size_t begin = count * participant / participants;
+            size_t end = count * (participant + 1) / participants;
+            if (begin < end) {
+                body(begin, end, participant);
+            }
+            };
+        Run(job);
+    }
+};
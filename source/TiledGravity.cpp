@@ -0,0 +1,34 @@
+#include "TiledGravity.h"
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <vector>
+#else
+#include <unistd.h>
+#endif
+
+size_t TiledGravity::DataCacheSize(int level)
+{
+#if defined(_WIN32)
+    DWORD length = 0;
+    GetLogicalProcessorInformation(nullptr, &length);
+    std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+    if (info.empty() || !GetLogicalProcessorInformation(info.data(), &length))
+        return 0;
+    for (const SYSTEM_LOGICAL_PROCESSOR_INFORMATION& entry : info)
+    {
+        if (entry.Relationship == RelationCache && entry.Cache.Level == level
+            && (entry.Cache.Type == CacheData || entry.Cache.Type == CacheUnified)) {
+            return entry.Cache.Size;
+        }
+    }
+    return 0;
+#elif defined(_SC_LEVEL1_DCACHE_SIZE)
+    long size = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : _SC_LEVEL2_CACHE_SIZE);
+    return size > 0 ? (size_t)size : 0;
+#else
+    (void)level;
+    return 0;
+#endif
+}
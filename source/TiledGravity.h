@@ -0,0 +1,69 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include "BodyStore.h"
+#include "TestParticles.h"
+
+/// <summary>
+/// Cache-blocked direct summation. The sources are packed once into the interleaved block the test-particle
+/// sweep uses, then walked a tile at a time: every target of a chunk is swept against one tile before the next
+/// tile is touched, so the tile stays in L1 and the chunk's positions and accelerations stay in L2 however
+/// large N gets. Tile and chunk sizes come from the cache sizes of the machine it runs on.
+/// </summary>
+class TiledGravity
+{
+private:
+    static constexpr size_t BytesPerSource = 4 * sizeof(double);   // x, y, z, mu
+    static constexpr size_t BytesPerTarget = 6 * sizeof(double);   // x, y, z, ax, ay, az
+    static constexpr size_t FallbackL1 = 32 * 1024;
+    static constexpr size_t FallbackL2 = 1024 * 1024;
+
+    TestParticleSources sources;
+    size_t tileSize = 0;
+    size_t chunkSize = 0;
+
+    // Data cache size in bytes of the given level, 0 if the system does not say (TiledGravity.cpp, which keeps the
+    // platform headers out of everything that includes this one)
+    static size_t DataCacheSize(int level);
+
+public:
+    TiledGravity()
+    {
+        size_t l1 = DataCacheSize(1);
+        size_t l2 = DataCacheSize(2);
+        if (l1 == 0) l1 = FallbackL1;
+        if (l2 == 0) l2 = FallbackL2;
+        // Half of each level, leaving room for the other stream and whatever else is live, rounded down to a multiple
+        // of 16. The SIMD sweep runs across targets, 8 (AVX2) or 16 (AVX-512) a step, so a chunk boundary never leaves
+        // a scalar tail; only the last chunk does, when the target count is not a multiple of the step. Sources are
+        // taken one at a time, so the last tile, short whenever the source count is not a multiple of tileSize, costs
+        // nothing extra
+        tileSize = std::max<size_t>(64, (l1 / 2 / BytesPerSource) / 16 * 16);
+        chunkSize = std::max<size_t>(tileSize, (l2 / 2 / BytesPerTarget) / 16 * 16);
+    }
+
+    size_t GetTileSize() const
+    {
+        return tileSize;
+    }
+
+    size_t GetChunkSize() const
+    {
+        return chunkSize;
+    }
+
+    // Pull of sources [sourceBegin, sourceEnd) on targets [targetBegin, targetEnd), skipping coincident pairs
+    void Accumulate(const StageView& s, const double* mu, size_t targetBegin, size_t targetEnd, size_t sourceBegin, size_t sourceEnd)
+    {
+        sources.Load(s, mu, sourceBegin, sourceEnd);
+        const size_t numberOfSources = sources.GetCount();
+        for (size_t chunk = targetBegin; chunk < targetEnd; chunk += chunkSize)
+        {
+            size_t chunkEnd = std::min(chunk + chunkSize, targetEnd);
+            for (size_t tile = 0; tile < numberOfSources; tile += tileSize)
+            {
+                sources.Accumulate(s, chunk, chunkEnd, tile, std::min(tile + tileSize, numberOfSources));
+            }
+        }
+    }
+};
@@ -0,0 +1,201 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include <algorithm>
+#include "triple.h"
+
+// A trail oldest first as at most two contiguous runs, the second empty unless the ring has wrapped
+struct TrailSpans {
+    std::span<const triple> first, second;
+
+    size_t size() const { return first.size() + second.size(); }
+};
+
+/// <summary>
+/// Fixed-capacity ring of one body's most recent stored positions, in storage it does not own (a TrailSlab
+/// region), each with the simulation time it was stored at. Storing a position once the ring is full overwrites
+/// the oldest in place, so a store is O(1) however long the trail is. Indexing runs oldest first, as the vector
+/// it replaces did. Every point stored takes the next serial number, so a reader keeping its own copy of the trail
+/// can tell from the serials, the count of moves of the newest point and the generation, bumped whenever the trail
+/// restarts, exactly which points changed since it last looked.
+/// </summary>
+class TrailRing
+{
+private:
+    triple* data = nullptr;
+    double* times = nullptr;
+    size_t capacity = 0, start = 0, count = 0;
+    uint64_t pushed = 0, moves = 0, generation = 0;
+
+    size_t Slot(size_t i) const
+    {
+        const size_t k = start + i;
+        return k < capacity ? k : k - capacity;
+    }
+
+    friend class TrailSlab;
+
+public:
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t GetCapacity() const { return capacity; }
+
+    uint64_t GetStartSerial() const { return pushed - count; }  // Serial of the oldest point
+    uint64_t GetEndSerial() const { return pushed; }            // One past the serial of the newest
+    uint64_t GetMoves() const { return moves; }
+    uint64_t GetGeneration() const { return generation; }
+
+    const triple& operator[](size_t i) const { return data[Slot(i)]; }
+    double TimeAt(size_t i) const { return times[Slot(i)]; }
+    const triple& back() const { return data[Slot(count - 1)]; }
+
+    // Stores p, taken at time t, as the newest position, dropping the oldest when full; ignored until the ring has storage
+    void push_back(const triple& p, double t)
+    {
+        if (capacity == 0)
+            return;
+        pushed++;
+        if (count < capacity) {
+            const size_t k = Slot(count++);
+            data[k] = p;
+            times[k] = t;
+            return;
+        }
+        data[start] = p;
+        times[start] = t;
+        start = start + 1 == capacity ? 0 : start + 1;
+    }
+
+    // Moves the newest position to p, taken at time t
+    void ReplaceBack(const triple& p, double t)
+    {
+        const size_t k = Slot(count - 1);
+        data[k] = p;
+        times[k] = t;
+        moves++;
+    }
+
+    void PopFront()
+    {
+        start = start + 1 == capacity ? 0 : start + 1;
+        count--;
+    }
+
+    void clear()
+    {
+        start = 0;
+        count = 0;
+        generation++;
+    }
+
+    // Lets go of the storage, for a body leaving the slab
+    void Detach()
+    {
+        data = nullptr;
+        times = nullptr;
+        capacity = 0;
+        clear();
+    }
+
+    TrailSpans Spans() const
+    {
+        const size_t firstLength = std::min(count, capacity - start);
+        return { { data + start, firstLength }, { data, count - firstLength } };
+    }
+};
+
+/// <summary>
+/// Streaming simplification of a trail as it is stored. The newest point is provisional: while the chord from the
+/// last kept point to a new sample passes within tolerance of every sample since, the new sample just moves it,
+/// and only when the chord misses one does it become kept and the new sample the next provisional point. Straight
+/// stretches collapse to a point per MaxRun samples, and a bend keeps as many as it needs to stay within tolerance.
+/// </summary>
+class TrailFilter
+{
+private:
+    static constexpr int MaxRun = 32;   // Samples folded into one chord before its end is kept anyway, bounding the test
+
+    triple run[MaxRun];                 // Samples since the last kept point, the provisional one's earlier positions
+    int runCount = 0;
+
+    static double DistanceSquared(const triple& p, const triple& a, const triple& b)
+    {
+        const triple ab = b - a, ap = p - a;
+        const double length2 = ab * ab;
+        const double s = length2 > 0 ? std::clamp((ap * ab) / length2, 0.0, 1.0) : 0.0;
+        const triple miss = ap - s * ab;
+        return miss * miss;
+    }
+
+public:
+    void Reset() { runCount = 0; }
+
+    // Stores p, taken at time t, into ring, folding it into the provisional point when that keeps within tolerance
+    void Store(TrailRing& ring, const triple& p, double t, double tolerance)
+    {
+        if (ring.size() < 2 || tolerance <= 0) {
+            ring.push_back(p, t);
+            runCount = 0;
+            return;
+        }
+        const triple& anchor = ring[ring.size() - 2];
+        const triple& provisional = ring.back();
+        const double tolerance2 = tolerance * tolerance;
+        bool fits = runCount < MaxRun && DistanceSquared(provisional, anchor, p) <= tolerance2;
+        for (int k = 0; k < runCount && fits; k++)
+        {
+            fits = DistanceSquared(run[k], anchor, p) <= tolerance2;
+        }
+        if (fits) {
+            run[runCount++] = provisional;
+            ring.ReplaceBack(p, t);
+            return;
+        }
+        ring.push_back(p, t);
+        runCount = 0;
+    }
+};
+
+/// <summary>
+/// One allocation holding every body's trail ring back to back, capacity positions each. Laying it out again,
+/// for a new body count or capacity, keeps the newest positions of each ring that fit its new region.
+/// </summary>
+class TrailSlab
+{
+private:
+    std::vector<triple> storage;
+    std::vector<double> times;
+    size_t capacity = 0;
+
+public:
+    size_t GetCapacity() const { return capacity; }
+
+    // Gives each of rings a region of capacity positions, in order, carrying over what it held
+    void Layout(const std::vector<TrailRing*>& rings, size_t newCapacity)
+    {
+        std::vector<triple> next(rings.size() * newCapacity);
+        std::vector<double> nextTimes(next.size());
+        for (size_t r = 0; r < rings.size(); r++)
+        {
+            TrailRing& ring = *rings[r];
+            const size_t kept = std::min(ring.count, newCapacity);
+            triple* region = next.data() + r * newCapacity;
+            double* timeRegion = nextTimes.data() + r * newCapacity;
+            for (size_t k = 0; k < kept; k++)
+            {
+                region[k] = ring[ring.count - kept + k];
+                timeRegion[k] = ring.TimeAt(ring.count - kept + k);
+            }
+            ring.data = newCapacity > 0 ? region : nullptr;
+            ring.times = newCapacity > 0 ? timeRegion : nullptr;
+            ring.capacity = newCapacity;
+            ring.start = 0;
+            ring.count = kept;
+        }
+        storage.swap(next);
+        times.swap(nextTimes);
+        capacity = newCapacity;
+    }
+};
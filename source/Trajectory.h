@@ -0,0 +1,202 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include "triple.h"
+
+// Cubic Hermite piece of a trajectory, fixed by the position and velocity at both ends
+struct TrajectorySegment {
+    double t0, t1;
+    triple p0, v0, p1, v1;
+
+    triple Position(double t) const
+    {
+        const double h = t1 - t0;
+        if (h <= 0)
+            return p1;
+        const double s = std::clamp((t - t0) / h, 0.0, 1.0);
+        const double s2 = s * s, s3 = s2 * s;
+        return (2 * s3 - 3 * s2 + 1) * p0 + ((s3 - 2 * s2 + s) * h) * v0 + (-2 * s3 + 3 * s2) * p1 + ((s3 - s2) * h) * v1;
+    }
+
+    triple Velocity(double t) const
+    {
+        const double h = t1 - t0;
+        if (h <= 0)
+            return v1;
+        const double s = std::clamp((t - t0) / h, 0.0, 1.0);
+        const double s2 = s * s;
+        return ((6 * s2 - 6 * s) / h) * (p0 - p1) + (3 * s2 - 4 * s + 1) * v0 + (3 * s2 - 2 * s) * v1;
+    }
+};
+
+/// <summary>
+/// Continuous record of one body's path as cubic Hermite segments, from which its position and velocity can be
+/// read at any time it covers. Every step's end state is appended; the open segment is stretched over as many
+/// steps as it can while the cubic through its ends still passes within tolerance of the step ends it spans, so a
+/// planet's year or a quiet cruise takes a few segments and a periapsis pass as many as its bending needs. The
+/// closed segments are bounded by a count, oldest dropped first.
+/// </summary>
+class TrajectoryStore
+{
+private:
+    static constexpr int MaxCheckpoints = 16;   // Step ends kept to test the open segment against, evenly spread over it
+
+    struct Checkpoint {
+        double t;
+        triple p;
+    };
+
+    std::deque<TrajectorySegment> segments;
+    std::vector<TrajectorySegment> pending;     // Closed while a reader held the guard, moved into segments once it lets go
+    bool staleSegments = false;                 // segments predate a Reset that found the guard held, dropped at the next flush
+    TrajectorySegment open = {};
+    Checkpoint checkpoints[MaxCheckpoints];
+    int checkpointCount = 0;
+    double checkpointSpacing = 0;               // Doubles each time the checkpoints fill, when every other one is dropped
+    bool started = false;
+
+    // Whether candidate passes within tolerance of the open segment's end and the step ends before it
+    bool Fits(const TrajectorySegment& candidate, double tolerance) const
+    {
+        const triple end = candidate.Position(open.t1) - open.p1;
+        if (end * end > tolerance * tolerance)
+            return false;
+        for (int k = 0; k < checkpointCount; k++)
+        {
+            const triple miss = candidate.Position(checkpoints[k].t) - checkpoints[k].p;
+            if (miss * miss > tolerance * tolerance)
+                return false;
+        }
+        return true;
+    }
+
+    void AddCheckpoint(double t, const triple& p)
+    {
+        if (checkpointCount > 0 && t - checkpoints[checkpointCount - 1].t < checkpointSpacing)
+            return;
+        if (checkpointCount == MaxCheckpoints) {
+            for (int k = 0; k < MaxCheckpoints / 2; k++)
+            {
+                checkpoints[k] = checkpoints[2 * k];
+            }
+            checkpointCount = MaxCheckpoints / 2;
+            checkpointSpacing = checkpoints[1].t - checkpoints[0].t;
+        }
+        checkpoints[checkpointCount++] = { t, p };
+    }
+
+    void ClearCheckpoints()
+    {
+        checkpointCount = 0;
+        checkpointSpacing = 0;
+    }
+
+    // Segment of a time-ordered run holding t, clamped to the first and last
+    template <typename Segments>
+    static const TrajectorySegment& FindIn(const Segments& run, double t)
+    {
+        const auto next = std::upper_bound(run.begin(), run.end(), t, [](double time, const TrajectorySegment& segment) { return time < segment.t1; });
+        return next == run.end() ? run.back() : *next;
+    }
+
+    // Closed segment holding t, clamped to the first and last
+    const TrajectorySegment& FindClosed(double t) const
+    {
+        return FindIn(segments, t);
+    }
+
+    // Segment holding t as the writer sees it: the closed ones, those still waiting for the guard, then the open one
+    const TrajectorySegment& Find(double t) const
+    {
+        if (t >= open.t0)
+            return open;
+        if (!pending.empty() && (t >= pending.front().t0 || staleSegments || segments.empty()))
+            return FindIn(pending, t);
+        if (staleSegments || segments.empty())
+            return open;
+        return FindClosed(t);
+    }
+
+    // Moves the waiting segments into the closed ones, and drops those a Reset left behind, if guard is free
+    void Flush(size_t maxSegments, std::mutex& guard)
+    {
+        if ((pending.empty() && !staleSegments) || !guard.try_lock())
+            return;
+        if (staleSegments) {
+            segments.clear();
+            staleSegments = false;
+        }
+        segments.insert(segments.end(), pending.begin(), pending.end());
+        pending.clear();
+        while (segments.size() > std::max(maxSegments, (size_t)1))
+        {
+            segments.pop_front();
+        }
+        guard.unlock();
+    }
+
+public:
+    // Starts the record afresh at a single state. Like Append it never blocks on guard: while a reader holds it the old
+    // closed segments stay where the reader sees them, and a later Append drops them
+    void Reset(double t, const triple& p, const triple& v, std::mutex& guard)
+    {
+        pending.clear();
+        open = { t, t, p, v, p, v };
+        ClearCheckpoints();
+        started = true;
+        staleSegments = !segments.empty();
+        Flush(1, guard);
+    }
+
+    /// <summary>
+    /// Extends the record to the state p, v at time t, later than the last. Closing a segment, the only change
+    /// to the closed segments, happens under guard, which readers of them hold; when a reader has it the segment
+    /// waits, unseen by readers, for a later call that finds guard free, so the writer never blocks.
+    /// </summary>
+    void Append(double t, const triple& p, const triple& v, double tolerance, size_t maxSegments, std::mutex& guard)
+    {
+        if (!started) {
+            Reset(t, p, v, guard);
+            return;
+        }
+        if (t > open.t1) {
+            const TrajectorySegment candidate = { open.t0, t, open.p0, open.v0, p, v };
+            if (open.t1 == open.t0 || Fits(candidate, tolerance)) {
+                if (open.t1 > open.t0) {
+                    AddCheckpoint(open.t1, open.p1);
+                }
+                open = candidate;
+            }
+            else {
+                pending.push_back(open);
+                open = { open.t1, t, open.p1, open.v1, p, v };
+                ClearCheckpoints();
+            }
+        }
+        Flush(maxSegments, guard);
+    }
+
+    bool Empty() const { return !started; }
+    double StartTime() const
+    {
+        if (!staleSegments && !segments.empty())
+            return segments.front().t0;
+        return pending.empty() ? open.t0 : pending.front().t0;
+    }
+    double EndTime() const { return open.t1; }
+    size_t GetSegmentCount() const { return (staleSegments ? 0 : segments.size()) + pending.size() + (started ? 1 : 0); }
+
+    // Position and velocity at time t, held at the ends outside the recorded span, for the writer's thread
+    triple Position(double t) const { return Find(t).Position(t); }
+    triple Velocity(double t) const { return Find(t).Velocity(t); }
+
+    // The closed segments alone, all another thread may read, holding the guard given to Append
+    bool ClosedEmpty() const { return segments.empty(); }
+    double ClosedStartTime() const { return segments.front().t0; }
+    double ClosedEndTime() const { return segments.back().t1; }
+    triple ClosedPosition(double t) const { return FindClosed(t).Position(t); }
+};
@@ -8,6 +8,13 @@ VertexBuffer::VertexBuffer(const void* data, unsigned int size)
     GLCall(glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW));
 }
 
+VertexBuffer::VertexBuffer(unsigned int size)
+{
+    GLCall(glGenBuffers(1, &m_RendererID));
+    GLCall(glBindBuffer(GL_ARRAY_BUFFER, m_RendererID));
+    GLCall(glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_DYNAMIC_DRAW));
+}
+
 VertexBuffer::~VertexBuffer()
 {
     GLCall(glDeleteBuffers(1, &m_RendererID));
@@ -18,6 +25,13 @@ void VertexBuffer::Bind()
     GLCall(glBindBuffer(GL_ARRAY_BUFFER, m_RendererID));
 }
 
+// Overwrites size bytes from offset, leaving the rest of the buffer as it was
+void VertexBuffer::Update(const void* data, unsigned int offset, unsigned int size)
+{
+    GLCall(glBindBuffer(GL_ARRAY_BUFFER, m_RendererID));
+    GLCall(glBufferSubData(GL_ARRAY_BUFFER, offset, size, data));
+}
+
 void VertexBuffer::Unbind()
 {
     GLCall(glBindBuffer(GL_ARRAY_BUFFER, 0));
@@ -6,9 +6,12 @@ private:
 	unsigned int m_RendererID;
 public:
 	VertexBuffer(const void* data, unsigned int size);
+	// Empty buffer of size bytes, filled piece by piece with Update
+	VertexBuffer(unsigned int size);
 	~VertexBuffer();
 
 	void Bind();
 	void Unbind();
+	void Update(const void* data, unsigned int offset, unsigned int size);
 	void CreateCircle(float x, float y, unsigned int vertexCount);
 };
\ No newline at end of file
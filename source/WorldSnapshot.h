@@ -0,0 +1,70 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include "triple.h"
+
+class PhysicsObject;
+
+/// <summary>
+/// Single-producer single-consumer triple buffer. The writer fills Back() and publishes it with Publish(); the
+/// reader takes the newest published slot with Latest(), which stays its own until it asks again. Each side only
+/// ever swaps its slot with the shared middle one in a single atomic exchange, so neither waits on the other and
+/// the reader never sees a slot the writer is still filling.
+/// </summary>
+template<typename T>
+class TripleBuffer
+{
+private:
+    static constexpr int Fresh = 4;    // Set on the middle slot's index when it holds a publish the reader has not taken
+
+    T slots[3];
+    std::atomic<int> middle{ 1 };
+    int back = 0, front = 2;
+
+public:
+    T& Back() { return slots[back]; }
+
+    void Publish()
+    {
+        back = middle.exchange(back | Fresh, std::memory_order_acq_rel) & ~Fresh;
+    }
+
+    const T& Latest()
+    {
+        if (middle.load(std::memory_order_relaxed) & Fresh) {
+            front = middle.exchange(front, std::memory_order_acq_rel) & ~Fresh;
+        }
+        return slots[front];
+    }
+};
+
+// Everything the renderer draws a frame from, copied by the simulation thread at the end of a frame of steps
+struct WorldSnapshot {
+    std::vector<PhysicsObject*> objects;    // allObjects as it was, for names, radii and the trails
+    std::vector<triple> positions, velocities, externalForces;
+    std::vector<triple> selectedPositions;  // Each object relative to the selected one, through the reference frames
+    std::vector<int> referenceIndices;      // Index of each object's referenceObject, -1 for none
+    int selectedIndex = -1;                 // -1 for none
+    int referenceIndex = -1;                // The simulator's referenceObject
+    double timeElapsed = 0;
+    int years = 0, days = 0, hours = 0, minutes = 0;
+    double seconds = 0.0;
+    double timeWarp = 1;
+    int substeps = 1;
+    bool paused = false;
+    size_t frame = 0;                       // Publishes before this one
+
+    size_t Count() const { return objects.size(); }
+
+    // Index of object in this snapshot, -1 when it is not in it
+    int IndexOf(const PhysicsObject* object) const
+    {
+        for (size_t i = 0; i < objects.size(); i++)
+        {
+            if (objects[i] == object)
+                return (int)i;
+        }
+        return -1;
+    }
+};
@@ -1,4 +1,6 @@
 #include "body.h"
+#include <random>
+#include <iomanip>
 
 using application = renderer;
 double maxtps = 10000000000.0f;
@@ -211,4 +213,168 @@ void ExternalForces() {
 
     }
 
+}
+
+// Fills a body store with a Plummer sphere of equal-mass bodies, the self-gravitating cloud the solver reports below run on
+void PlummerCloud(BodyStore& bodies, size_t numberOfBodies, double cloudRadius) {
+    bodies.Resize(numberOfBodies, numberOfBodies);
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    for (size_t i = 0; i < numberOfBodies; i++) {
+        // Plummer sphere radius with an isotropic direction
+        double r = cloudRadius / std::sqrt(std::pow(uniform(rng) * 0.999 + 0.0005, -2.0 / 3.0) - 1.0);
+        double cosTheta = 2.0 * uniform(rng) - 1.0;
+        double phi = 2.0 * 3.14159265358979323846 * uniform(rng);
+        double sinTheta = std::sqrt(1.0 - cosTheta * cosTheta);
+        bodies.x[i] = r * sinTheta * std::cos(phi);
+        bodies.y[i] = r * sinTheta * std::sin(phi);
+        bodies.z[i] = r * cosTheta;
+        bodies.m[i] = 1.0e20;
+        bodies.mu[i] = bodies.m[i] * GravitySimulator::G;
+    }
+}
+
+// Sorted relative error of the stage 1 accelerations against stage 0 (the direct sum)
+std::vector<double> RelativeErrors(BodyStore& bodies) {
+    StageView exactStage = bodies.View(0);
+    StageView approxStage = bodies.View(1);
+    std::vector<double> errors(bodies.count);
+    for (size_t i = 0; i < bodies.count; i++) {
+        triple exact(exactStage.ax[i], exactStage.ay[i], exactStage.az[i]);
+        triple approx(approxStage.ax[i], approxStage.ay[i], approxStage.az[i]);
+        errors[i] = (approx - exact).magnitude() / exact.magnitude();
+    }
+    std::sort(errors.begin(), errors.end());
+    return errors;
+}
+
+// Console report of Barnes-Hut accuracy and cost against the direct kernel on a self-gravitating cloud, used to pick barnesHutTheta
+void BarnesHutAccuracy() {
+    const size_t numberOfBodies = 20000;
+    BodyStore bodies;
+    PlummerCloud(bodies, numberOfBodies, 1.0e9);
+    ThreadPool pool((int)std::thread::hardware_concurrency());
+    StageView direct = bodies.View(0);
+    StageView tree = bodies.View(1);
+
+    timepoint start = clock1::now();
+    pool.ParallelFor(numberOfBodies, [&](size_t begin, size_t end, int) {
+        AccumulateGravityBlock(direct, bodies.mu.data(), begin, end, 0, numberOfBodies);
+        });
+    double directTime = (clock1::now() - start).count() / 1000000000.0;
+
+    std::cout << "Barnes-Hut accuracy, " << numberOfBodies << " bodies, " << pool.GetNumberOfParticipants() << " threads, direct sum "
+        << std::fixed << std::setprecision(2) << directTime * 1000.0 << " ms" << std::endl;
+    std::cout << " theta   median err     99% err     max err   nodes   build ms   walk ms  speedup  sorted" << std::endl;
+    BarnesHutTree barnesHutTree;
+    for (double theta : { 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 1.0 }) {
+        bodies.stages[1].ClearAcceleration();
+        start = clock1::now();
+        barnesHutTree.Build(tree, bodies.mu.data(), 0, numberOfBodies, theta, pool);
+        double buildTime = (clock1::now() - start).count() / 1000000000.0;
+        start = clock1::now();
+        pool.ParallelFor(numberOfBodies, [&](size_t begin, size_t end, int) {
+            barnesHutTree.Accumulate(tree, begin, end);
+            });
+        double walkTime = (clock1::now() - start).count() / 1000000000.0;
+
+        std::vector<double> errors = RelativeErrors(bodies);
+        std::cout << std::setw(6) << std::setprecision(2) << theta
+            << std::scientific << std::setprecision(3)
+            << std::setw(13) << errors[numberOfBodies / 2]
+            << std::setw(12) << errors[numberOfBodies * 99 / 100]
+            << std::setw(12) << errors.back()
+            << std::fixed << std::setprecision(2)
+            << std::setw(8) << barnesHutTree.GetNumberOfNodes()
+            << std::setw(11) << buildTime * 1000.0
+            << std::setw(10) << walkTime * 1000.0
+            << std::setw(9) << directTime / (buildTime + walkTime) << "x"
+            << std::setw(8) << (barnesHutTree.IsKeyOrderSorted() ? "yes" : "NO") << std::endl;
+    }
+}
+
+// Console report of fast multipole accuracy and cost per expansion order, against the direct kernel on the same cloud, used to pick fmmOrder
+void FastMultipoleAccuracy(double theta = 0.4) {
+    const size_t numberOfBodies = 20000;
+    BodyStore bodies;
+    PlummerCloud(bodies, numberOfBodies, 1.0e9);
+    ThreadPool pool((int)std::thread::hardware_concurrency());
+    StageView direct = bodies.View(0);
+    StageView tree = bodies.View(1);
+
+    timepoint start = clock1::now();
+    pool.ParallelFor(numberOfBodies, [&](size_t begin, size_t end, int) {
+        AccumulateGravityBlock(direct, bodies.mu.data(), begin, end, 0, numberOfBodies);
+        });
+    double directTime = (clock1::now() - start).count() / 1000000000.0;
+
+    std::cout << "Fast multipole accuracy, " << numberOfBodies << " bodies, " << pool.GetNumberOfParticipants() << " threads, theta "
+        << std::fixed << std::setprecision(2) << theta << ", direct sum " << directTime * 1000.0 << " ms" << std::endl;
+    std::cout << " order   median err     99% err     max err   cells   build ms    eval ms  speedup  sorted" << std::endl;
+    FastMultipoleSolver fastMultipole;
+    for (int order = 1; order <= 8; order++) {
+        bodies.stages[1].ClearAcceleration();
+        start = clock1::now();
+        fastMultipole.Build(tree, numberOfBodies, numberOfBodies, pool);
+        double buildTime = (clock1::now() - start).count() / 1000000000.0;
+        start = clock1::now();
+        fastMultipole.Evaluate(tree, bodies.mu.data(), order, theta, pool);
+        double evaluateTime = (clock1::now() - start).count() / 1000000000.0;
+
+        std::vector<double> errors = RelativeErrors(bodies);
+        std::cout << std::setw(6) << order
+            << std::scientific << std::setprecision(3)
+            << std::setw(13) << errors[numberOfBodies / 2]
+            << std::setw(12) << errors[numberOfBodies * 99 / 100]
+            << std::setw(12) << errors.back()
+            << std::fixed << std::setprecision(2)
+            << std::setw(8) << fastMultipole.GetNumberOfCells()
+            << std::setw(11) << buildTime * 1000.0
+            << std::setw(11) << evaluateTime * 1000.0
+            << std::setw(9) << directTime / (buildTime + evaluateTime) << "x"
+            << std::setw(8) << (fastMultipole.IsKeyOrderSorted() ? "yes" : "NO") << std::endl;
+    }
+}
+
+// Console report of direct-sum throughput on a cloud of N = 1k..64k, the symmetric pair loop against the streaming SIMD
+// kernel and the cache-blocked one. GFLOP/s counts the customary 20 flops per body-body interaction, so the pair
+// loop is credited with two interactions per pair
+void TiledGravityThroughput() {
+    const double flopsPerInteraction = 20.0;
+    TiledGravity tiledGravity;
+    std::cout << "Direct-sum throughput, single thread, " << GetSimdLevelName(GetSimdLevel()) << " kernels, tile "
+        << tiledGravity.GetTileSize() << " sources, chunk " << tiledGravity.GetChunkSize() << " targets" << std::endl;
+    std::cout << "       N   pair loop GFLOP/s   streaming GFLOP/s   tiled GFLOP/s   tiled max err" << std::endl;
+    for (size_t numberOfBodies = 1024; numberOfBodies <= 65536; numberOfBodies *= 2) {
+        BodyStore bodies;
+        PlummerCloud(bodies, numberOfBodies, 1.0e9);
+        StageView streaming = bodies.View(0);
+        StageView tiled = bodies.View(1);
+        const double flops = flopsPerInteraction * (double)numberOfBodies * (double)numberOfBodies;
+
+        AccelerationBuffer pairs;
+        pairs.Resize(numberOfBodies);
+        timepoint start = clock1::now();
+        for (size_t i = 0; i < numberOfBodies; i++) {
+            AccumulateGravitySymmetricRow(streaming, bodies.mu.data(), i, i + 1, numberOfBodies, pairs.ax.data(), pairs.ay.data(), pairs.az.data());
+        }
+        double pairTime = (clock1::now() - start).count() / 1000000000.0;
+
+        start = clock1::now();
+        AccumulateGravityBlock(streaming, bodies.mu.data(), 0, numberOfBodies, 0, numberOfBodies);
+        double streamingTime = (clock1::now() - start).count() / 1000000000.0;
+
+        start = clock1::now();
+        tiledGravity.Accumulate(tiled, bodies.mu.data(), 0, numberOfBodies, 0, numberOfBodies);
+        double tiledTime = (clock1::now() - start).count() / 1000000000.0;
+
+        std::vector<double> errors = RelativeErrors(bodies);
+        std::cout << std::setw(8) << numberOfBodies
+            << std::fixed << std::setprecision(2)
+            << std::setw(20) << flops / pairTime / 1.0e9
+            << std::setw(20) << flops / streamingTime / 1.0e9
+            << std::setw(16) << flops / tiledTime / 1.0e9
+            << std::scientific << std::setprecision(3)
+            << std::setw(16) << errors.back() << std::endl;
+    }
 }
\ No newline at end of file
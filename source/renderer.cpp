@@ -153,16 +153,17 @@ void renderer::render() {
             setMVPMatrix(shader2);
             setMVPMatrix(shader3);
 
-            {
+            // The newest state the simulator has published; it never waits on this thread, nor this one on it
+            const WorldSnapshot& world = linkedSim->LatestSnapshot();
+            if (linkedSim->showTraces) {
+                // The trail history is the one thing still shared with the simulator, which skips a store rather than wait
                 std::lock_guard<std::mutex> guard(linkedSim->storingPositionsMutex);
-                if (linkedSim->showTraces) {
-                    renderTrailsLines(linkedSim, shader2);
-                }
-                renderExternalForces(linkedSim, shader3);
-                renderSimulatorObjects(linkedSim, shader);
+                renderTrailsLines(linkedSim, world, shader2);
             }
+            renderExternalForces(linkedSim, world, shader3);
+            renderSimulatorObjects(linkedSim, world, shader);
 
-            renderImGui(linkedSim);
+            renderImGui(linkedSim, world);
             // Handle mouse input (this part is unconventional to place here, usually in the render loop)
             if (!ImGui::GetIO().WantCaptureMouse) {
                 int state = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT);
@@ -286,13 +287,14 @@ void renderer::rendernonmt() {
             setMVPMatrix(shader2);
             setMVPMatrix(shader3);
 
+            const WorldSnapshot& world = linkedSim->LatestSnapshot();
             if (linkedSim->showTraces) {
-                renderTrailsLines(linkedSim, shader2);
+                renderTrailsLines(linkedSim, world, shader2);
             }
-			renderExternalForces(linkedSim, shader3);
-            renderSimulatorObjects(linkedSim, shader);
+			renderExternalForces(linkedSim, world, shader3);
+            renderSimulatorObjects(linkedSim, world, shader);
 
-            renderImGui(linkedSim);
+            renderImGui(linkedSim, world);
             if (!ImGui::GetIO().WantCaptureMouse) {
                 int state = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT);
                 if (state == GLFW_PRESS)
@@ -366,7 +368,7 @@ void renderer::rendernonmt() {
     glfwDestroyWindow(window);  // Proper cleanup of the GLFW window
 }
 
-void renderer::setMVPMatrix(Shader& shader) {
+void renderer::setMVPMatrix(Shader& shader, float modelX, float modelY) {
     shader.Bind();
     float aspectRatio = static_cast<float>(scrWidth) / static_cast<float>(scrHeight);
     /* Projection Matrix */
@@ -374,7 +376,7 @@ void renderer::setMVPMatrix(Shader& shader) {
     /* View Matrix - Move the camera around */
     glm::mat4 view = glm::translate(glm::mat4(1.0f), glm::vec3(0, 0, 0));
     /* Model Matrix - Move the model around */
-    glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(0, 0, 0));
+    glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(modelX, modelY, 0));
     /* Combine into an MVP */
     glm::mat4 mvp = proj * view * model;
     shader.SetUniformMat4f("u_MVP", mvp);
@@ -394,7 +396,7 @@ void renderer::setMVPMatrixNoZoom(Shader& shader) {
     shader.SetUniformMat4f("u_MVP", mvp);
 }
 
-void renderer::renderImGui(GravitySimulator* linkedSim) {
+void renderer::renderImGui(GravitySimulator* linkedSim, const WorldSnapshot& world) {
     //// Start ImGui frame
     ImGui_ImplOpenGL3_NewFrame();
     ImGui_ImplGlfw_NewFrame();
@@ -409,76 +411,92 @@ void renderer::renderImGui(GravitySimulator* linkedSim) {
             ImGui::Text("Linked Simulator dt: %.10fms (%.1fHz)", linkedSim->myDt * 1000.0, 1.0 / linkedSim->myDt);
             /*float position[3] = { linkedSim->allObjects[0]->p.x, linkedSim->allObjects[0]->p.y, linkedSim->allObjects[0]->p.z };
             ImGui::SliderFloat3("Earth Location: ", position, 0, 10000);*/
-            int years = linkedSim->years;
-            int days = linkedSim->days;
-            int hrs = linkedSim->hours;
-            int mins = linkedSim->minutes;
-            double secs = linkedSim->seconds;
+            int years = world.years;
+            int days = world.days;
+            int hrs = world.hours;
+            int mins = world.minutes;
+            double secs = world.seconds;
             if (years < 1) {
-                ImGui::Text("Elapsed Time: %i days %02i:%02i:%06.3f (Timewarp %.2fx)", days, hrs, mins, secs, linkedSim->timeWarp);
+                ImGui::Text("Elapsed Time: %i days %02i:%02i:%06.3f (Timewarp %.2fx)", days, hrs, mins, secs, world.timeWarp);
             }
             else if (years == 1) {
-                ImGui::Text("Elapsed Time: %i year %i days %02i:%02i:%06.3f (Timewarp %.0fx)", years, days, hrs, mins, secs, linkedSim->timeWarp);
+                ImGui::Text("Elapsed Time: %i year %i days %02i:%02i:%06.3f (Timewarp %.0fx)", years, days, hrs, mins, secs, world.timeWarp);
+            }
+            else {
+                ImGui::Text("Elapsed Time: %i years %i days %02i:%02i:%06.3f (Timewarp %.0fx)", years, days, hrs, mins, secs, world.timeWarp);
+            }
+            if (linkedSim->useRKF) {
+                ImGui::Text("Adaptive step: %.5fs (tolerance %.0e, %zu rejected)", linkedSim->rkfStepSize, linkedSim->rkfTolerance, linkedSim->rkfRejectedSteps);
             }
             else {
-                ImGui::Text("Elapsed Time: %i years %i days %02i:%02i:%06.3f (Timewarp %.0fx)", years, days, hrs, mins, secs, linkedSim->timeWarp);
+                ImGui::Text("Simulator Delta T: %.5fs", (world.timeWarp * linkedSim->myDt) / world.substeps);
             }
-            ImGui::Text("Simulator Delta T: %.5fs", (linkedSim->timeWarp * linkedSim->myDt) / linkedSim->substeps);
             //ImGui::Text("Substeps: %i", linkedSim->substeps);
-            ImGui::DragFloat("Position store Delay", &linkedSim->positionStoreDelay, 0.01f, 100.0f);
-            ImGui::DragInt("Number of stored positions", &linkedSim->numberOfStoredPositions, 1, 1000);
+            // Every change goes through the simulator's command queue and shows in a later snapshot
+            float storeDelay = linkedSim->positionStoreDelay;
+            if (ImGui::DragFloat("Position store Delay", &storeDelay, 0.01f, 100.0f))
+                linkedSim->Post(SimulatorCommand::Set(SimulatorSetting::PositionStoreDelay, storeDelay));
+            int storedPositions = linkedSim->numberOfStoredPositions;
+            if (ImGui::DragInt("Number of stored positions", &storedPositions, 1, 1000))
+                linkedSim->Post(SimulatorCommand::Set(SimulatorSetting::NumberOfStoredPositions, storedPositions));
+            bool decimateTrails = linkedSim->decimateTrails;
+            if (ImGui::Checkbox("Simplify trails", &decimateTrails))
+                linkedSim->Post(SimulatorCommand::Set(SimulatorSetting::DecimateTrails, decimateTrails));
+            bool recordTrajectories = linkedSim->recordTrajectories;
+            if (ImGui::Checkbox("Dense-output trails", &recordTrajectories))
+                linkedSim->Post(SimulatorCommand::Set(SimulatorSetting::RecordTrajectories, recordTrajectories));
+            bool onRails = linkedSim->onRails;
+            if (ImGui::Checkbox("On rails (patched conics)", &onRails))
+                linkedSim->Post(SimulatorCommand::Set(SimulatorSetting::OnRails, onRails));
+            bool regularizeEncounters = linkedSim->regularizeEncounters;
+            if (ImGui::Checkbox("Regularize close encounters (KS)", &regularizeEncounters))
+                linkedSim->Post(SimulatorCommand::Set(SimulatorSetting::RegularizeEncounters, regularizeEncounters));
             //ImGui::Checkbox("Use Runge-Kutta 4th order method: ", &linkedSim->useRK);
-            // Dropdown menu to select an object
-            std::vector<PhysicsObject*> vec = linkedSim->allObjects;
-            std::vector<std::string> objectNames;
-            for (size_t i = 0; i < linkedSim->allObjects.size(); ++i) {
-                objectNames.push_back(linkedSim->allObjects[i]->name);
+            if (linkedSim->type == SimType::FastMultipole) {
+                int fmmOrder = linkedSim->fmmOrder;
+                if (ImGui::SliderInt("FMM expansion order", &fmmOrder, 1, FastMultipoleSolver::MaxOrder))
+                    linkedSim->Post(SimulatorCommand::Set(SimulatorSetting::FmmOrder, fmmOrder));
+                float fmmTheta = (float)linkedSim->fmmTheta;
+                if (ImGui::SliderFloat("FMM separation (theta)", &fmmTheta, 0.1f, 1.0f))
+                    linkedSim->Post(SimulatorCommand::Set(SimulatorSetting::FmmTheta, fmmTheta));
             }
-
-            // Convert names to a char* array (required by ImGui::Combo)
+            // Dropdown menu to select an object, from the objects in the snapshot
+            const int count = (int)world.Count();
             std::vector<const char*> objectNamesCStr;
-            for (const auto& name : objectNames) {
-                objectNamesCStr.push_back(name.c_str());
+            for (PhysicsObject* object : world.objects) {
+                objectNamesCStr.push_back(object->name.c_str());
             }
 			objectNamesCStr.push_back("None");
-            if(linkedSim->selectedObject != linkedSim->noneObject)
+            if (world.selectedIndex >= 0)
             {
-                selectedObjectIndex = (int)std::distance(vec.begin(), std::find(vec.begin(), vec.end(), linkedSim->selectedObject)); // Index of the selected object
-                if (selectedObjectIndex >= vec.size()) {
-                    selectedObjectIndex = 0;
-                    linkedSim->selectedObject = linkedSim->allObjects[0];
-                }
+                selectedObjectIndex = world.selectedIndex;
             }
-            
-			if (linkedSim->selectedObject->referenceObject != nullptr)
-            {
-                selectedObjectIndex2 = (int)std::distance(vec.begin(), std::find(vec.begin(), vec.end(), linkedSim->selectedObject->referenceObject));
-            }
-            else {
-                selectedObjectIndex2 = objectNamesCStr.size() - 1;
+            else if (selectedObjectIndex > count) {
+                selectedObjectIndex = count;
             }
+            const int selected = world.selectedIndex;
+            const int reference = selected >= 0 ? world.referenceIndices[selected] : -1;
+            selectedObjectIndex2 = reference >= 0 ? reference : count;
             // Render the dropdown
-            if (ImGui::Combo("Select Object", &selectedObjectIndex, objectNamesCStr.data(), (int)objectNamesCStr.size())) {
-                // Optional: Handle object selection changes
-            }
+            ImGui::Combo("Select Object", &selectedObjectIndex, objectNamesCStr.data(), (int)objectNamesCStr.size());
 
-			// Display the selected object's distance from the centre of the simulation coordinates
-            double distance = linkedSim->selectedObject->p.magnitude();
-            if(linkedSim->selectedObject != linkedSim->noneObject) {
-                ImGui::Text("Current Distance From Centre: %.5f m (%.5f ly)", (linkedSim->selectedObject->p).magnitude(), (linkedSim->selectedObject->p).magnitude() / 9.461e15);
+			// Display the selected object's distance from the centre of the simulation coordinates, as of the snapshot
+            if (selected >= 0) {
+                const triple selectedP = world.positions[selected], selectedV = world.velocities[selected];
+                ImGui::Text("Current Distance From Centre: %.5f m (%.5f ly)", selectedP.magnitude(), selectedP.magnitude() / 9.461e15);
                 triple currentV, radialV;
                 // Calculate current velocity relative to reference object if it exists
-                if (linkedSim->selectedObject->referenceObject != nullptr) {
-                    currentV = (linkedSim->selectedObject->v - linkedSim->selectedObject->referenceObject->v);
-                    radialV = (linkedSim->selectedObject->v - linkedSim->selectedObject->referenceObject->v).onto((linkedSim->selectedObject->p - linkedSim->selectedObject->referenceObject->p).normalized());
+                if (reference >= 0) {
+                    currentV = (selectedV - world.velocities[reference]);
+                    radialV = (selectedV - world.velocities[reference]).onto((selectedP - world.positions[reference]).normalized());
                 }
                 else {
-                    currentV = (linkedSim->selectedObject->v);
-                    radialV = (linkedSim->selectedObject->v).onto((linkedSim->selectedObject->p).normalized());
+                    currentV = (selectedV);
+                    radialV = (selectedV).onto((selectedP).normalized());
                 }
                 ImGui::Text("Current Speed: %.5f m/s (%.5fc)", currentV.magnitude(), currentV.magnitude() / 299792458.0);
                 // Only display radial and tangential speed if the reference object is different from the selected object
-                if (linkedSim->selectedObject->referenceObject != linkedSim->selectedObject) {
+                if (reference != selected) {
                     ImGui::Text("Radial Speed: %.5f m/s (%.5fc)", radialV.magnitude(), radialV.magnitude() / 299792458.0);
                     triple tangenV = currentV - radialV;
                     ImGui::Text("Tangential Speed: %.5f m/s (%.5fc)", tangenV.magnitude(), tangenV.magnitude() / 299792458.0);
@@ -487,37 +505,15 @@ void renderer::renderImGui(GravitySimulator* linkedSim) {
                 // Dropdown to select reference object
 
                 if (ImGui::Combo("Select Reference Object", &selectedObjectIndex2, objectNamesCStr.data(), (int)objectNamesCStr.size())) {
-
-                    if (selectedObjectIndex2 < linkedSim->allObjects.size())
-                    {
-                        if (linkedSim->selectedObject != nullptr)
-                        {
-                            linkedSim->selectedObject->referenceObject = linkedSim->allObjects[selectedObjectIndex2];
-                        }
-                    }
-                    else {
-                        if (linkedSim->selectedObject != nullptr)
-                        {
-                            linkedSim->selectedObject->referenceObject = nullptr;
-                        }
-                    }
+                    PhysicsObject* target = selectedObjectIndex2 < count ? world.objects[selectedObjectIndex2] : nullptr;
+                    linkedSim->Post(SimulatorCommand::Make(SimulatorCommandType::SetReference, 0, world.objects[selected], target));
                 }
             }
-            if (selectedObjectIndex < linkedSim->allObjects.size())
+            // Until the simulator applies it the snapshot still shows the old selection
+            if (selectedObjectIndex != (selected >= 0 ? selected : count))
             {
-                if (linkedSim->selectedObject != linkedSim->allObjects[selectedObjectIndex])
-                {
-
-                    linkedSim->selectedObject = linkedSim->allObjects[selectedObjectIndex];
-                    if (linkedSim->selectedObject->referenceObject != nullptr)
-                    {
-                        selectedObjectIndex2 = (int)std::distance(vec.begin(), std::find(vec.begin(), vec.end(), linkedSim->selectedObject->referenceObject));
-                    }
-
-                }
-            }
-            else {
-                linkedSim->selectedObject = linkedSim->noneObject;
+                PhysicsObject* object = selectedObjectIndex < count ? world.objects[selectedObjectIndex] : nullptr;
+                linkedSim->Post(SimulatorCommand::Make(SimulatorCommandType::Select, 0, object));
             }
            
 
@@ -616,7 +612,7 @@ void renderer::linkSimulator(GravitySimulator* simulator) {
     std::cout << "Linked Simulator!" << std::endl;
 }
 
-void renderer::renderSimulatorObjects(GravitySimulator* simulator, Shader& shader) {
+void renderer::renderSimulatorObjects(GravitySimulator* simulator, const WorldSnapshot& world, Shader& shader) {
     float screenHeightInv = 1.0f / scrHeight;
     indexBuffer.clear();
     positions3.clear();
@@ -624,34 +620,21 @@ void renderer::renderSimulatorObjects(GravitySimulator* simulator, Shader& shade
     centre[0] = simulator->viewPosX + ((simulator->deltaX) * simulator->zoomLevel * screenHeightInv);
     centre[1] = simulator->viewPosY + ((-simulator->deltaY) * simulator->zoomLevel * screenHeightInv);
     
-    int selectedObjIndex;
-    for (unsigned int i = 0; i < simulator->allObjects.size(); i++)
+    for (unsigned int i = 0; i < world.Count(); i++)
     {
-        if (simulator->allObjects[i] == simulator->selectedObject) {
-            selectedObjIndex = i;
-        }
-        float _radiusOfCurrentObject = simulator->allObjects[i]->radius;
+        float _radiusOfCurrentObject = world.objects[i]->radius;
         if (_radiusOfCurrentObject / simulator->zoomLevel < 2.0f)
         {
             _radiusOfCurrentObject = simulator->zoomLevel * 2.0f;
         }
 
-        // Calculate the object's position relative to the selected object
+        // The object's position relative to the selected object, taken through the reference frames when the
+        // snapshot was published, so objects sharing one stay precise far from the absolute origin
         double objX, objY, objZ;
-		
-        if (simulator->selectedObject == 0) {
-            triple lastPos = simulator->allObjects[i]->p;
-            objX = (lastPos.x);
-            objY = (lastPos.y);
-            objZ = (lastPos.z);
-        }
-        else {
-            triple lastPos = simulator->allObjects[i]->p;
-			triple selectedPos = simulator->selectedObject->p;
-            objX = (lastPos.x - selectedPos.x);
-            objY = (lastPos.y - selectedPos.y);
-            objZ = (lastPos.z - selectedPos.z);
-        }
+        triple relative = world.selectedPositions[i];
+        objX = relative.x;
+        objY = relative.y;
+        objZ = relative.z;
 
         // Apply camera rotation with Z as the up-down axis
         // Yaw (Z-axis rotation)
@@ -719,16 +702,11 @@ void renderer::renderTrails(GravitySimulator* simulator, Shader& shader) {
                     _va1l = simulator->zoomLevel * 1.5f;
                 }
                 triple pastPosition, referencePosition, referenceCurrentPosition;
+                // Stored relative to the trail's reference
                 pastPosition = simulator->allObjects[i]->pastPositions[j];
-                if (simulator->referenceObject != nullptr)
+                if (simulator->allObjects[i]->trailReference != nullptr)
                 {
-                    referencePosition = simulator->referenceObject->pastPositions[j];
-                    referenceCurrentPosition = simulator->referenceObject->p;
-                }
-                if (simulator->allObjects[i]->referenceObject != nullptr)
-                {
-                    referencePosition = simulator->allObjects[i]->referenceObject->pastPositions[j];
-                    referenceCurrentPosition = simulator->allObjects[i]->referenceObject->p;
+                    referenceCurrentPosition = simulator->allObjects[i]->trailReference->p;
                 }
                 // Calculate the object's position relative to the selected object
                 double objX, objY, objZ;
@@ -785,7 +763,34 @@ void renderer::renderTrails(GravitySimulator* simulator, Shader& shader) {
     Draw(va1, ib1, shader, window);
 }
 
-void renderer::renderTrailsLines(GravitySimulator* simulator, Shader& shader)
+// Rotates p, relative to the view's origin, to the camera: x across the screen and z up it
+static void ProjectTrailPoint(const triple& p, double cosZ, double sinZ, float cosX, float sinX, double& x, double& z)
+{
+    const double tempX = p.x * cosZ - p.y * sinZ;
+    const double tempY = p.x * sinZ + p.y * cosZ;
+    x = tempX;
+    z = tempY * sinX + p.z * cosX;
+}
+
+// Quad of halfWidth either side of the line from x1, z1 to x2, z2, as four vertices of position and texture coordinate
+static void TrailQuad(float* out, double x1, double z1, double x2, double z2, float halfWidth, float screenHeightInv)
+{
+    float dx = (float)(x2 - x1);
+    float dz = (float)(z2 - z1);
+    float len = std::sqrt(dx * dx + dz * dz);
+    if (len > 0.0001f) { dx /= len; dz /= len; }
+
+    const float px = -dz * halfWidth;
+    const float pz = dx * halfWidth;
+    const float quad[16] = {
+        (float)(x1 + px) * screenHeightInv, (float)(z1 + pz) * screenHeightInv, 0, 0,
+        (float)(x1 - px) * screenHeightInv, (float)(z1 - pz) * screenHeightInv, 1, 0,
+        (float)(x2 - px) * screenHeightInv, (float)(z2 - pz) * screenHeightInv, 1, 1,
+        (float)(x2 + px) * screenHeightInv, (float)(z2 + pz) * screenHeightInv, 0, 1 };
+    std::copy(quad, quad + 16, out);
+}
+
+void renderer::renderTrailsLines(GravitySimulator* simulator, const WorldSnapshot& world, Shader& shader)
 {
     float screenHeightInv = 1.0f / scrHeight;
     indexBuffer.clear();
@@ -794,117 +799,119 @@ void renderer::renderTrailsLines(GravitySimulator* simulator, Shader& shader)
     centre[0] = simulator->viewPosX + ((simulator->deltaX) * simulator->zoomLevel * screenHeightInv);
     centre[1] = simulator->viewPosY + ((-simulator->deltaY) * simulator->zoomLevel * screenHeightInv);
 
-    /* ============================
-       FIX 1: freeze live positions
-       ============================ */
-    std::vector<triple> frozenPositions(simulator->allObjects.size());
-    for (size_t k = 0; k < simulator->allObjects.size(); ++k)
-        frozenPositions[k] = simulator->allObjects[k]->p;
+    // Trails are simplified as they are stored to a tolerance in pixels at this zoom; posted again when it changes
+    if (simulator->zoomLevel != postedTrailScale && simulator->Post(SimulatorCommand::Set(SimulatorSetting::TrailScale, simulator->zoomLevel)))
+        postedTrailScale = simulator->zoomLevel;
 
-    triple frozenSelectedPos;
-    if (simulator->selectedObject)
-        frozenSelectedPos = simulator->selectedObject->p;
+    // Current positions from the snapshot, so every trail ends where its body is drawn
+    const std::vector<triple>& frozenPositions = world.positions;
 
-    for (unsigned int i = 0; i < simulator->allObjects.size(); i++)
+    triple frozenSelectedPos;
+    if (world.selectedIndex >= 0)
+        frozenSelectedPos = world.positions[world.selectedIndex];
+
+    // With recorded trajectories each trail and its reference's are evaluated at the same evenly spaced times
+    // across the span the stored positions would cover, built again every frame. Only the closed segments are
+    // shared with the simulation thread; the last one joins the snapshot's position
+    const bool dense = simulator->recordTrajectories;
+    const double trailSpan = (double)simulator->positionStoreDelay * simulator->numberOfStoredPositions;
+    std::vector<triple> trail, referenceTrail;
+
+    const double cosZ = cos(simulator->cameraRotationY);
+    const double sinZ = sin(simulator->cameraRotationY);
+    const float cosX = cos(simulator->cameraRotationX);
+    const float sinX = sin(simulator->cameraRotationX);
+
+    for (unsigned int i = 0; i < world.Count(); i++)
     {
-        if (!simulator->allObjects[i]->pastPositions.empty())
+        PhysicsObject* object = world.objects[i];
+        const int refIdx = world.referenceIndices[i];
+        PhysicsObject* ref = refIdx >= 0 ? world.objects[refIdx] : nullptr;
+
+        float _va1l = object->radius * 0.5f;
+        if (_va1l / simulator->zoomLevel < 1)
+            _va1l = simulator->zoomLevel;
+
+        // The stored positions are relative to the reference already and live in the object's trail geometry,
+        // brought up to date with the quads for the points stored since the last frame. Only the piece from the
+        // newest stored point to where the body is now is built every frame
+        if (!dense) {
+            const TrailRing& stored = object->pastPositions;
+            // A trail restarted for a new reference is drawn once the snapshot has caught up with it
+            if (stored.empty() || object->trailReference != ref)
+                continue;
+            const triple origin = (ref != nullptr ? frozenPositions[refIdx] : triple(0, 0, 0)) - frozenSelectedPos;
+            double x1, z1, x2, z2;
+            ProjectTrailPoint(stored.back() + origin, cosZ, sinZ, cosX, sinX, x1, z1);
+            ProjectTrailPoint(frozenPositions[i] - frozenSelectedPos, cosZ, sinZ, cosX, sinX, x2, z2);
+            const unsigned int baseIndex = positions3.size() / 4;
+            positions3.resize(positions3.size() + 16);
+            TrailQuad(&positions3[positions3.size() - 16], x1 + centre[0] * scrHeight, z1 + centre[1] * scrHeight,
+                x2 + centre[0] * scrHeight, z2 + centre[1] * scrHeight, _va1l, screenHeightInv);
+            indexBuffer.insert(indexBuffer.end(), { baseIndex, baseIndex + 1, baseIndex + 2, baseIndex + 2, baseIndex + 3, baseIndex });
+
+            if (stored.size() < 2)
+                continue;
+            TrailGeometry& geometry = trailGeometry[object];
+            updateTrailGeometry(geometry, stored, _va1l);
+            double ox, oz;
+            ProjectTrailPoint(geometry.anchor + origin, cosZ, sinZ, cosX, sinX, ox, oz);
+            setMVPMatrix(shader, (float)((ox + centre[0] * scrHeight) * screenHeightInv), (float)((oz + centre[1] * scrHeight) * screenHeightInv));
+            geometry.va->Bind();
+            trailIndices->Bind();
+            // Segment s, from point s to s + 1, sits in slot s % capacity; the slots of the oldest to the newest
+            // run to the end of the buffer and on from its start once the ring has wrapped
+            const size_t segments = stored.size() - 1;
+            const size_t firstSlot = stored.GetStartSerial() % geometry.capacity;
+            const size_t run = std::min(segments, geometry.capacity - firstSlot);
+            GLCall(glDrawElements(GL_TRIANGLES, (GLsizei)(run * 6), GL_UNSIGNED_INT, (const void*)(firstSlot * 6 * sizeof(unsigned int))));
+            if (run < segments) {
+                GLCall(glDrawElements(GL_TRIANGLES, (GLsizei)((segments - run) * 6), GL_UNSIGNED_INT, nullptr));
+            }
+            continue;
+        }
+
+        if (!object->trajectory.ClosedEmpty() && (ref == nullptr || !ref->trajectory.ClosedEmpty()))
         {
             unsigned int baseIndex = positions3.size() / 4;
-            unsigned int lastIndex = simulator->allObjects[i]->pastPositions.size();
+            double trailEnd = object->trajectory.ClosedEndTime();
+            double trailStart = std::max(world.timeElapsed - trailSpan, object->trajectory.ClosedStartTime());
+            if (ref != nullptr) {
+                trailEnd = std::min(trailEnd, ref->trajectory.ClosedEndTime());
+                trailStart = std::max(trailStart, ref->trajectory.ClosedStartTime());
+            }
+            trailStart = std::min(trailStart, trailEnd);
+            unsigned int lastIndex = (unsigned int)std::max(simulator->numberOfStoredPositions, 1);
+            trail.resize(lastIndex);
+            referenceTrail.resize(lastIndex);
+            for (unsigned int j = 0; j < lastIndex; j++)
+            {
+                const double t = lastIndex > 1 ? trailStart + (trailEnd - trailStart) * j / (lastIndex - 1) : trailEnd;
+                trail[j] = object->trajectory.ClosedPosition(t);
+                if (ref != nullptr)
+                    referenceTrail[j] = ref->trajectory.ClosedPosition(t);
+            }
 
-            /* FIX 2: use frozen current position */
             triple currentPosition = frozenPositions[i];
+            triple referenceCurrentPosition = ref != nullptr ? frozenPositions[refIdx] : triple(0, 0, 0);
 
             for (unsigned int j = 0; j < lastIndex; j++)
             {
-                float _va1l = simulator->allObjects[i]->radius * 0.5f;
-                if (_va1l / simulator->zoomLevel < 1)
-                    _va1l = simulator->zoomLevel;
-
-                triple pastPosition1 = simulator->allObjects[i]->pastPositions[j];
-                triple pastPosition2 =
-                    (j == lastIndex - 1)
-                    ? currentPosition
-                    : simulator->allObjects[i]->pastPositions[j + 1];
-
-                triple referencePosition1{}, referencePosition2{}, referenceCurrentPosition{};
-				
-                if (simulator->allObjects[i]->referenceObject != nullptr)
-                {
-                    auto* ref = simulator->allObjects[i]->referenceObject;
-                    size_t refIdx =
-                        std::distance(simulator->allObjects.begin(),
-                            std::find(simulator->allObjects.begin(),
-                                simulator->allObjects.end(), ref));
-
-                    referencePosition1 = ref->pastPositions[j];
-                    referencePosition2 =
-                        (j == lastIndex - 1)
-                        ? frozenPositions[refIdx]
-                        : ref->pastPositions[j + 1];
-
-                    /* FIX 3: frozen reference current */
-                    referenceCurrentPosition = frozenPositions[refIdx];
-                }
-                else{
-                    referencePosition1 = triple(0, 0, 0);
-                    referencePosition2 = triple(0, 0, 0);
-                }
-
-                double objX1, objY1, objZ1;
-                double objX2, objY2, objZ2;
-
-                if (simulator->selectedObject == nullptr)
-                {
-                    objX1 = pastPosition1.x - referencePosition1.x + referenceCurrentPosition.x;
-                    objY1 = pastPosition1.y - referencePosition1.y + referenceCurrentPosition.y;
-                    objZ1 = pastPosition1.z - referencePosition1.z + referenceCurrentPosition.z;
-
-                    objX2 = pastPosition2.x - referencePosition2.x + referenceCurrentPosition.x;
-                    objY2 = pastPosition2.y - referencePosition2.y + referenceCurrentPosition.y;
-                    objZ2 = pastPosition2.z - referencePosition2.z + referenceCurrentPosition.z;
-                }
-                else
+                triple pastPosition1 = trail[j];
+                triple pastPosition2 = (j == lastIndex - 1) ? currentPosition : trail[j + 1];
+                triple referencePosition1{}, referencePosition2{};
+                if (ref != nullptr)
                 {
-                    objX1 = pastPosition1.x - referencePosition1.x + referenceCurrentPosition.x - frozenSelectedPos.x;
-                    objY1 = pastPosition1.y - referencePosition1.y + referenceCurrentPosition.y - frozenSelectedPos.y;
-                    objZ1 = pastPosition1.z - referencePosition1.z + referenceCurrentPosition.z - frozenSelectedPos.z;
-
-                    objX2 = pastPosition2.x - referencePosition2.x + referenceCurrentPosition.x - frozenSelectedPos.x;
-                    objY2 = pastPosition2.y - referencePosition2.y + referenceCurrentPosition.y - frozenSelectedPos.y;
-                    objZ2 = pastPosition2.z - referencePosition2.z + referenceCurrentPosition.z - frozenSelectedPos.z;
+                    referencePosition1 = referenceTrail[j];
+                    referencePosition2 = (j == lastIndex - 1) ? referenceCurrentPosition : referenceTrail[j + 1];
                 }
 
-                double cosZ = cos(simulator->cameraRotationY);
-                double sinZ = sin(simulator->cameraRotationY);
-
-                double tempX1 = objX1 * cosZ - objY1 * sinZ;
-                double tempY1 = objX1 * sinZ + objY1 * cosZ;
-                double tempX2 = objX2 * cosZ - objY2 * sinZ;
-                double tempY2 = objX2 * sinZ + objY2 * cosZ;
-
-                float cosX = cos(simulator->cameraRotationX);
-                float sinX = sin(simulator->cameraRotationX);
-
-                float finalZ1 = tempY1 * sinX + objZ1 * cosX + centre[1] * scrHeight;
-                float finalX1 = tempX1 + centre[0] * scrHeight;
-                float finalZ2 = tempY2 * sinX + objZ2 * cosX + centre[1] * scrHeight;
-                float finalX2 = tempX2 + centre[0] * scrHeight;
-
-                float dx = finalX2 - finalX1;
-                float dz = finalZ2 - finalZ1;
-                float len = std::sqrt(dx * dx + dz * dz);
-                if (len > 0.0001f) { dx /= len; dz /= len; }
-
-                float px = -dz * _va1l;
-                float pz = dx * _va1l;
-
-                positions3.insert(positions3.end(), {
-                    (finalX1 + px) * screenHeightInv, (finalZ1 + pz) * screenHeightInv, 0, 0,
-                    (finalX1 - px) * screenHeightInv, (finalZ1 - pz) * screenHeightInv, 1, 0,
-                    (finalX2 - px) * screenHeightInv, (finalZ2 - pz) * screenHeightInv, 1, 1,
-                    (finalX2 + px) * screenHeightInv, (finalZ2 + pz) * screenHeightInv, 0, 1,
-                    });
+                double x1, z1, x2, z2;
+                ProjectTrailPoint(pastPosition1 - referencePosition1 + referenceCurrentPosition - frozenSelectedPos, cosZ, sinZ, cosX, sinX, x1, z1);
+                ProjectTrailPoint(pastPosition2 - referencePosition2 + referenceCurrentPosition - frozenSelectedPos, cosZ, sinZ, cosX, sinX, x2, z2);
+                positions3.resize(positions3.size() + 16);
+                TrailQuad(&positions3[positions3.size() - 16], x1 + centre[0] * scrHeight, z1 + centre[1] * scrHeight,
+                    x2 + centre[0] * scrHeight, z2 + centre[1] * scrHeight, _va1l, screenHeightInv);
 
                 indexBuffer.insert(indexBuffer.end(), {
                     baseIndex + j * 4, baseIndex + j * 4 + 1, baseIndex + j * 4 + 2,
@@ -914,6 +921,12 @@ void renderer::renderTrailsLines(GravitySimulator* simulator, Shader& shader)
         }
     }
 
+    // Drop the geometry of objects that have left the simulation
+    if (trailGeometry.size() > world.Count()) {
+        std::erase_if(trailGeometry, [&world](const auto& entry) { return world.IndexOf(entry.first) < 0; });
+    }
+
+    setMVPMatrix(shader);
     VertexArray va;
     VertexBuffer vb(positions3.data(), positions3.size() * sizeof(float));
     VertexBufferLayout layout;
@@ -925,8 +938,81 @@ void renderer::renderTrailsLines(GravitySimulator* simulator, Shader& shader)
     Draw(va, ib, shader, window);
 }
 
+void renderer::updateTrailGeometry(TrailGeometry& geometry, const TrailRing& stored, float halfWidth)
+{
+    const float screenHeightInv = 1.0f / scrHeight;
+    const double cosZ = cos(linkedSim->cameraRotationY);
+    const double sinZ = sin(linkedSim->cameraRotationY);
+    const float cosX = cos(linkedSim->cameraRotationX);
+    const float sinX = sin(linkedSim->cameraRotationX);
+    const uint64_t start = stored.GetStartSerial(), end = stored.GetEndSerial();
+
+    // The vertices are floats measured from the anchor, a few parts in 10^8 of the distance off; the trail is
+    // measured from its newest point again before that reaches a tenth of a pixel there
+    const bool drifted = (stored.back() - geometry.anchor).magnitude() > 1e6 * linkedSim->zoomLevel;
+    const bool rebuild = !geometry.vb || geometry.capacity != stored.GetCapacity() || geometry.generation != stored.GetGeneration()
+        || geometry.endSerial > end || geometry.rotationX != linkedSim->cameraRotationX || geometry.rotationY != linkedSim->cameraRotationY
+        || geometry.halfWidth != halfWidth || geometry.height != scrHeight || drifted;
+
+    if (!geometry.vb || geometry.capacity != stored.GetCapacity()) {
+        geometry.capacity = stored.GetCapacity();
+        geometry.vb = std::make_unique<VertexBuffer>((unsigned int)(geometry.capacity * 16 * sizeof(float)));
+        geometry.va = std::make_unique<VertexArray>();
+        VertexBufferLayout layout;
+        layout.Push<float>(2);
+        layout.Push<float>(2);
+        geometry.va->AddBuffer(*geometry.vb, layout);
+    }
+    if (geometry.capacity > trailIndexCapacity) {
+        std::vector<unsigned int> indices(geometry.capacity * 6);
+        for (unsigned int k = 0; k < geometry.capacity; k++)
+        {
+            const unsigned int base = k * 4;
+            const unsigned int quad[6] = { base, base + 1, base + 2, base + 2, base + 3, base };
+            std::copy(quad, quad + 6, indices.begin() + k * 6);
+        }
+        trailIndices = std::make_unique<IndexBuffer>(indices.data(), (unsigned int)indices.size());
+        trailIndexCapacity = geometry.capacity;
+    }
+
+    // The quads of points stored since the last update, and of the one before them if the newest point has moved
+    uint64_t first = start;
+    if (rebuild) {
+        geometry.anchor = stored.back();
+    }
+    else {
+        const uint64_t back = geometry.moves != stored.GetMoves() ? 2 : 1;
+        if (geometry.endSerial >= start + back)
+            first = geometry.endSerial - back;
+    }
+    const size_t count = end - 1 > first ? (size_t)(end - 1 - first) : 0;
+    trailUpload.resize(count * 16);
+    for (size_t k = 0; k < count; k++)
+    {
+        const size_t index = (size_t)(first + k - start);
+        double x1, z1, x2, z2;
+        ProjectTrailPoint(stored[index] - geometry.anchor, cosZ, sinZ, cosX, sinX, x1, z1);
+        ProjectTrailPoint(stored[index + 1] - geometry.anchor, cosZ, sinZ, cosX, sinX, x2, z2);
+        TrailQuad(&trailUpload[k * 16], x1, z1, x2, z2, halfWidth, screenHeightInv);
+    }
+    for (size_t done = 0; done < count;)
+    {
+        const size_t slot = (size_t)((first + done) % geometry.capacity);
+        const size_t run = std::min(count - done, geometry.capacity - slot);
+        geometry.vb->Update(&trailUpload[done * 16], (unsigned int)(slot * 16 * sizeof(float)), (unsigned int)(run * 16 * sizeof(float)));
+        done += run;
+    }
+
+    geometry.generation = stored.GetGeneration();
+    geometry.endSerial = end;
+    geometry.moves = stored.GetMoves();
+    geometry.rotationX = linkedSim->cameraRotationX;
+    geometry.rotationY = linkedSim->cameraRotationY;
+    geometry.halfWidth = halfWidth;
+    geometry.height = scrHeight;
+}
 
-void renderer::renderExternalForces(GravitySimulator* simulator, Shader& shader)
+void renderer::renderExternalForces(GravitySimulator* simulator, const WorldSnapshot& world, Shader& shader)
 {
     float screenHeightInv = 1.0f / scrHeight;
     indexBuffer.clear();
@@ -944,20 +1030,22 @@ void renderer::renderExternalForces(GravitySimulator* simulator, Shader& shader)
     const float worldUnitsPerPixel = (simulator->zoomLevel);
 
 
-    for (unsigned int i = 0; i < simulator->allObjects.size(); i++)
+    for (unsigned int i = 0; i < world.Count(); i++)
     {
-        triple pos = simulator->allObjects[i]->p;
-        triple force = simulator->allObjects[i]->ExternalForces; // total external force
+        triple pos = world.positions[i];
+        triple force = world.externalForces[i]; // total external force
 
         // Optional: subtract reference object position (keep original behaviour)
-        if (simulator->selectedObject != nullptr && simulator->selectedObject->referenceObject != nullptr)
+        if (world.selectedIndex >= 0 && world.referenceIndices[world.selectedIndex] >= 0)
         {
-            pos.x -= simulator->selectedObject->referenceObject->p.x;
-            pos.y -= simulator->selectedObject->referenceObject->p.y;
-            pos.z -= simulator->selectedObject->referenceObject->p.z;
-            pos.x -= simulator->selectedObject->p.x - simulator->selectedObject->referenceObject->p.x;
-            pos.y -= simulator->selectedObject->p.y - simulator->selectedObject->referenceObject->p.y;
-            pos.z -= simulator->selectedObject->p.z - simulator->selectedObject->referenceObject->p.z;
+            const triple selectedPosition = world.positions[world.selectedIndex];
+            const triple referencePosition = world.positions[world.referenceIndices[world.selectedIndex]];
+            pos.x -= referencePosition.x;
+            pos.y -= referencePosition.y;
+            pos.z -= referencePosition.z;
+            pos.x -= selectedPosition.x - referencePosition.x;
+            pos.y -= selectedPosition.y - referencePosition.y;
+            pos.z -= selectedPosition.z - referencePosition.z;
         }
 
         // Map force magnitude -> desired pixel length (clamped)
@@ -1110,53 +1198,32 @@ void renderer::key_callback(GLFWwindow* window, int key, int scancode, int actio
     {
         instance->missionData = !instance->missionData;
     }
+    // Changes to the simulation are queued for the simulation thread, which applies them between frames
     if (key == GLFW_KEY_TAB && action == GLFW_PRESS)
     {
-        if (mods & GLFW_MOD_SHIFT) { // Check if SHIFT is pressed
-            // Decrease the index and wrap around
-            instance->linkedSim->selectedObjectIndex -= 1;
-            if (instance->linkedSim->selectedObjectIndex < 0) {
-                instance->linkedSim->selectedObjectIndex = instance->linkedSim->allObjects.size() - 1;
-            }
-            instance->selectedObjectIndex2 = (int)std::distance(instance->linkedSim->allObjects.begin(), std::find(instance->linkedSim->allObjects.begin(), instance->linkedSim->allObjects.end(), instance->linkedSim->selectedObject->referenceObject));
-            if (instance->selectedObjectIndex2 >= instance->linkedSim->allObjects.size()) {
-                instance->selectedObjectIndex2 = 0;
-            }
-        }
-        else {
-            // Increase the index and wrap around
-            instance->linkedSim->selectedObjectIndex += 1;
-            if (instance->linkedSim->selectedObjectIndex >= instance->linkedSim->allObjects.size()) {
-                instance->linkedSim->selectedObjectIndex = 0;
-            }
-            instance->selectedObjectIndex2 = (int)std::distance(instance->linkedSim->allObjects.begin(), std::find(instance->linkedSim->allObjects.begin(), instance->linkedSim->allObjects.end(), instance->linkedSim->selectedObject->referenceObject));
-            if (instance->selectedObjectIndex2 >= instance->linkedSim->allObjects.size()) {
-                instance->selectedObjectIndex2 = 0;
-            }
-        }
-        instance->linkedSim->selectedObject = instance->linkedSim->allObjects[instance->linkedSim->selectedObjectIndex];
+        // SHIFT + TAB steps back, wrapping around
+        instance->linkedSim->Post(SimulatorCommand::Make(SimulatorCommandType::SelectNext, (mods & GLFW_MOD_SHIFT) ? -1 : 1));
     }
     if (key == GLFW_KEY_PERIOD && action == GLFW_PRESS)
     {
-        instance->linkedSim->timeWarp = instance->linkedSim->timeWarp * 2.0f;
+        instance->linkedSim->Post(SimulatorCommand::Make(SimulatorCommandType::ScaleTimeWarp, 2.0));
     }
     if (key == GLFW_KEY_COMMA && action == GLFW_PRESS)
     {
-        instance->linkedSim->timeWarp = instance->linkedSim->timeWarp / 2.0f;
-        if (instance->linkedSim->timeWarp < 0.01f) instance->linkedSim->timeWarp = 0.01f;
+        instance->linkedSim->Post(SimulatorCommand::Make(SimulatorCommandType::ScaleTimeWarp, 0.5));
     }
+    // With the adaptive integrator the brackets tighten or loosen its tolerance instead of changing the substeps
     if (key == GLFW_KEY_RIGHT_BRACKET && action == GLFW_PRESS)
     {
-        instance->linkedSim->substeps = instance->linkedSim->substeps * 2;
+        instance->linkedSim->Post(SimulatorCommand::Make(SimulatorCommandType::ScaleSubsteps, 2.0));
     }
     if (key == GLFW_KEY_LEFT_BRACKET && action == GLFW_PRESS)
     {
-        instance->linkedSim->substeps = instance->linkedSim->substeps / 2;
-        if (instance->linkedSim->substeps < 1) instance->linkedSim->substeps = 1;
+        instance->linkedSim->Post(SimulatorCommand::Make(SimulatorCommandType::ScaleSubsteps, 0.5));
     }
     if (key == GLFW_KEY_SLASH && action == GLFW_PRESS)
     {
-        instance->linkedSim->timeWarp = 1;
+        instance->linkedSim->Post(SimulatorCommand::Make(SimulatorCommandType::SetTimeWarp, 1.0));
     }
     if (key == GLFW_KEY_T && action == GLFW_PRESS)
     {
@@ -1183,7 +1250,7 @@ void renderer::key_callback(GLFWwindow* window, int key, int scancode, int actio
     }
     if (key == GLFW_KEY_P && action == GLFW_PRESS)
     {
-        instance->linkedSim->paused = !instance->linkedSim->paused;
+        instance->linkedSim->Post(SimulatorCommand::Make(SimulatorCommandType::TogglePause));
     }
 
     
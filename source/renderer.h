@@ -2,6 +2,8 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <chrono>
+#include <memory>
+#include <unordered_map>
 #include "VertexArray.h"
 #include "IndexBuffer.h"
 #include "Shader.h"
@@ -20,6 +22,20 @@ using timepoint = std::chrono::high_resolution_clock::time_point;
 using clock1 = std::chrono::high_resolution_clock;
 using duration = std::chrono::high_resolution_clock::duration;
 enum RenderingMethod { SingleThreading, MultiThreading };
+
+// One object's stored trail as line quads in its own vertex buffer, one slot per stored point in the order of the
+// TrailRing's serial numbers, so keeping it in step uploads only the quads that changed. The vertices are rotated
+// to the camera and measured from anchor; where the trail is drawn is left to the model matrix
+struct TrailGeometry {
+    std::unique_ptr<VertexBuffer> vb;
+    std::unique_ptr<VertexArray> va;
+    size_t capacity = 0;
+    uint64_t generation = 0, endSerial = 0, moves = 0;
+    triple anchor;
+    float rotationX = 0, rotationY = 0, halfWidth = 0;
+    int height = 0;
+};
+
 class renderer {
 public:
     GLFWwindow* window = nullptr;
@@ -53,6 +69,11 @@ public:
     bool missionData = false;
     int selectedObjectIndex = 0;
     int selectedObjectIndex2 = 0;
+    float postedTrailScale = 0; // zoomLevel last posted as the scale trails are simplified at
+    std::unordered_map<const PhysicsObject*, TrailGeometry> trailGeometry;
+    std::unique_ptr<IndexBuffer> trailIndices;  // Quads of every trail vertex buffer, as many as the largest holds
+    size_t trailIndexCapacity = 0;
+    std::vector<float> trailUpload;
     RenderingMethod renderingMethod = RenderingMethod::MultiThreading;
 
     renderer();
@@ -76,19 +97,21 @@ public:
 
     void linkSimulator(GravitySimulator* simulator);
 
-    void setMVPMatrix(Shader& shader);
+    void setMVPMatrix(Shader& shader, float modelX = 0.0f, float modelY = 0.0f);
 
     void setMVPMatrixNoZoom(Shader& shader);
 
-    void renderImGui(GravitySimulator* linkedSim);
+    void renderImGui(GravitySimulator* linkedSim, const WorldSnapshot& world);
 
-    void renderSimulatorObjects(GravitySimulator* simulator, Shader& shader);
+    void renderSimulatorObjects(GravitySimulator* simulator, const WorldSnapshot& world, Shader& shader);
 
     void renderTrails(GravitySimulator* simulator, Shader& shader);
 
-    void renderTrailsLines(GravitySimulator* simulator, Shader& shader);
+    void renderTrailsLines(GravitySimulator* simulator, const WorldSnapshot& world, Shader& shader);
+
+    void updateTrailGeometry(TrailGeometry& geometry, const TrailRing& stored, float halfWidth);
 
-    void renderExternalForces(GravitySimulator* simulator, Shader& shader);
+    void renderExternalForces(GravitySimulator* simulator, const WorldSnapshot& world, Shader& shader);
 
     void renderCircle(const Shader& shader);
 